@@ -0,0 +1,144 @@
+/* arena: cache-aligned allocation for the containers of cpp/common
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// AlignedAllocator gives std::vector buffers that start on a cache line,
+// so the rows of a Matrix (matrix.hpp) can be loaded with aligned vector
+// instructions. Arena hands out many small aligned pieces of a few large
+// blocks, freed all at once when the arena goes away, for containers
+// like PackedSequences (packed_sequences.hpp) that hold many small
+// arrays which live as long as the container.
+
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+#include <vector>
+
+static const size_t cache_line = 64;
+
+// n bytes aligned to align (a power of two, at least sizeof(void*))
+inline void *
+aligned_malloc(const size_t n, const size_t align = cache_line) {
+  void *p = 0;
+  if (posix_memalign(&p, align, n ? n : align) != 0)
+    throw std::bad_alloc();
+  return p;
+}
+
+template <typename T>
+struct AlignedAllocator {
+  typedef T value_type;
+
+  AlignedAllocator() {}
+  template <typename U>
+  AlignedAllocator(const AlignedAllocator<U> &) {}
+
+  T *allocate(const size_t n) {
+    return static_cast<T*>(aligned_malloc(n*sizeof(T)));
+  }
+  void deallocate(T *p, size_t) {free(p);}
+};
+
+template <typename T, typename U>
+inline bool
+operator==(const AlignedAllocator<T> &, const AlignedAllocator<U> &) {
+  return true;
+}
+
+template <typename T, typename U>
+inline bool
+operator!=(const AlignedAllocator<T> &, const AlignedAllocator<U> &) {
+  return false;
+}
+
+// Bump allocator over blocks of at least block_size bytes. Pieces are
+// never freed on their own and never move, so pointers into an arena
+// stay valid until it is destroyed. Arenas can be moved, not copied.
+class Arena {
+public:
+  static const size_t block_size = size_t(1) << 20;
+
+  Arena() : cur(0), left(0), total(0) {}
+  ~Arena() {
+    for (size_t i = 0; i < blocks.size(); ++i)
+      free(blocks[i]);
+  }
+
+  Arena(Arena &&other) :
+    blocks(std::move(other.blocks)), cur(other.cur), left(other.left),
+    total(other.total) {
+    other.blocks.clear();
+    other.cur = 0;
+    other.left = other.total = 0;
+  }
+  // the blocks of this arena go to other, to be freed with it
+  Arena &operator=(Arena &&other) {
+    std::swap(blocks, other.blocks);
+    std::swap(cur, other.cur);
+    std::swap(left, other.left);
+    std::swap(total, other.total);
+    return *this;
+  }
+
+  // n zeroed bytes aligned to align (a power of two, at most cache_line)
+  void *allocate(const size_t n, const size_t align = cache_line) {
+    const size_t pad = (align - reinterpret_cast<size_t>(cur) % align) % align;
+    if (cur == 0 || pad + n > left) {
+      const size_t size = (n > block_size) ? n : block_size;
+      blocks.push_back(static_cast<char*>(aligned_malloc(size)));
+      cur = blocks.back();
+      left = size;
+      total += size;
+      return take(0, n);
+    }
+    return take(pad, n);
+  }
+
+  // n zeroed T, packed after the last piece rather than on a cache line
+  template <typename T>
+  T *allocate_array(const size_t n) {
+    return static_cast<T*>(allocate(n*sizeof(T), alignof(T)));
+  }
+
+  // bytes taken from the system
+  size_t size() const {return total;}
+
+private:
+  std::vector<char*> blocks;
+  char *cur;
+  size_t left;
+  size_t total;
+
+  void *take(const size_t pad, const size_t n) {
+    char *p = cur + pad;
+    std::fill(p, p + n, 0);
+    cur = p + n;
+    left -= pad + n;
+    return p;
+  }
+
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+};
+
+#endif
@@ -0,0 +1,157 @@
+/* bench_report: per-phase timings of tsne and gmm for benchmarks
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// When the BENCH_REPORT variable names a file, a program appends to it
+// one CSV line per phase it timed:
+//
+//   program,threads,n_rows,n_cols,phase,calls,seconds,items_per_second,
+//   max_rss_kb
+//
+// seconds adds up all calls of the phase, over all threads when they
+// run in parallel, and items are what the phase works through (rows
+// parsed, points of a gradient, ...). max_rss_kb is the peak resident
+// memory of the whole run. The header line is written when the file is
+// new, so runs with several thread counts go into the same report.
+// Without the variable, phases are only collected after collect(), to
+// be printed with print().
+
+#ifndef BENCH_REPORT_HPP
+#define BENCH_REPORT_HPP
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+class BenchReport {
+public:
+  explicit BenchReport(const std::string &program) :
+    program(program), n_rows(0), n_cols(0), active(false) {
+    const char *f = std::getenv("BENCH_REPORT");
+    if (f) {
+      filename = f;
+      active = true;
+    }
+  }
+
+  bool enabled() const {return active;}
+  void collect() {active = true;}
+
+  void set_size(const size_t r, const size_t c) {
+    n_rows = r;
+    n_cols = c;
+  }
+
+  // adds one call of the phase, safe to call from several threads
+  void add(const std::string &phase, const double seconds,
+           const size_t items) {
+    if (!enabled())
+      return;
+    std::lock_guard<std::mutex> lock(mtx);
+    size_t i = 0;
+    while (i < phases.size() && phases[i].name != phase)
+      ++i;
+    if (i == phases.size())
+      phases.push_back(Phase(phase));
+    phases[i].calls++;
+    phases[i].seconds += seconds;
+    phases[i].items += items;
+  }
+
+  // one line per phase, as tsne prints with -v
+  void print(std::ostream &out) const {
+    for (size_t i = 0; i < phases.size(); ++i) {
+      const Phase &p = phases[i];
+      out << "phase=" << p.name << "\tcalls=" << p.calls
+          << "\tseconds=" << p.seconds << "\n";
+    }
+  }
+
+  // appends the phases, in the order they were first timed
+  void write() const {
+    if (filename.empty())
+      return;
+    const bool is_new = !std::ifstream(filename.c_str());
+    std::ofstream out(filename.c_str(), std::ios::app);
+    if (is_new)
+      out << "program,threads,n_rows,n_cols,phase,calls,seconds,"
+          << "items_per_second,max_rss_kb\n";
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    for (size_t i = 0; i < phases.size(); ++i) {
+      const Phase &p = phases[i];
+      out << program << ',' << threads << ',' << n_rows << ',' << n_cols
+          << ',' << p.name << ',' << p.calls << ',' << p.seconds << ','
+          << (p.seconds > 0 ? p.items/p.seconds : 0.0) << ','
+          << usage.ru_maxrss << '\n';
+    }
+  }
+
+  static double now() {
+    return std::chrono::duration<double>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+private:
+  struct Phase {
+    std::string name;
+    size_t calls;
+    double seconds;
+    double items;
+    explicit Phase(const std::string &n) :
+      name(n), calls(0), seconds(0.0), items(0.0) {}
+  };
+
+  std::string program;
+  std::string filename;
+  size_t n_rows, n_cols;
+  bool active;
+  std::vector<Phase> phases;
+  std::mutex mtx;
+};
+
+// Adds the time from its construction to its destruction to a phase
+class PhaseTimer {
+public:
+  PhaseTimer(BenchReport &r, const std::string &phase,
+             const size_t items) :
+    report(r), phase(phase), items(items), start(BenchReport::now()) {}
+  ~PhaseTimer() {report.add(phase, BenchReport::now() - start, items);}
+
+private:
+  BenchReport &report;
+  std::string phase;
+  size_t items;
+  double start;
+};
+
+#endif
@@ -0,0 +1,151 @@
+/* binary_matrix: binary matrix files that can be mapped with mmap
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// A matrix of doubles in native byte order after a 64 byte header:
+//
+//   char     magic[8]     "MTXBIN01"
+//   uint64_t n_rows
+//   uint64_t n_cols
+//   uint64_t layout       0 for row-major, 1 for column-major
+//   uint64_t reserved[4]  0
+//   double   data[n_rows * n_cols]
+//
+// The text matrices of tsne and gmm (a line with the number of rows and
+// columns, then the rows) are converted with mtx2bin. A row-major file
+// is used in place from the mapping, without copying or parsing.
+
+#ifndef BINARY_MATRIX_HPP
+#define BINARY_MATRIX_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct BinaryMatrixHeader {
+  char magic[8];
+  uint64_t n_rows;
+  uint64_t n_cols;
+  uint64_t layout;
+  uint64_t reserved[4];
+};
+
+static const char binary_matrix_magic[8] =
+  {'M', 'T', 'X', 'B', 'I', 'N', '0', '1'};
+
+enum MatrixLayout {row_major = 0, col_major = 1};
+
+// true if the file starts with the magic of a binary matrix
+inline bool
+is_binary_matrix(const std::string &filename) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char magic[sizeof(binary_matrix_magic)];
+  return in.read(magic, sizeof(magic)) &&
+    memcmp(magic, binary_matrix_magic, sizeof(magic)) == 0;
+}
+
+// Writes the header of an n_rows x n_cols matrix, to be followed by
+// n_rows * n_cols doubles in the given layout
+inline void
+write_binary_matrix_header(std::ostream &out, const size_t n_rows,
+                           const size_t n_cols, const MatrixLayout layout) {
+  BinaryMatrixHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, binary_matrix_magic, sizeof(h.magic));
+  h.n_rows = n_rows;
+  h.n_cols = n_cols;
+  h.layout = layout;
+  out.write(reinterpret_cast<const char*>(&h), sizeof(h));
+}
+
+// Maps a binary matrix file. rows() is the matrix in row-major order:
+// the mapping itself for a row-major file, or a transposed copy for a
+// column-major one
+class BinaryMatrix {
+public:
+  explicit BinaryMatrix(const std::string &filename) : map(0), map_size(0) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw std::runtime_error("could not open file: " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0 ||
+        size_t(st.st_size) < sizeof(BinaryMatrixHeader)) {
+      close(fd);
+      throw std::runtime_error("malformatted matrix file: " + filename);
+    }
+    map_size = st.st_size;
+    map = mmap(0, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      map = 0;
+      throw std::runtime_error("could not map matrix file: " + filename);
+    }
+
+    memcpy(&header, map, sizeof(header));
+    if (memcmp(header.magic, binary_matrix_magic, sizeof(header.magic)) ||
+        header.layout > col_major || map_size != sizeof(header) +
+        header.n_rows*header.n_cols*sizeof(double)) {
+      munmap(map, map_size);
+      throw std::runtime_error("malformatted matrix file: " + filename);
+    }
+
+    const double *data = reinterpret_cast<const double*>(
+      static_cast<const char*>(map) + sizeof(header));
+    if (header.layout == row_major)
+      row_data = data;
+    else {
+      transposed.resize(header.n_rows*header.n_cols);
+      for (size_t j = 0; j < header.n_cols; ++j)
+        for (size_t i = 0; i < header.n_rows; ++i)
+          transposed[i*header.n_cols + j] = data[j*header.n_rows + i];
+      row_data = transposed.data();
+    }
+  }
+
+  ~BinaryMatrix() {
+    if (map)
+      munmap(map, map_size);
+  }
+
+  size_t n_rows() const {return header.n_rows;}
+  size_t n_cols() const {return header.n_cols;}
+  const double *rows() const {return row_data;}
+  const double *operator[](const size_t i) const {
+    return row_data + i*header.n_cols;
+  }
+
+private:
+  BinaryMatrixHeader header;
+  void *map;
+  size_t map_size;
+  const double *row_data;
+  std::vector<double> transposed;
+
+  BinaryMatrix(const BinaryMatrix &);
+  BinaryMatrix &operator=(const BinaryMatrix &);
+};
+
+#endif
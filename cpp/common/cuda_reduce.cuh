@@ -0,0 +1,66 @@
+/* cuda_reduce: sums over the threads of a block, for the GPU kernels of
+ * tsne and gmm
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// The partial sums of the threads are added as a tree of fixed shape,
+// never with atomics, so a kernel gives the same result on every run, as
+// the openmp loops on the host do whatever the number of threads.
+// Every kernel that calls block_sum has to be launched with block_size
+// threads, and all of them have to call it.
+
+#ifndef CUDA_REDUCE_CUH
+#define CUDA_REDUCE_CUH
+
+#include <cuda_runtime.h>
+
+#include <cstddef>
+
+// Threads of every block, a power of two
+static const unsigned block_size = 256;
+
+__device__ static double
+block_sum(const double x) {
+  __shared__ double partial[block_size];
+  const unsigned t = threadIdx.x;
+  partial[t] = x;
+  __syncthreads();
+  for (unsigned s = block_size/2; s > 0; s >>= 1) {
+    if (t < s)
+      partial[t] += partial[t + s];
+    __syncthreads();
+  }
+  const double ans = partial[0];
+  __syncthreads();
+  return ans;
+}
+
+// out[0] is the sum of the first n entries of x, or of their squares.
+// Launched as a single block
+__global__ static void
+sum_kernel(const double *x, const size_t n, const bool squares,
+           double *out) {
+  double ans = 0.0;
+  for (size_t e = threadIdx.x; e < n; e += block_size)
+    ans += squares ? x[e]*x[e] : x[e];
+  ans = block_sum(ans);
+  if (threadIdx.x == 0)
+    out[0] = ans;
+}
+
+#endif
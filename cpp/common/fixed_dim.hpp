@@ -0,0 +1,56 @@
+/* fixed_dim: kernels over rows whose length is known at compile time
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// The loops over the entries of a row take the number of entries as a
+// template argument Dim, so the compiler can unroll them for the common
+// dimensions (2 and 3 for the embeddings of tsne, 10, 20 or 50 principal
+// components for gmm). Dim = 0 is the fallback, with the number of
+// entries given at run time. A function templated on Dim is called
+// through a switch over the dimensions it was instantiated for, once per
+// call of the whole kernel rather than per row.
+
+#ifndef FIXED_DIM_HPP
+#define FIXED_DIM_HPP
+
+#include <cstddef>
+
+// The number of entries of a row: Dim, or n when Dim is 0
+template <size_t Dim>
+inline size_t
+fixed_dim(const size_t n) {
+  return Dim ? Dim : n;
+}
+
+// Square Euclidean distance between two rows of n entries
+template <size_t Dim>
+inline double
+sq_dist(const double *a, const double *b, const size_t n) {
+  const size_t d = fixed_dim<Dim>(n);
+  double ans = 0.0;
+#ifdef _OPENMP
+#pragma omp simd reduction(+:ans)
+#endif
+  for (size_t i = 0; i < d; ++i) {
+    const double diff = a[i] - b[i];
+    ans += diff*diff;
+  }
+  return ans;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/* matrix: dense row-major matrices shared by tsne and gmm
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef MATRIX_HPP
+#define MATRIX_HPP
+
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+#include "arena.hpp"
+
+// Dense row-major matrix in one contiguous buffer that starts on a cache
+// line. m[i] points to the first entry of row i, so entries are read as
+// m[i][j]. Matrices are large, so they are moved and never copied by
+// accident: copy() makes a copy when one is needed.
+struct Matrix {
+  size_t n_rows;
+  size_t n_cols;
+  std::vector<double, AlignedAllocator<double> > data;
+
+  Matrix() : n_rows(0), n_cols(0) {}
+  Matrix(const size_t r, const size_t c, const double x = 0.0) :
+    n_rows(r), n_cols(c), data(r*c, x) {}
+
+  Matrix(Matrix &&other) :
+    n_rows(other.n_rows), n_cols(other.n_cols),
+    data(std::move(other.data)) {
+    other.n_rows = other.n_cols = 0;
+  }
+  Matrix &operator=(Matrix &&other) {
+    std::swap(n_rows, other.n_rows);
+    std::swap(n_cols, other.n_cols);
+    data.swap(other.data);
+    return *this;
+  }
+
+  Matrix copy() const {
+    Matrix m;
+    m.n_rows = n_rows;
+    m.n_cols = n_cols;
+    m.data = data;
+    return m;
+  }
+
+  double *operator[](const size_t i) {return &data[i*n_cols];}
+  const double *operator[](const size_t i) const {return &data[i*n_cols];}
+
+private:
+  Matrix(const Matrix &);
+  Matrix &operator=(const Matrix &);
+};
+
+// Read-only row-major matrix stored elsewhere, in a Matrix or in a
+// mapped binary matrix file (binary_matrix.hpp)
+struct MatrixView {
+  const double *data;
+  size_t n_rows;
+  size_t n_cols;
+
+  MatrixView(const double *d, const size_t r, const size_t c) :
+    data(d), n_rows(r), n_cols(c) {}
+  MatrixView(const Matrix &m) :
+    data(m.data.data()), n_rows(m.n_rows), n_cols(m.n_cols) {}
+
+  const double *operator[](const size_t i) const {return data + i*n_cols;}
+};
+
+#endif
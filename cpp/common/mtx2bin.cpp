@@ -0,0 +1,113 @@
+/* mtx2bin: converts a text matrix to the binary matrix format
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "binary_matrix.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <unistd.h>
+
+using std::vector;
+using std::string;
+using std::cerr;
+using std::endl;
+
+static void
+usage(const char *prog) {
+  cerr << "usage: " << prog << " [-c] [-r rest.txt] <matrix.txt> <matrix.bin>"
+       << endl
+       << "  -c  write the matrix in column-major order "
+       << "(default: row-major)" << endl
+       << "  -r  copy whatever follows the matrix in the input "
+       << "(e.g. the k-means" << endl
+       << "      assignments of a gmm input) to this file" << endl;
+}
+
+int
+main(int argc, char **argv) {
+  try {
+    MatrixLayout layout = row_major;
+    string rest_file;
+    int c;
+    while ((c = getopt(argc, argv, "cr:")) >= 0) {
+      if (c == 'c') layout = col_major;
+      else if (c == 'r') rest_file = optarg;
+      else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    if (argc - optind != 2) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    const string infile(argv[optind]), outfile(argv[optind + 1]);
+
+    std::ifstream in(infile.c_str());
+    size_t n_rows, n_cols;
+    if (!(in >> n_rows >> n_cols))
+      throw std::runtime_error("could not read matrix size: " + infile);
+
+    std::ofstream out(outfile.c_str(), std::ios::binary);
+    if (!out)
+      throw std::runtime_error("could not open file: " + outfile);
+    write_binary_matrix_header(out, n_rows, n_cols, layout);
+
+    // rows are written as they are read
+    vector<double> row(n_cols), all;
+    if (layout == col_major)
+      all.resize(n_rows*n_cols);
+    for (size_t i = 0; i < n_rows; ++i) {
+      for (size_t j = 0; j < n_cols; ++j)
+        if (!(in >> row[j]))
+          throw std::runtime_error("matrix ends early: " + infile);
+      if (layout == row_major)
+        out.write(reinterpret_cast<const char*>(row.data()),
+                  n_cols*sizeof(double));
+      else
+        for (size_t j = 0; j < n_cols; ++j)
+          all[j*n_rows + i] = row[j];
+    }
+    if (layout == col_major)
+      out.write(reinterpret_cast<const char*>(all.data()),
+                all.size()*sizeof(double));
+    if (!out)
+      throw std::runtime_error("could not write file: " + outfile);
+
+    if (!rest_file.empty()) {
+      std::ofstream rest(rest_file.c_str());
+      if (!rest)
+        throw std::runtime_error("could not open file: " + rest_file);
+      // skip the end of the last row of the matrix
+      string line;
+      getline(in, line);
+      if (line.find_first_not_of(" \t\r") != string::npos)
+        rest << line << '\n';
+      rest << in.rdbuf();
+    }
+  }
+  catch (std::exception &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
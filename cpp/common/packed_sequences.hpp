@@ -0,0 +1,111 @@
+/* packed_sequences: DNA sequences at 2 bits per base
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef PACKED_SEQUENCES_HPP
+#define PACKED_SEQUENCES_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "arena.hpp"
+
+// Nucleotide encoding as in seq_nt4_table of ksw.c: A, C, G and T (either
+// case) map to 0-3 and everything else to 4 (N)
+static const size_t nt4_size = 5;
+static const unsigned char nt4_n = 4;
+
+struct Nt4Table {
+  unsigned char code[256];
+
+  Nt4Table() {
+    for (size_t c = 0; c < 256; ++c)
+      code[c] = nt4_n;
+    code['A'] = code['a'] = 0;
+    code['C'] = code['c'] = 1;
+    code['G'] = code['g'] = 2;
+    code['T'] = code['t'] = 3;
+  }
+
+  unsigned char operator[](const unsigned char c) const {return code[c];}
+};
+
+static const Nt4Table nt4_table;
+
+// A sequence packed at 2 bits per base, 32 bases per word, with a
+// separate bit mask for the positions that are not A, C, G or T. The
+// words belong to the PackedSequences it came from.
+class PackedSequence {
+public:
+  PackedSequence() : bits(0), n_mask(0), len(0) {}
+  PackedSequence(const uint64_t *b, const uint64_t *m, const size_t l) :
+    bits(b), n_mask(m), len(l) {}
+
+  size_t size() const {return len;}
+  bool empty() const {return len == 0;}
+
+  // nt4 code of position i
+  unsigned char code(const size_t i) const {
+    if ((n_mask[i >> 6] >> (i & 63)) & 1)
+      return nt4_n;
+    return (bits[i >> 5] >> ((i & 31) << 1)) & 3;
+  }
+
+private:
+  const uint64_t *bits;
+  const uint64_t *n_mask;
+  size_t len;
+};
+
+// All the sequences of a file, packed into the blocks of an arena instead
+// of two small vectors each, so they are few allocations and mostly
+// consecutive in memory. Sequences never move once added.
+class PackedSequences {
+public:
+  PackedSequences() : n_bases(0) {}
+  PackedSequences(PackedSequences &&other) :
+    arena(std::move(other.arena)), n_bases(other.n_bases) {}
+
+  PackedSequence add(const std::string &seq) {
+    const size_t len = seq.size();
+    uint64_t *bits = arena.allocate_array<uint64_t>((len + 31)/32);
+    uint64_t *n_mask = arena.allocate_array<uint64_t>((len + 63)/64);
+    for (size_t i = 0; i < len; ++i) {
+      const unsigned char c = nt4_table[(unsigned char)seq[i]];
+      if (c == nt4_n)
+        n_mask[i >> 6] |= uint64_t(1) << (i & 63);
+      else
+        bits[i >> 5] |= uint64_t(c) << ((i & 31) << 1);
+    }
+    n_bases += len;
+    return PackedSequence(bits, n_mask, len);
+  }
+
+  size_t total_bases() const {return n_bases;}
+  size_t memory_bytes() const {return arena.size();}
+
+private:
+  Arena arena;
+  size_t n_bases;
+
+  PackedSequences(const PackedSequences &);
+  PackedSequences &operator=(const PackedSequences &);
+};
+
+#endif
@@ -0,0 +1,135 @@
+/* synth: synthetic inputs of tsne and gmm for benchmarks
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <utility>
+#include <stdexcept>
+#include <cstdlib>
+#include <unistd.h>
+
+using std::vector;
+using std::string;
+using std::cerr;
+using std::endl;
+
+static void
+usage(const char *prog) {
+  cerr << "usage: " << prog << " [-k clusters] [-s seed] [-a assign.txt] "
+       << "[-m max_k] <n_rows> <n_cols> <matrix.txt>" << endl
+       << "  -k  number of gaussian clusters of the rows (default: 10)"
+       << endl
+       << "  -s  seed of the random numbers (default: 1)" << endl
+       << "  -a  also write initial assignments of the rows for 1 to max_k"
+       << endl
+       << "      clusters, one line each, as gmm reads after its matrix"
+       << endl
+       << "  -m  max_k (default: 50)" << endl;
+}
+
+int
+main(int argc, char **argv) {
+  try {
+    size_t n_clusters = 10, max_k = 50;
+    unsigned seed = 1;
+    string assign_file;
+    int c;
+    while ((c = getopt(argc, argv, "k:s:a:m:")) >= 0) {
+      if (c == 'k') n_clusters = strtoul(optarg, 0, 10);
+      else if (c == 's') seed = strtoul(optarg, 0, 10);
+      else if (c == 'a') assign_file = optarg;
+      else if (c == 'm') max_k = strtoul(optarg, 0, 10);
+      else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    if (argc - optind != 3) {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+    const size_t n_rows = strtoul(argv[optind], 0, 10);
+    const size_t n_cols = strtoul(argv[optind + 1], 0, 10);
+    const string outfile(argv[optind + 2]);
+    if (n_rows == 0 || n_cols == 0 || n_clusters == 0)
+      throw std::runtime_error("the sizes must be positive");
+    if (!assign_file.empty() && max_k > n_rows)
+      throw std::runtime_error("max_k is larger than the number of rows");
+
+    // rows around cluster means uniform in [-10, 10], with unit variance
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> unif(-10.0, 10.0);
+    std::normal_distribution<double> noise(0.0, 1.0);
+    std::uniform_int_distribution<size_t> pick(0, n_clusters - 1);
+    vector<double> means(n_clusters*n_cols);
+    for (size_t i = 0; i < means.size(); ++i)
+      means[i] = unif(gen);
+    vector<double> x(n_rows*n_cols);
+    for (size_t i = 0; i < n_rows; ++i) {
+      const size_t k = pick(gen);
+      for (size_t j = 0; j < n_cols; ++j)
+        x[i*n_cols + j] = means[k*n_cols + j] + noise(gen);
+    }
+
+    std::ofstream out(outfile.c_str());
+    if (!out)
+      throw std::runtime_error("could not open file: " + outfile);
+    out.precision(8);
+    out << n_rows << '\t' << n_cols << '\n';
+    for (size_t i = 0; i < n_rows; ++i) {
+      for (size_t j = 0; j < n_cols; ++j)
+        out << (j ? "\t" : "") << x[i*n_cols + j];
+      out << '\n';
+    }
+    if (!out)
+      throw std::runtime_error("could not write file: " + outfile);
+
+    // the rows sorted by their sum and cut into k runs of about the same
+    // size, so no cluster is too small to have a covariance
+    if (!assign_file.empty()) {
+      std::ofstream a(assign_file.c_str());
+      if (!a)
+        throw std::runtime_error("could not open file: " + assign_file);
+      vector<std::pair<double, size_t> > order(n_rows);
+      for (size_t i = 0; i < n_rows; ++i) {
+        order[i] = std::make_pair(0.0, i);
+        for (size_t j = 0; j < n_cols; ++j)
+          order[i].first += x[i*n_cols + j];
+      }
+      std::sort(order.begin(), order.end());
+      vector<size_t> assignment(n_rows);
+      for (size_t k = 1; k <= max_k; ++k) {
+        for (size_t r = 0; r < n_rows; ++r)
+          assignment[order[r].second] = r*k/n_rows;
+        for (size_t i = 0; i < n_rows; ++i)
+          a << (i ? " " : "") << assignment[i];
+        a << '\n';
+      }
+    }
+  }
+  catch (std::exception &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/* thread_pool: a fixed set of threads that run one job at a time
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// For the programs that do not use openmp: the threads are started once
+// and each run() hands all of them the same job, with the index of the
+// worker, so a program that processes its input in batches does not
+// start new threads for every batch. How the work of a job is split
+// among the workers (a shared counter, per-worker queues, ...) is up to
+// the job.
+
+#ifndef THREAD_POOL_HPP
+#define THREAD_POOL_HPP
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class ThreadPool {
+public:
+  explicit ThreadPool(const size_t n) :
+    n_workers(n ? n : 1), job(0), generation(0), running(0),
+    stopping(false) {
+    for (size_t w = 1; w < n_workers; ++w)
+      threads.push_back(std::thread(&ThreadPool::loop, this, w));
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      stopping = true;
+    }
+    start.notify_all();
+    for (size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
+  }
+
+  size_t size() const {return n_workers;}
+
+  // Calls f(w) for every worker w in [0, size()) at the same time,
+  // worker 0 being the calling thread, and returns once all are done
+  void run(const std::function<void(size_t)> &f) {
+    {
+      std::lock_guard<std::mutex> lock(m);
+      job = &f;
+      running = n_workers - 1;
+      ++generation;
+    }
+    start.notify_all();
+    f(0);
+    std::unique_lock<std::mutex> lock(m);
+    finished.wait(lock, [this] {return running == 0;});
+    job = 0;
+  }
+
+private:
+  void loop(const size_t w) {
+    size_t seen = 0;
+    for (;;) {
+      const std::function<void(size_t)> *f;
+      {
+        std::unique_lock<std::mutex> lock(m);
+        start.wait(lock, [&] {return stopping || generation != seen;});
+        if (stopping)
+          return;
+        seen = generation;
+        f = job;
+      }
+      (*f)(w);
+      std::lock_guard<std::mutex> lock(m);
+      if (--running == 0)
+        finished.notify_one();
+    }
+  }
+
+  size_t n_workers;
+  std::vector<std::thread> threads;
+  std::mutex m;
+  std::condition_variable start;
+  std::condition_variable finished;
+  const std::function<void(size_t)> *job;
+  size_t generation;
+  size_t running;
+  bool stopping;
+
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+};
+
+#endif
@@ -16,6 +16,17 @@
 #include <gsl/gsl_blas.h>
 #include <fstream>
 #include <algorithm>
+#include <stdexcept>
+#include <cstdlib>
+#include <unistd.h>
+
+#include "binary_matrix.hpp"
+#include "bench_report.hpp"
+#include "fixed_dim.hpp"
+#include "matrix.hpp"
+#ifdef GMM_WITH_CUDA
+#include "gmm_cuda.hpp"
+#endif
 
 using std::min;
 using std::max;
@@ -33,17 +44,27 @@ using std::sort;
 using std::pair;
 using std::make_pair;
 
+// Families of covariance matrices: any, diagonal, a multiple of the
+// identity, or any but the same for all clusters
+enum CovarianceModel {full_cov, diagonal_cov, spherical_cov, tied_cov};
+
 struct 
 CovarianceMatrix{
-  vector<vector<double> > m, m_inv;
+  CovarianceModel model;
+  vector<vector<double> > m;
+  // Lower triangular Cholesky factor L of m = L L^t, row-major in one
+  // contiguous block (entries above the diagonal are 0)
+  vector<double> chol;
   size_t dim;
+  // log of the determinant
   double det;
   size_t det_sgn;
 
-  CovarianceMatrix (size_t num_dims){
+  CovarianceMatrix (size_t num_dims, CovarianceModel cov_model = full_cov){
+    model = cov_model;
     dim = num_dims;
     m = vector <vector <double> > (dim, vector <double> (dim, 0.0));
-    m_inv = vector <vector <double> > (dim, vector <double> (dim, 0.0));
+    chol = vector <double> (dim*dim, 0.0);
   }
 
   // Debug print
@@ -53,76 +74,92 @@ CovarianceMatrix{
         if(!inv)
           os << m[i][j]  << "\t";
         else
-          os << m_inv[i][j] << "\t";
+          os << chol[i*dim + j] << "\t";
 
       os << "\n";
     }
   }
 
+  // Only the diagonal of m and chol is used
+  bool diagonal() const {
+    return model == diagonal_cov || model == spherical_cov;
+  }
+
   // Resets covariance to identity
   void reset(){
     for(size_t i = 0; i < dim; ++i)
       for(size_t j = i; j < dim; ++j)
         if(i == j)
-          m[i][i] = m_inv[i][i] = 1;
+          m[i][i] = chol[i*dim + i] = 1;
         else
-          m[i][j] = m[j][i] = m_inv[i][j] = m_inv[j][i] = 0;
+          m[i][j] = m[j][i] = chol[i*dim + j] = chol[j*dim + i] = 0;
     det_sgn = 1;
     det = 1.0;
   }
-  // Finds the inverse of the covariance matrix and its determinant.
-  // to be used for density computation and called after a new instance
-  // of the covariance matrix has been computed
+  // Finds the Cholesky factor of the covariance matrix and its log
+  // determinant, twice the sum of the logs of the diagonal of the
+  // factor. To be used for density computation and called after a new
+  // instance of the covariance matrix has been computed
   bool invert_det(){
-    bool invertible = true;
+    det = 0.0;
+    for(size_t j = 0; diagonal() && j < dim; ++j){
+      // Not positive definite
+      if(!(m[j][j] > 0.0)){
+        reset();
+        return false;
+      }
+      det += log(m[j][j]);
+      chol[j*dim + j] = sqrt(m[j][j]);
+    }
+    for(size_t j = 0; !diagonal() && j < dim; ++j){
+      double *lj = &chol[j*dim];
+      double d = m[j][j];
+      for(size_t k = 0; k < j; ++k)
+        d -= lj[k]*lj[k];
+
+      // Not positive definite
+      if(!(d > 0.0)){
+        reset();
+        return false;
+      }
+      det += log(d);
+      lj[j] = sqrt(d);
+      for(size_t i = j + 1; i < dim; ++i){
+        const double *li = &chol[i*dim];
+        double x = m[i][j];
+        for(size_t k = 0; k < j; ++k)
+          x -= li[k]*lj[k];
+        chol[i*dim + j] = x/lj[j];
+      }
+      for(size_t i = j + 1; i < dim; ++i)
+        lj[i] = 0.0;
+    }
 
-    gsl_matrix *gm = gsl_matrix_alloc(dim,dim);
-    for(size_t i = 0; i < dim; ++i)
-      for(size_t j = 0; j < dim; ++j)
-        gsl_matrix_set(gm, i,j,m[i][j]);
-
-    gsl_permutation *p = gsl_permutation_alloc(dim);
-    int s;
-
-    // LU decomposition
-    gsl_linalg_LU_decomp(gm, p, &s);
-    
-    //Log of determinant
-    det = gsl_linalg_LU_lndet (gm);
-    det_sgn = gsl_linalg_LU_sgndet(gm, s);
-       
     // Test if det = 0
     // exp(-310) is roughly underflow for double precision
     if(isnan(det) || det < -300.0){
       reset();
-      invertible = false;
-    } else {
-      // Inverse
-      gsl_matrix *inv = gsl_matrix_alloc(dim,dim);
-      gsl_linalg_LU_invert(gm, p, inv);
-
-      for(size_t i = 0; i < dim; ++i)
-        for(size_t j = i; j < dim; ++j)
-          m_inv[j][i] = m_inv[i][j] = gsl_matrix_get(inv,i,j);
-
-      gsl_matrix_free(inv);
+      return false;
     }
-    
-    gsl_permutation_free(p);
-    gsl_matrix_free(gm);
-    return invertible;
+    det_sgn = 1;
+    return true;
   }
 };
 
+// Square distance, with the dimension fixed at compile time if Dim > 0
+// (see fixed_dim.hpp)
+template <size_t Dim = 0>
 double
 dist (const vector <double> &a, const vector <double> &b){
-  double ans = 0,z;
   assert(a.size() == b.size());
-  for(size_t i = 0; i < a.size(); ++i){
-    z = a[i] - b[i];
-    ans += z*z;
-  }
-  return ans;
+  return sq_dist<Dim>(&a[0], &b[0], a.size());
+}
+
+// Square distance of a sample, a row of the input, to a center
+template <size_t Dim = 0>
+double
+dist (const double *a, const vector <double> &b){
+  return sq_dist<Dim>(a, &b[0], b.size());
 }
 
 //////////////////////////////////////////////////////////
@@ -137,76 +174,261 @@ dist (const vector <double> &a, const vector <double> &b){
 //////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////
 
-// Sets the k-th cluster centroid as random points
+// Centers of k-means, the center of each sample and the bounds of
+// Hamerly (2010): upper[i] is at least the distance of sample i to its
+// center and lower[i] at most its distance to any other center
+struct
+KMeans{
+  vector <vector <double> > centers;
+  vector <size_t> which_cluster;
+  vector <double> upper;
+  vector <double> lower;
+};
+
+// Lloyd's iterations stop after this many even if some samples still move
+static const size_t kmeans_max_steps = 100;
+
+// The closest center to x, its distance and the distance to the second
+// closest (infinity with a single center)
+template <size_t Dim>
 void
-kmeans_init_centroids (vector <vector <double> > &means, 
-                       const vector <vector <double> > &in){
+nearest_centers (const double *x,
+                 const vector <vector <double> > &centers,
+                 size_t &which, double &first, double &second){
+  which = 0;
+  first = second = numeric_limits<double>::infinity();
+  for(size_t k = 0; k < centers.size(); ++k){
+    const double d = sqrt(dist<Dim>(x, centers[k]));
+    if(d < first){
+      second = first;
+      first = d;
+      which = k;
+    } else if(d < second)
+      second = d;
+  }
+}
 
-  size_t cur_cluster = 0, cur_elems = 0;
-  const size_t num_samples = in.size();
-  const size_t num_clusters = means.size();
-  const size_t num_dims = in[0].size();
+// Adds a center by k-means++ seeding: a sample drawn with probability
+// proportional to its squared distance to the closest center. The
+// assignment of km must be that of its centers, as after kmeans_lloyd,
+// so a solution with k centers is the start of one with k + 1
+void
+kmeans_add_center (const MatrixView &in,
+                   KMeans &km, gsl_rng *rng){
+  const size_t num_samples = in.n_rows;
+  size_t pick = gsl_rng_uniform_int(rng, num_samples);
 
-  for(size_t k = 0; k < num_clusters; ++k)
-    for(size_t j = 0; j < num_dims; ++j)
-      means[k][j] = in[k][j];
+  if(!km.centers.empty()){
+    vector <double> d2 = vector <double> (num_samples, 0.0);
+#ifdef _OPENMP
+    #pragma omp parallel for
+#endif
+    for(size_t i = 0; i < num_samples; ++i)
+      d2[i] = dist(in[i], km.centers[km.which_cluster[i]]);
+
+    double total = 0.0;
+    for(size_t i = 0; i < num_samples; ++i)
+      total += d2[i];
+
+    // All samples are centers already, any one will do
+    if(total > 0.0){
+      double u = gsl_rng_uniform(rng)*total;
+      pick = 0;
+      while(pick + 1 < num_samples && (u -= d2[pick]) >= 0.0)
+        ++pick;
+    }
+  }
+  km.centers.push_back(vector <double> (in[pick], in[pick] + in.n_cols));
 }
 
-// Assigns elements to a centroid
-// returns true if any of them changed
-// if false we can stop k-means
-bool
-kmeans_assign (const vector <vector <double> > &in,
-               const vector <vector <double>> &means,
-               vector <size_t> &which_cluster){
-  bool changed = false;
-  for(size_t i = 0; i < in.size(); i++){
-    double min_dist = dist(in[i], means[0]),
-           cur_dist;
-    size_t which = 0;
-    for(size_t k = 1; k < means.size(); k++){
-      cur_dist = dist(in[i], means[k]);
-      if(cur_dist< min_dist){
-        min_dist = cur_dist;
-        which = k;
+// Lloyd's iterations from the centers of km until no sample changes its
+// center. A sample is only compared with all centers when its upper
+// bound is above both its lower bound and half the distance of its
+// center to the closest other, as otherwise no center can be closer.
+// Centers left without samples stay where they are
+template <size_t Dim>
+void
+kmeans_lloyd_dim (const MatrixView &in, KMeans &km){
+  const size_t num_samples = in.n_rows,
+               num_dims = in.n_cols,
+               num_clusters = km.centers.size();
+
+  km.which_cluster.resize(num_samples);
+  km.upper.resize(num_samples);
+  km.lower.resize(num_samples);
+#ifdef _OPENMP
+  #pragma omp parallel for
+#endif
+  for(size_t i = 0; i < num_samples; ++i)
+    nearest_centers<Dim>(in[i], km.centers, km.which_cluster[i],
+                         km.upper[i], km.lower[i]);
+
+  vector <double> moved = vector <double> (num_clusters, 0.0),
+                  half_gap = vector <double> (num_clusters, 0.0);
+  for(size_t step = 0; step < kmeans_max_steps; ++step){
+
+    // Centers of the assignment, and how far they moved
+    vector <vector <double> > sums = vector <vector <double> > (num_clusters, vector <double> (num_dims, 0.0));
+    vector <size_t> num_elements = vector <size_t> (num_clusters, 0);
+    for(size_t i = 0; i < num_samples; ++i){
+      const size_t k = km.which_cluster[i];
+      for(size_t j = 0; j < num_dims; ++j)
+        sums[k][j] += in[i][j];
+      num_elements[k]++;
+    }
+    size_t most_moved = 0;
+    for(size_t k = 0; k < num_clusters; ++k){
+      moved[k] = 0.0;
+      if(num_elements[k] > 0){
+        for(size_t j = 0; j < num_dims; ++j)
+          sums[k][j] /= double(num_elements[k]);
+        moved[k] = sqrt(dist<Dim>(sums[k], km.centers[k]));
+        km.centers[k] = sums[k];
       }
+      if(moved[k] > moved[most_moved])
+        most_moved = k;
+    }
+    double second_moved = 0.0;
+    for(size_t k = 0; k < num_clusters; ++k)
+      if(k != most_moved)
+        second_moved = max(second_moved, moved[k]);
+
+    for(size_t k = 0; k < num_clusters; ++k){
+      double closest = numeric_limits<double>::infinity();
+      for(size_t kp = 0; kp < num_clusters; ++kp)
+        if(kp != k)
+          closest = min(closest, dist<Dim>(km.centers[k], km.centers[kp]));
+      half_gap[k] = 0.5*sqrt(closest);
+    }
+
+    size_t changed = 0;
+#ifdef _OPENMP
+    #pragma omp parallel for reduction(+:changed)
+#endif
+    for(size_t i = 0; i < num_samples; ++i){
+      const size_t k = km.which_cluster[i];
+      km.upper[i] += moved[k];
+      km.lower[i] -= (k == most_moved) ? second_moved : moved[most_moved];
+
+      const double bound = max(half_gap[k], km.lower[i]);
+      if(km.upper[i] <= bound)
+        continue;
+      km.upper[i] = sqrt(dist<Dim>(in[i], km.centers[k]));
+      if(km.upper[i] <= bound)
+        continue;
+
+      nearest_centers<Dim>(in[i], km.centers, km.which_cluster[i],
+                           km.upper[i], km.lower[i]);
+      if(km.which_cluster[i] != k)
+        ++changed;
     }
 
-    if(which != which_cluster[i])
-      changed = true;
-    which_cluster[i] = which;
+    if(changed == 0)
+      break;
   }
+}
 
-  return changed;
+// The usual numbers of principal components get their own kernels
+void
+kmeans_lloyd (const MatrixView &in, KMeans &km){
+  const size_t num_dims = in.n_cols;
+  if(num_dims == 10)
+    kmeans_lloyd_dim<10>(in, km);
+  else if(num_dims == 20)
+    kmeans_lloyd_dim<20>(in, km);
+  else if(num_dims == 50)
+    kmeans_lloyd_dim<50>(in, km);
+  else
+    kmeans_lloyd_dim<0>(in, km);
 }
 
-// Updates centroids based on assignment
+// Each sample in the cluster of its closest center, which is the
+// assignment kmeans_lloyd ends with, so a job only has to keep the
+// centers of its k-means until it runs
+template <size_t Dim>
 void
-kmeans_update(const vector <vector <double> > &in,
-              vector <vector <double> > &means,
-              const vector <size_t> &which_cluster){
+nearest_assignment_dim (const MatrixView &in,
+                        const vector <vector <double> > &centers,
+                        vector <size_t> &which_cluster){
+  const size_t num_samples = in.n_rows;
+  which_cluster.resize(num_samples);
+#ifdef _OPENMP
+  #pragma omp taskloop grainsize(256) default(shared)
+#endif
+  for(size_t i = 0; i < num_samples; ++i){
+    double first, second;
+    nearest_centers<Dim>(in[i], centers, which_cluster[i], first, second);
+  }
+}
 
-  const size_t num_dims = in[0].size(),
-               num_clusters = means.size(),
-               num_samples = in.size();
-            
-  vector <size_t> num_elements = vector<size_t>(num_clusters,0);
+void
+nearest_assignment (const MatrixView &in,
+                    const vector <vector <double> > &centers,
+                    vector <size_t> &which_cluster){
+  const size_t num_dims = in.n_cols;
+  if(num_dims == 10)
+    nearest_assignment_dim<10>(in, centers, which_cluster);
+  else if(num_dims == 20)
+    nearest_assignment_dim<20>(in, centers, which_cluster);
+  else if(num_dims == 50)
+    nearest_assignment_dim<50>(in, centers, which_cluster);
+  else
+    nearest_assignment_dim<0>(in, centers, which_cluster);
+}
 
-  // Set the means back to zero
-  for(size_t k = 0; k < num_clusters;++k)
-    means[k] = vector<double>(num_dims, 0.0);
+// The k-means of one restart, one more center at a time: the solution
+// with k + 1 centers starts from the one with k. Only the centers of
+// each k are kept
+struct
+KMeansChain{
+  KMeans km;
+  gsl_rng *rng;
+  // centers of k clusters in solutions[k - 1]
+  vector <vector <vector <double> > > solutions;
+#ifdef _OPENMP
+  omp_lock_t lock;
+#endif
 
-  for(size_t i = 0; i < num_samples; ++i){
-    for(size_t j = 0; j < num_dims; ++j){
-      means[which_cluster[i]][j] += in[i][j];
+  KMeansChain(const size_t max_clusters, const unsigned long seed){
+    rng = gsl_rng_alloc(gsl_rng_mt19937);
+    gsl_rng_set(rng, seed);
+    solutions.resize(max_clusters);
+#ifdef _OPENMP
+    omp_init_lock(&lock);
+#endif
+  }
+
+  ~KMeansChain(){
+    gsl_rng_free(rng);
+#ifdef _OPENMP
+    omp_destroy_lock(&lock);
+#endif
+  }
+
+  // The centers of num_clusters clusters, found first if the chain is
+  // not there yet. Safe to call from several threads
+  const vector <vector <double> > &
+  centers(const MatrixView &in, const size_t num_clusters,
+          BenchReport &bench){
+#ifdef _OPENMP
+    omp_set_lock(&lock);
+#endif
+    while(km.centers.size() < num_clusters){
+      PhaseTimer t(bench, "kmeans", in.n_rows);
+      kmeans_add_center(in, km, rng);
+      kmeans_lloyd(in, km);
+      solutions[km.centers.size() - 1] = km.centers;
     }
-    num_elements[which_cluster[i]]++;
+#ifdef _OPENMP
+    omp_unset_lock(&lock);
+#endif
+    return solutions[num_clusters - 1];
   }
 
-  for(size_t k = 0; k < num_clusters; ++k)
-    for(size_t j = 0; j < num_dims; ++j)
-      means[k][j] = means[k][j]/double(num_elements[k]);
-}
+private:
+  KMeansChain(const KMeansChain &);
+  KMeansChain &operator=(const KMeansChain &);
+};
 
 ////////////////////////////
 ////////////////////////////
@@ -220,30 +442,104 @@ kmeans_update(const vector <vector <double> > &in,
 ////////////////////////////
 ////////////////////////////
 
-// MVN density (log)
-double 
-dnorm (const vector <double> &x,
-                const vector <double> &mean,
-                const CovarianceMatrix &cov){
+// x such that L x = b, for the lower triangular Cholesky factor of cov
+void
+forward_solve(const CovarianceMatrix &cov, const vector <double> &b,
+              vector <double> &x){
+  const size_t num_dims = cov.dim;
+  x.resize(num_dims);
+  for(size_t j = 0; j < num_dims; ++j){
+    double v = b[j];
+    for(size_t jp = 0; jp < j; ++jp)
+      v -= cov.chol[j*num_dims + jp]*x[jp];
+    x[j] = v/cov.chol[j*num_dims + j];
+  }
+}
+
+// MVN densities (log) of the samples in [lo, hi) in all clusters, the
+// one of sample i in cluster k in log_density[(i - lo)*num_clusters + k].
+// For each cluster, the samples minus the mean are solved against the
+// Cholesky factor in a single triangular solve with many right hand
+// sides. With a tied covariance the samples are solved once for all
+// clusters, and with a diagonal one each costs O(D). centered is a
+// workspace
+void
+log_densities(const MatrixView &in,
+              const size_t lo, const size_t hi,
+              const vector <vector <double> > &means,
+              const vector <CovarianceMatrix> &cov,
+              vector <double> &log_density,
+              vector <double> &centered){
+  const size_t num_samples = hi - lo;
+  const size_t num_dims = in.n_cols;
+  const size_t num_clusters = means.size();
+  const double log_2pi = double(num_dims)*log(2*M_PI);
 
-  size_t num_dims = mean.size();
-  double exp_val = 0.0;
+  log_density.resize(num_samples*num_clusters);
+  centered.resize(num_samples*num_dims);
+  gsl_matrix_view z =
+    gsl_matrix_view_array(&centered[0], num_samples, num_dims);
 
-  // L = (x - mu)^t * Sigma^{-1} 
-  vector <double> left_mult = vector <double> (num_dims, 0.0);
-  for(size_t i = 0; i < num_dims; ++i)
-    for(size_t j = 0; j < num_dims; ++j)
-      left_mult[i] += (x[j] - mean[j])*cov.m_inv[j][i];
+  if(cov[0].model == tied_cov){
+    // Row i of Z is L^{-1} x_i, and L^{-1} (x_i - mu) is that minus
+    // L^{-1} mu, found by forward substitution
+    for(size_t i = 0; i < num_samples; ++i)
+      for(size_t j = 0; j < num_dims; ++j)
+        centered[i*num_dims + j] = in[lo + i][j];
+    gsl_matrix_const_view l =
+      gsl_matrix_const_view_array(&cov[0].chol[0], num_dims, num_dims);
+    gsl_blas_dtrsm(CblasRight, CblasLower, CblasTrans, CblasNonUnit, 1.0,
+                   &l.matrix, &z.matrix);
 
-  // R = L * (x - mu)
-  for(size_t j = 0; j < num_dims; ++j)
-    exp_val += left_mult[j]*(x[j] - mean[j]);
-  
-  // If matrix is singular or not psd, probability = 0
-  if(exp_val < 0.0)
-    return numeric_limits<double>::min();
+    vector <double> solved_mean(num_dims);
+    for(size_t k = 0; k < num_clusters; ++k){
+      forward_solve(cov[0], means[k], solved_mean);
+      for(size_t i = 0; i < num_samples; ++i){
+        double exp_val = 0.0;
+        for(size_t j = 0; j < num_dims; ++j){
+          const double d = centered[i*num_dims + j] - solved_mean[j];
+          exp_val += d*d;
+        }
+        log_density[i*num_clusters + k] = -0.5*(cov[0].det + log_2pi + exp_val);
+      }
+    }
+    return;
+  }
+
+  vector <double> inv_sd(num_dims);
+  for(size_t k = 0; k < num_clusters; ++k){
+    if(cov[k].diagonal()){
+      for(size_t j = 0; j < num_dims; ++j)
+        inv_sd[j] = 1.0/cov[k].chol[j*num_dims + j];
+      for(size_t i = 0; i < num_samples; ++i){
+        const double *x = in[lo + i], *mu = &means[k][0];
+        double exp_val = 0.0;
+        for(size_t j = 0; j < num_dims; ++j){
+          const double d = (x[j] - mu[j])*inv_sd[j];
+          exp_val += d*d;
+        }
+        log_density[i*num_clusters + k] = -0.5*(cov[k].det + log_2pi + exp_val);
+      }
+      continue;
+    }
+
+    for(size_t i = 0; i < num_samples; ++i)
+      for(size_t j = 0; j < num_dims; ++j)
+        centered[i*num_dims + j] = in[lo + i][j] - means[k][j];
+
+    // Z L^t = X - mu, so row i of Z is L^{-1} (x_i - mu)
+    gsl_matrix_const_view l =
+      gsl_matrix_const_view_array(&cov[k].chol[0], num_dims, num_dims);
+    gsl_blas_dtrsm(CblasRight, CblasLower, CblasTrans, CblasNonUnit, 1.0,
+                   &l.matrix, &z.matrix);
 
-  return (-0.5 * (cov.det + double(num_dims)*log(2*M_PI) + exp_val));
+    for(size_t i = 0; i < num_samples; ++i){
+      double exp_val = 0.0;
+      for(size_t j = 0; j < num_dims; ++j)
+        exp_val += centered[i*num_dims + j]*centered[i*num_dims + j];
+      log_density[i*num_clusters + k] = -0.5*(cov[k].det + log_2pi + exp_val);
+    }
+  }
 }
                 
 // Calculates the log sum of exponentials by making sure
@@ -251,69 +547,175 @@ dnorm (const vector <double> &x,
 // More exactly, calculates log(\sum_i \pi_k N_k (x_i))
 double
 log_sum_of_exps(const vector <double> &pi,
-                const vector <double> &log_density){
+                const double *log_density){
   double ans = 0.0;
   size_t which_max = 0;
-  for(size_t k = 1; k < log_density.size(); ++k)
+  for(size_t k = 1; k < pi.size(); ++k)
     if(log_density[k] > log_density[which_max])
       which_max = k;
 
-  for(size_t k = 0; k < log_density.size(); ++k)
+  for(size_t k = 0; k < pi.size(); ++k)
     ans += pi[k]*exp(log_density[k] - log_density[which_max]);
 
   return (log_density[which_max] + log(ans));
 }
 
-// Computes the responsibilities but with some numerical tricks
-// to avoid underflow
-void
-e_step(vector <vector <double> > &gamma,
-       const vector <vector <double> > &in,
+// Samples of the E-step are processed in blocks of this many
+static const size_t e_step_block = 256;
+
+// Computes the responsibilities, gamma[i*num_clusters + k] for sample i
+// in cluster k, but with some numerical tricks
+// to avoid underflow, and returns the total log likelihood of the data
+// given the parameters, which is the sum of the normalizing terms.
+// Every block of samples is a task, so threads that are done with their
+// own number of clusters help with the others. The log likelihood is
+// added in sample order, so it does not depend on the number of threads
+double
+e_step(vector <double> &gamma,
+       const MatrixView &in,
        const vector <double> &pi,
        const vector <vector <double> > &means,
        const vector <CovarianceMatrix> &cov ){
 
   const size_t num_clusters = pi.size();
-  const size_t num_samples = in.size();
+  const size_t num_samples = in.n_rows;
+  const size_t num_blocks = (num_samples + e_step_block - 1)/e_step_block;
 
-  // Summation of small exps
-  for(size_t i = 0; i < num_samples; ++i){
-    vector <double> log_density = vector<double>(num_clusters,0.0);
-    for(size_t k = 0; k < num_clusters; ++k)
-      log_density[k] = dnorm(in[i], means[k], cov[k]);
+  vector <double> sample_loglik(num_samples, 0.0);
+#ifdef _OPENMP
+  #pragma omp taskloop grainsize(1) default(shared)
+#endif
+  for(size_t b = 0; b < num_blocks; ++b){
+    const size_t lo = b*e_step_block,
+                 hi = min(num_samples, lo + e_step_block);
+    vector <double> block_log_density, centered;
+    log_densities(in, lo, hi, means, cov, block_log_density, centered);
+
+    // Summation of small exps
+    for(size_t i = lo; i < hi; ++i){
+      const double *log_density = &block_log_density[(i - lo)*num_clusters];
+
+      double sum = log_sum_of_exps(pi, log_density);
+      sample_loglik[i] = sum;
+      double *gamma_i = &gamma[i*num_clusters];
+      for(size_t k = 0; k < num_clusters; ++k){
+        if(pi[k] == 0.0) {
+          gamma_i[k] = 0.0;
+        } else {
+          gamma_i[k]  = log(pi[k]) + log_density[k];
+          gamma_i[k] -= sum;
+          gamma_i[k]  = exp(gamma_i[k]);
+        }
 
-    double sum = log_sum_of_exps(pi, log_density);
-    for(size_t k = 0; k < num_clusters; ++k){
-      if(pi[k] == 0.0) {
-        gamma[i][k] = 0.0;
-      } else {
-        gamma[i][k]  = log(pi[k]) + log_density[k];
-        gamma[i][k] -= sum;
-        gamma[i][k]  = exp(gamma[i][k]);
+        assert(!isnan(gamma_i[k]));
       }
-      
-      assert(!isnan(gamma[i][k]));
     }
   }
+
+  double loglik = 0.0;
+  for(size_t i = 0; i < num_samples; ++i)
+    loglik += sample_loglik[i];
+  return loglik;
 }
 
-// Maximum likelihood params
+// The M-step splits the samples into this many chunks, whatever the
+// number of threads, so the sums are always added in the same order
+static const size_t m_step_chunks = 16;
+
+// Weighted sums of the samples of a chunk in every cluster: the total
+// weight, the sum of the samples and the upper triangle of the sum of
+// their outer products, row by row (only its diagonal, the sum of
+// squares, for diagonal covariances). The samples are taken minus a shift
+// per cluster, close to its mean, so the covariance is not the small
+// difference of two large numbers
+struct
+SufficientStats{
+  bool diagonal;
+  // entries of outer per cluster
+  size_t num_entries;
+  vector <double> weight;
+  vector <double> sum;
+  vector <double> outer;
+
+  SufficientStats(size_t num_clusters, size_t num_dims,
+                  bool diagonal_only = false){
+    diagonal = diagonal_only;
+    num_entries = diagonal ? num_dims : num_dims*(num_dims + 1)/2;
+    weight = vector <double> (num_clusters, 0.0);
+    sum = vector <double> (num_clusters*num_dims, 0.0);
+    outer = vector <double> (num_clusters*num_entries, 0.0);
+  }
+
+  // adds the samples in [lo, hi)
+  void accumulate(const vector <double> &gamma,
+                  const MatrixView &in,
+                  const vector <vector <double> > &shift,
+                  const size_t lo, const size_t hi){
+    const size_t num_clusters = weight.size();
+    const size_t num_dims = in.n_cols;
+    vector <double> z(num_dims);
+
+    for(size_t i = lo; i < hi; ++i){
+      const double *gamma_i = &gamma[i*num_clusters];
+      for(size_t k = 0; k < num_clusters; ++k){
+        const double w = gamma_i[k];
+        // Most responsibilities of a sample are 0
+        if(w == 0.0)
+          continue;
+
+        weight[k] += w;
+        double *sum_k = &sum[k*num_dims];
+        for(size_t j = 0; j < num_dims; ++j){
+          z[j] = in[i][j] - shift[k][j];
+          sum_k[j] += w*z[j];
+        }
+        double *outer_k = &outer[k*num_entries];
+        if(diagonal){
+          for(size_t j = 0; j < num_dims; ++j)
+            outer_k[j] += w*z[j]*z[j];
+          continue;
+        }
+        for(size_t j = 0; j < num_dims; ++j){
+          const double wz = w*z[j];
+          for(size_t jp = j; jp < num_dims; ++jp)
+            *outer_k++ += wz*z[jp];
+        }
+      }
+    }
+  }
+
+  void add(const SufficientStats &other){
+    for(size_t k = 0; k < weight.size(); ++k)
+      weight[k] += other.weight[k];
+    for(size_t e = 0; e < sum.size(); ++e)
+      sum[e] += other.sum[e];
+    for(size_t e = 0; e < outer.size(); ++e)
+      outer[e] += other.outer[e];
+  }
+};
+
+// Maximum likelihood params of the sufficient statistics of num_samples
+// samples. The means coming in are those the samples were shifted by. A
+// spherical covariance is the mean of the diagonal one, and a tied one
+// the mean of the full ones, weighted by the clusters
 void
-m_step(const vector< vector <double> > &gamma,
-       const vector< vector <double> > &in,
-       vector <double> &pi,
-       vector <vector <double> > &means,
-       vector <CovarianceMatrix> &cov){
+m_step_from_stats(const SufficientStats &stats,
+                  const size_t num_samples,
+                  vector <double> &pi,
+                  vector <vector <double> > &means,
+                  vector <CovarianceMatrix> &cov){
   const size_t num_clusters = pi.size();
-  const size_t num_samples = in.size();
-  const size_t num_dims = in[0].size();
+  const size_t num_dims = means[0].size();
+  const CovarianceModel model = cov[0].model;
+  const vector <vector <double> > shift = means;
+
+  // Sum of the weighted covariances, for tied_cov
+  vector <vector <double> > pooled = vector <vector <double> > (num_dims, vector <double> (num_dims, 0.0));
 
   for(size_t k = 0; k < num_clusters; ++k){
 
     // Pi
-    pi[k] = 0.0;
-    for(size_t i = 0; i < num_samples; ++i)
-      pi[k] += gamma[i][k];
+    pi[k] = stats.weight[k];
 
     // Unused cluster, send it back to the center
     if(pi[k] <= 0.0){
@@ -324,75 +726,109 @@ m_step(const vector< vector <double> > &gamma,
     // Some elements have been assigned, estiamte mean and cov
     } else {
 
-      // Means
+      // Means, and their distance to the shift
+      const double *sum_k = &stats.sum[k*num_dims];
+      vector <double> delta(num_dims);
       for(size_t j = 0; j < num_dims; ++j){
-        means[k][j] = 0.0;
-        for(size_t i = 0; i < num_samples; ++i)
-          means[k][j] += gamma[i][k]*in[i][j];       
-        means[k][j] = means[k][j] / pi[k];
+        delta[j] = sum_k[j] / pi[k];
+        means[k][j] = shift[k][j] + delta[j];
       }
 
       // Sigma
-      for(size_t j = 0; j < num_dims; ++j){
-        for(size_t jp = j; jp < num_dims; ++jp){
-          cov[k].m[j][jp] = cov[k].m[jp][j] = 0.0;
-
-          for(size_t i = 0; i < num_samples; ++i){
-            double z = gamma[i][k]*(in[i][j] - means[k][j])*(in[i][jp] - means[k][jp]);
-            cov[k].m[j][jp] += z;
-            if(jp != j)
-              cov[k].m[jp][j] += z;
-          }
-          cov[k].m[j][jp] = cov[k].m[jp][j] = cov[k].m[j][jp]/(pi[k]);
+      const double *outer_k = &stats.outer[k*stats.num_entries];
+      if(cov[k].diagonal()){
+        double mean_var = 0.0;
+        for(size_t j = 0; j < num_dims; ++j){
+          cov[k].m[j][j] = outer_k[j]/pi[k] - delta[j]*delta[j];
+          mean_var += cov[k].m[j][j]/double(num_dims);
         }
-      }  
+        if(model == spherical_cov)
+          for(size_t j = 0; j < num_dims; ++j)
+            cov[k].m[j][j] = mean_var;
+      } else if(model == tied_cov){
+        for(size_t j = 0; j < num_dims; ++j)
+          for(size_t jp = j; jp < num_dims; ++jp)
+            pooled[j][jp] += *outer_k++ - pi[k]*delta[j]*delta[jp];
+      } else {
+        for(size_t j = 0; j < num_dims; ++j)
+          for(size_t jp = j; jp < num_dims; ++jp)
+            cov[k].m[j][jp] = cov[k].m[jp][j] =
+              *outer_k++/pi[k] - delta[j]*delta[jp];
+      }
+
       //Dont forget this!!!
-      cov[k].invert_det();
+      if(model != tied_cov)
+        cov[k].invert_det();
 
       // pi goes to [0,1]
       pi[k] = pi[k]/double(num_samples);
     }
   }
+
+  if(model == tied_cov){
+    for(size_t j = 0; j < num_dims; ++j)
+      for(size_t jp = j; jp < num_dims; ++jp)
+        cov[0].m[j][jp] = cov[0].m[jp][j] = pooled[j][jp]/double(num_samples);
+    cov[0].invert_det();
+    for(size_t k = 1; k < num_clusters; ++k)
+      cov[k] = cov[0];
+  }
 }
 
-// Total log likelihood of data given EM parameters
-double
-log_likelihood(const vector <vector <double> > &in,
-               const vector <vector <double> > &means,
-               const vector <CovarianceMatrix> &cov,
-               const vector <double> &pi){
-  double loglik = 0.0;
+// Maximum likelihood params, from the sufficient statistics of the
+// responsibilities in one pass over the samples. The means coming in are
+// those of the last step (or any guess) and only shift the samples
+void
+m_step(const vector <double> &gamma,
+       const MatrixView &in,
+       vector <double> &pi,
+       vector <vector <double> > &means,
+       vector <CovarianceMatrix> &cov){
   const size_t num_clusters = pi.size();
-  const size_t num_samples = in.size();
+  const size_t num_samples = in.n_rows;
+  const size_t num_dims = in.n_cols;
+  const size_t num_chunks = min(m_step_chunks, num_samples);
 
- for(size_t i = 0; i < num_samples; ++i){
-   double sum = 0;
-   vector<double> log_density = vector<double>(num_clusters, 0.0);
-   for(size_t k = 0; k < num_clusters; ++k)
-     log_density[k] = dnorm(in[i], means[k], cov[k]);  
+  vector <SufficientStats> chunk_stats(num_chunks,
+                                       SufficientStats(num_clusters, num_dims,
+                                                       cov[0].diagonal()));
+#ifdef _OPENMP
+  #pragma omp taskloop grainsize(1) default(shared)
+#endif
+  for(size_t c = 0; c < num_chunks; ++c)
+    chunk_stats[c].accumulate(gamma, in, means, c*num_samples/num_chunks,
+                              (c + 1)*num_samples/num_chunks);
 
-   loglik += log_sum_of_exps(pi, log_density);
- }
+  for(size_t c = 1; c < num_chunks; ++c)
+    chunk_stats[0].add(chunk_stats[c]);
 
- return loglik;
+  m_step_from_stats(chunk_stats[0], num_samples, pi, means, cov);
 }
 
-// Bayesian Information Criterion
+// Bayesian Information Criterion, given the log likelihood of the
+// parameters
 double
-information_criterion(const vector <vector <double> > &in,
-    const vector <vector <double> > &means,
-    const vector <CovarianceMatrix> &cov,
+information_criterion(const size_t num_samples,
+    const size_t num_dims,
     const vector <double> &pi,
+    const double loglik,
+    const CovarianceModel model,
     bool bayesian = true){
 
   size_t num_params = 0;
-  size_t num_samples = in.size(),
-         num_clusters = pi.size(),
-         num_dims = in[0].size();
+  size_t num_clusters = pi.size();
 
   num_params += num_clusters * num_dims; //means
   num_params += num_clusters - 1; //pi. Minus one cause they sum to one
-  num_params += num_clusters*num_dims*(num_dims + 1) >> 1; //cov
+  //cov
+  if(model == full_cov)
+    num_params += num_clusters*num_dims*(num_dims + 1) >> 1;
+  else if(model == diagonal_cov)
+    num_params += num_clusters*num_dims;
+  else if(model == spherical_cov)
+    num_params += num_clusters;
+  else
+    num_params += num_dims*(num_dims + 1) >> 1;
 
   double ans = double(num_params);
   if(bayesian)
@@ -400,11 +836,11 @@ information_criterion(const vector <vector <double> > &in,
   else 
     ans *= 2;
 
-  return ans - 2*log_likelihood(in,means,cov,pi);
+  return ans - 2*loglik;
 }
 
 void 
-print_debug(const vector <vector <double> > &gamma, 
+print_debug(const vector <double> &gamma, 
             const vector <double> &pi,
             const vector <vector <double> > &means,
             const vector <CovarianceMatrix> &cov){
@@ -426,10 +862,10 @@ print_debug(const vector <vector <double> > &gamma,
   }
 
   cout << "========GAMMA==========\n";
-  for(size_t i = 0; i < gamma.size(); ++i){
+  for(size_t i = 0; i < gamma.size()/num_clusters; ++i){
     for(size_t k = 0; k < num_clusters; ++k){
-      if(gamma[i][k] > 1e-5)
-        cout << gamma[i][k] << "\t";
+      if(gamma[i*num_clusters + k] > 1e-5)
+        cout << gamma[i*num_clusters + k] << "\t";
       else
         cout << "0\t";
     }
@@ -449,15 +885,91 @@ print_debug(const vector <vector <double> > &gamma,
 ////////////////////////////////
 ////////////////////////////////
 
+// The EM iterations of cluster, cluster_gpu and cluster_stream, from the
+// parameters of the k-means assignment. Steps keeps the responsibilities
+// wherever that clustering has them, and has
+//   double e_step(pi, means, cov), which also gives the log likelihood
+//     of the parameters it used
+//   void m_step(pi, means, cov)
+// Returns the clustering BIC
+template <class Steps> double
+run_em(Steps &steps,
+       const size_t num_samples,
+       vector <double> &pi,
+       vector <vector <double> > &means,
+       vector <CovarianceMatrix> &cov){
+  double prev, cur;
+  prev = steps.e_step(pi, means, cov);
+  cur = prev;
+  // Some steps to test if loglik is increasing
+
+  double eps = 1e-2;
+  // EM can also cycle between solutions without ever meeting eps
+  const size_t max_steps = 1000;
+  bool stop = false;
+  for(size_t nsteps = 0; !stop && nsteps < max_steps; ++nsteps){
+    steps.m_step(pi, means, cov);
+    cur = steps.e_step(pi, means, cov);
+    if(fabs(prev - cur) < eps)
+      stop = true;
+    prev = cur;
+  }
+
+  return information_criterion(num_samples, means[0].size(), pi, cur,
+                               cov[0].model, false);
+}
+
+// Mean of the rows of in
+vector <double>
+sample_mean(const MatrixView &in){
+  vector <double> center = vector <double> (in.n_cols, 0.0);
+  for(size_t i = 0; i < in.n_rows; ++i)
+    for(size_t j = 0; j < in.n_cols; ++j)
+      center[j] += in[i][j];
+  for(size_t j = 0; j < in.n_cols; ++j)
+    center[j] /= double(in.n_rows);
+  return center;
+}
+
+// The steps of cluster, with the samples and the responsibilities in
+// memory
+struct
+InMemorySteps{
+  const MatrixView &in;
+  vector <double> &gamma;
+  BenchReport &bench;
+
+  InMemorySteps(const MatrixView &samples, vector <double> &resp,
+                BenchReport &report) :
+    in(samples), gamma(resp), bench(report) {}
+
+  double e_step(const vector <double> &pi,
+                const vector <vector <double> > &means,
+                const vector <CovarianceMatrix> &cov){
+    PhaseTimer t(bench, "e_step", in.n_rows);
+    return ::e_step(gamma, in, pi, means, cov);
+  }
+
+  void m_step(vector <double> &pi,
+              vector <vector <double> > &means,
+              vector <CovarianceMatrix> &cov){
+    PhaseTimer t(bench, "m_step", in.n_rows);
+    ::m_step(gamma, in, pi, means, cov);
+  }
+};
+
 // Returns the clustering BIC
 double
-cluster (const vector <vector <double> > &in, 
+cluster (const MatrixView &in,
          const size_t num_clusters,
-         const vector <size_t> &kmeans_init){
-  const size_t num_samples = in.size(),
-               num_dims = in[0].size();
+         const vector <size_t> &kmeans_init,
+         const CovarianceModel model,
+         BenchReport &bench){
+  const size_t num_samples = in.n_rows,
+               num_dims = in.n_cols;
 
-  vector <vector <double> > means = vector <vector <double> > (num_clusters, vector <double> (num_dims, 0.0));
+  // The mean of all samples is the shift of the first M-step
+  vector <vector <double> > means = vector <vector <double> > (num_clusters, sample_mean(in));
 
   /////////////////////////////////////////////////
   // GMM algorithm to soften the k-means assignment
@@ -466,72 +978,493 @@ cluster (const vector <vector <double> > &in,
   // mixing probabilities
   vector <double> pi = vector <double> (num_clusters, 0.0);
 
-  // Responsibilites
-  vector <vector <double> > gamma = vector <vector <double> > (num_samples, vector <double> (num_clusters, 0.0));
+  // Responsibilites, one row of num_clusters per sample
+  vector <double> gamma = vector <double> (num_samples*num_clusters, 0.0);
 
   // Covariance matrices
-  vector <CovarianceMatrix> cov = vector <CovarianceMatrix> (num_clusters, CovarianceMatrix(num_dims));
+  vector <CovarianceMatrix> cov = vector <CovarianceMatrix> (num_clusters, CovarianceMatrix(num_dims, model));
 
   // Read the cluster assignment from k means
   for(size_t i = 0; i < num_samples; ++i)
-    gamma[i][kmeans_init[i]] = 1.0;
+    gamma[i*num_clusters + kmeans_init[i]] = 1.0;
 
   // Initial guess of parameters given k means
   m_step(gamma,in,pi,means,cov);
 
-  double prev = log_likelihood(in,means,cov,pi),cur;
-  // Some steps to test if loglik is increasing
-  
-  double eps = 1e-2;
-  bool stop = false;
-  for(size_t nsteps = 0; !stop; ++nsteps){
-    e_step(gamma,in,pi,means,cov);
-    m_step(gamma,in,pi,means,cov);
-    cur = log_likelihood(in,means,cov,pi);
-    if(fabs(prev - cur) < eps)
-      stop = true;
-    prev = cur;
+  InMemorySteps steps(in, gamma, bench);
+  return run_em(steps, num_samples, pi, means, cov);
+}
+
+#ifdef GMM_WITH_CUDA
+// e_step with the samples and the responsibilities on the device, the
+// parameters laid out as GpuEM::e_step takes them (see gmm_cuda.hpp)
+double
+gpu_e_step(GpuEM &gpu,
+           const vector <double> &pi,
+           const vector <vector <double> > &means,
+           const vector <CovarianceMatrix> &cov){
+  const size_t num_clusters = pi.size();
+  const size_t num_dims = means[0].size();
+  vector <double> flat_means, factors, det(num_clusters);
+  GpuCovariance kind = gpu_full;
+  // The means of a tied covariance are solved against its factor once
+  if(cov[0].model == tied_cov){
+    kind = gpu_tied;
+    factors = cov[0].chol;
+    vector <double> solved_mean;
+    for(size_t k = 0; k < num_clusters; ++k){
+      forward_solve(cov[0], means[k], solved_mean);
+      flat_means.insert(flat_means.end(), solved_mean.begin(),
+                        solved_mean.end());
+    }
+  } else {
+    if(cov[0].diagonal())
+      kind = gpu_diagonal;
+    for(size_t k = 0; k < num_clusters; ++k){
+      flat_means.insert(flat_means.end(), means[k].begin(), means[k].end());
+      if(kind == gpu_diagonal)
+        for(size_t j = 0; j < num_dims; ++j)
+          factors.push_back(cov[k].chol[j*num_dims + j]);
+      else
+        factors.insert(factors.end(), cov[k].chol.begin(), cov[k].chol.end());
+    }
   }
-  
-  //print_debug(gamma,pi,means,cov);
-  double ans = information_criterion(in,means,cov,pi, false);
-  return ans;
+  for(size_t k = 0; k < num_clusters; ++k)
+    det[k] = cov[k].det;
+  return gpu.e_step(pi, flat_means, factors, det, kind);
+}
+
+// m_step from the sufficient statistics of the responsibilities on the
+// device
+void
+gpu_m_step(GpuEM &gpu,
+           const size_t num_samples,
+           vector <double> &pi,
+           vector <vector <double> > &means,
+           vector <CovarianceMatrix> &cov){
+  const size_t num_clusters = pi.size();
+  vector <double> shift;
+  for(size_t k = 0; k < num_clusters; ++k)
+    shift.insert(shift.end(), means[k].begin(), means[k].end());
+  SufficientStats stats(num_clusters, means[0].size(), cov[0].diagonal());
+  gpu.stats(shift, stats.weight, stats.sum, stats.outer);
+  m_step_from_stats(stats, num_samples, pi, means, cov);
+}
+
+// The steps of cluster_gpu, with the responsibilities on the device
+struct
+GpuSteps{
+  GpuEM &gpu;
+  size_t num_samples;
+  BenchReport &bench;
+
+  GpuSteps(GpuEM &device, const size_t n, BenchReport &report) :
+    gpu(device), num_samples(n), bench(report) {}
+
+  double e_step(const vector <double> &pi,
+                const vector <vector <double> > &means,
+                const vector <CovarianceMatrix> &cov){
+    PhaseTimer t(bench, "e_step", num_samples);
+    return gpu_e_step(gpu, pi, means, cov);
+  }
+
+  void m_step(vector <double> &pi,
+              vector <vector <double> > &means,
+              vector <CovarianceMatrix> &cov){
+    PhaseTimer t(bench, "m_step", num_samples);
+    gpu_m_step(gpu, num_samples, pi, means, cov);
+  }
+};
+
+// Same as cluster, with the E-step and the sufficient statistics of the
+// M-step on the GPU, where the responsibilities stay. in is only used
+// for the mean of the samples
+double
+cluster_gpu (const MatrixView &in,
+             const GpuSamples &samples,
+             const size_t num_clusters,
+             const vector <size_t> &kmeans_init,
+             const CovarianceModel model,
+             BenchReport &bench){
+  const size_t num_samples = in.n_rows,
+               num_dims = in.n_cols;
+
+  // The mean of all samples is the shift of the first M-step
+  vector <vector <double> > means = vector <vector <double> > (num_clusters, sample_mean(in));
+
+  vector <double> pi = vector <double> (num_clusters, 0.0);
+  vector <CovarianceMatrix> cov = vector <CovarianceMatrix> (num_clusters, CovarianceMatrix(num_dims, model));
+  GpuEM gpu(samples, num_clusters, cov[0].diagonal());
+
+  // Initial guess of parameters given k means
+  gpu.set_assignment(kmeans_init);
+  gpu_m_step(gpu, num_samples, pi, means, cov);
+
+  GpuSteps steps(gpu, num_samples, bench);
+  return run_em(steps, num_samples, pi, means, cov);
+}
+#endif
+
+// One pass over a matrix too large to hold, batch rows at a time, that
+// puts in stats the sufficient statistics of the responsibilities,
+// shifted by the means. With nearest_mean each sample is all in the
+// cluster of the closest mean, as in k-means, and pi and cov are unused.
+// Otherwise this is the E-step, and the log likelihood is returned. The
+// rows are split into the same chunks as in m_step, each a task
+double
+stream_pass(const BinaryMatrix &m, const size_t batch,
+            const vector <double> &pi,
+            const vector <vector <double> > &means,
+            const vector <CovarianceMatrix> &cov,
+            const bool nearest_mean,
+            SufficientStats &stats){
+  const size_t num_samples = m.n_rows(),
+               num_dims = m.n_cols(),
+               num_clusters = means.size();
+  const size_t num_chunks = min(m_step_chunks, num_samples);
+
+  vector <SufficientStats> chunk_stats(num_chunks,
+                                       SufficientStats(num_clusters, num_dims,
+                                                       cov[0].diagonal()));
+  vector <double> chunk_loglik(num_chunks, 0.0);
+#ifdef _OPENMP
+  #pragma omp taskloop grainsize(1) default(shared)
+#endif
+  for(size_t c = 0; c < num_chunks; ++c){
+    const size_t chunk_end = (c + 1)*num_samples/num_chunks;
+    vector <double> gamma;
+    for(size_t lo = c*num_samples/num_chunks; lo < chunk_end; lo += batch){
+      const size_t hi = min(chunk_end, lo + batch);
+      // the rows of a binary matrix are contiguous, so a batch is a view
+      const MatrixView rows(m[lo], hi - lo, num_dims);
+      gamma.assign((hi - lo)*num_clusters, 0.0);
+      if(nearest_mean){
+        for(size_t i = 0; i < hi - lo; ++i){
+          size_t which;
+          double first, second;
+          nearest_centers<0>(rows[i], means, which, first, second);
+          gamma[i*num_clusters + which] = 1.0;
+        }
+      } else
+        chunk_loglik[c] += e_step(gamma, rows, pi, means, cov);
+      chunk_stats[c].accumulate(gamma, rows, means, 0, hi - lo);
+    }
+  }
+
+  double loglik = chunk_loglik[0];
+  for(size_t c = 1; c < num_chunks; ++c){
+    chunk_stats[0].add(chunk_stats[c]);
+    loglik += chunk_loglik[c];
+  }
+  stats = chunk_stats[0];
+  return loglik;
+}
+
+// The steps of cluster_stream: the E-step is a pass over the matrix that
+// also finds the statistics of its responsibilities, from which the
+// M-step only has to take the parameters
+struct
+StreamSteps{
+  const BinaryMatrix &m;
+  size_t batch;
+  SufficientStats &stats;
+  BenchReport &bench;
+
+  StreamSteps(const BinaryMatrix &matrix, const size_t batch_rows,
+              SufficientStats &pass_stats, BenchReport &report) :
+    m(matrix), batch(batch_rows), stats(pass_stats), bench(report) {}
+
+  double e_step(const vector <double> &pi,
+                const vector <vector <double> > &means,
+                const vector <CovarianceMatrix> &cov){
+    PhaseTimer t(bench, "stream_pass", m.n_rows());
+    return stream_pass(m, batch, pi, means, cov, false, stats);
+  }
+
+  void m_step(vector <double> &pi,
+              vector <vector <double> > &means,
+              vector <CovarianceMatrix> &cov){
+    m_step_from_stats(stats, m.n_rows(), pi, means, cov);
+  }
+};
+
+// Returns the clustering BIC of the rows of a binary matrix, keeping
+// only the parameters and their sufficient statistics in memory. The EM
+// steps are the same as in cluster, starting from the k-means centers,
+// and each costs a pass over the matrix
+double
+cluster_stream (const BinaryMatrix &m,
+                const size_t batch,
+                const vector <vector <double> > &centers,
+                const CovarianceModel model,
+                BenchReport &bench){
+  const size_t num_samples = m.n_rows(),
+               num_dims = m.n_cols(),
+               num_clusters = centers.size();
+
+  vector <vector <double> > means = centers;
+  vector <double> pi = vector <double> (num_clusters, 0.0);
+  vector <CovarianceMatrix> cov = vector <CovarianceMatrix> (num_clusters, CovarianceMatrix(num_dims, model));
+  SufficientStats stats(num_clusters, num_dims, cov[0].diagonal());
+
+  // Initial guess of parameters given k means
+  {
+    PhaseTimer t(bench, "stream_pass", num_samples);
+    stream_pass(m, batch, pi, means, cov, true, stats);
+  }
+  m_step_from_stats(stats, num_samples, pi, means, cov);
+
+  StreamSteps steps(m, batch, stats, bench);
+  return run_em(steps, num_samples, pi, means, cov);
+}
+
+// With -b, k-means only sees this many rows of the matrix
+static const size_t kmeans_sample = 100000;
+
+// Rows evenly spaced over a binary matrix, at most max_rows of them
+void
+sample_rows(const BinaryMatrix &m, const size_t max_rows, Matrix &rows){
+  const size_t num_rows = min(max_rows, m.n_rows());
+  rows = Matrix(num_rows, m.n_cols());
+  for(size_t r = 0; r < num_rows; ++r){
+    const size_t i = r*m.n_rows()/num_rows;
+    std::copy(m[i], m[i] + m.n_cols(), rows[r]);
+  }
+}
+
+void
+usage(const char *prog){
+  cerr << "usage: " << prog << " [-k max_k] [-r restarts] [-s stop]"
+       << " [-i] [-S seed] [-b batch] [-c model] [-g] [matrix.bin]"
+       << " <input"
+       << endl
+       << "  -k  largest number of clusters tried (default: 50)" << endl
+       << "  -r  initial assignments per number of clusters, the best"
+       << endl
+       << "      of which is kept (default: 1)" << endl
+       << "  -s  stop once the BIC has risen for this many numbers of"
+       << endl
+       << "      clusters in a row (default: 0, try them all)" << endl
+       << "  -i  find the initial assignments by k-means++ instead of"
+       << endl
+       << "      reading them after the matrix" << endl
+       << "  -S  seed of the k-means++ seeding (default: 1)" << endl
+       << "  -b  read matrix.bin this many rows at a time in every EM"
+       << endl
+       << "      step instead of loading it (implies -i)" << endl
+       << "  -c  covariance matrices: full, diag, spherical or tied (the"
+       << endl
+       << "      same full matrix for all clusters) (default: full)" << endl
+       << "  -g  run the E and M-steps on the GPU (needs a build with"
+       << endl
+       << "      CUDA=1, not with -b)" << endl;
 }
 
 int 
-main(){
-  const size_t max_cl = 50;
+main(int argc, char **argv){
+  size_t max_cl = 50, restarts = 1, patience = 0, batch = 0;
+  bool own_init = false, use_gpu = false;
+  unsigned long seed = 1;
+  CovarianceModel model = full_cov;
+  int opt;
+  while((opt = getopt(argc, argv, "k:r:s:iS:b:c:g")) >= 0){
+    if(opt == 'k') max_cl = strtoul(optarg, 0, 10);
+    else if(opt == 'c'){
+      const std::string name(optarg);
+      if(name == "full") model = full_cov;
+      else if(name == "diag") model = diagonal_cov;
+      else if(name == "spherical") model = spherical_cov;
+      else if(name == "tied") model = tied_cov;
+      else {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+    }
+    else if(opt == 'b') batch = strtoul(optarg, 0, 10);
+    else if(opt == 'i') own_init = true;
+    else if(opt == 'g') use_gpu = true;
+    else if(opt == 'S') seed = strtoul(optarg, 0, 10);
+    else if(opt == 'r') restarts = strtoul(optarg, 0, 10);
+    else if(opt == 's') patience = strtoul(optarg, 0, 10);
+    else {
+      usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if(argc - optind > 1 || max_cl == 0 || restarts == 0 ||
+     (batch > 0 && optind == argc) || (batch > 0 && use_gpu)){
+    usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+#ifndef GMM_WITH_CUDA
+  if(use_gpu){
+    cerr << "ERROR:\t-g needs gmm to be built with CUDA=1" << endl;
+    return EXIT_FAILURE;
+  }
+#endif
+
   size_t num_samples, num_dims;
-  cin >> num_samples >> num_dims;
+  // The samples of stdin, or the rows k-means sees when streaming
+  Matrix text_in;
+  BinaryMatrix *binary = 0;
+  BenchReport bench("gmm");
+  const double start = BenchReport::now();
+
+  if(optind < argc){
+    try {
+      binary = new BinaryMatrix(argv[optind]);
+    }
+    catch (std::exception &e) {
+      cerr << "ERROR:\t" << e.what() << endl;
+      return EXIT_FAILURE;
+    }
+  }
 
-  vector <vector <double> > in  = vector < vector <double> > (num_samples, vector <double> (num_dims, 0.0));
-  for(size_t i = 0; i < num_samples; i++)
-    for(size_t j = 0; j < num_dims; j++)
-      cin >> in[i][j];
+  // Streaming, only a sample of the rows is loaded, for k-means
+  if(batch > 0){
+    sample_rows(*binary, kmeans_sample, text_in);
+    num_samples = binary->n_rows();
+    own_init = true;
+
+  // With a binary matrix file, stdin only has the k-means assignments, if any
+  } else if(binary){
+    num_samples = binary->n_rows();
+  } else {
+    cin >> num_samples >> num_dims;
+
+    text_in = Matrix(num_samples, num_dims);
+    for(size_t i = 0; i < num_samples; i++)
+      for(size_t j = 0; j < num_dims; j++)
+        cin >> text_in[i][j];
+  }
+  // The rows of a binary matrix file are used where they are, not copied
+  const MatrixView in = (binary && batch == 0) ?
+    MatrixView(binary->rows(), binary->n_rows(), binary->n_cols()) :
+    MatrixView(text_in);
+  bench.add("parse", BenchReport::now() - start, num_samples);
+  bench.set_size(num_samples, in.n_cols);
+
+#ifdef GMM_WITH_CUDA
+  // The samples go to the device once, for all the jobs
+  GpuSamples *gpu_samples = 0;
+  if(use_gpu){
+    PhaseTimer t(bench, "gpu_init", num_samples);
+    gpu_samples = new GpuSamples(in);
+  }
+#endif
 
-  vector <vector <size_t> > kmeans_init  = vector <vector <size_t> > (max_cl, vector <size_t> (num_samples, 0));
-  for(size_t k = 0; k < max_cl; ++k)
-    for(size_t i = 0; i < num_samples; ++i)
-      cin >> kmeans_init[k][i];
+  // restarts lines for k = 1, then restarts lines for k = 2, ...
+  const size_t num_jobs = max_cl*restarts;
+  vector <vector <size_t> > kmeans_init  = vector <vector <size_t> > (own_init ? 0 : num_jobs, vector <size_t> (num_samples, 0));
+  // With -i each restart has its own seed, and only the centers of its
+  // k-means are kept. The sweep finds them as it needs them when it can
+  // stop early, and otherwise they are all found first, with every
+  // thread on each k-means
+  vector <KMeansChain *> kmeans_chains;
+  if(own_init){
+    for(size_t r = 0; r < restarts; ++r){
+      kmeans_chains.push_back(new KMeansChain(max_cl, seed + r));
+      if(!patience)
+        kmeans_chains[r]->centers(in, max_cl, bench);
+    }
+  } else {
+    for(size_t job = 0; job < num_jobs; ++job)
+      for(size_t i = 0; i < num_samples; ++i)
+        cin >> kmeans_init[job][i];
+    if(!cin){
+      cerr << "ERROR:\texpected " << num_jobs << " initial assignments" << endl;
+      return EXIT_FAILURE;
+    }
+  }
 
-  vector<double> ics = vector<double> (max_cl, 0.0);
+  ////////////////////////////////////////////////
+  // Every (k, restart) pair is a job, handed to the threads one at a
+  // time as they become free. The largest k cost the most, so they go
+  // first, unless the sweep can stop early, which needs the k in order.
+  // The BIC of k is known once all its restarts are done, and only the
+  // k of the done prefix decide when to stop, so the output does not
+  // depend on the number of threads
+  ////////////////////////////////////////////////
+  vector <double> ics = vector <double> (max_cl, 0.0);
+  vector <size_t> restarts_left = vector <size_t> (max_cl, restarts);
+  size_t last_cl = max_cl, done_cl = 0, rises = 0;
 
 #ifdef _OPENMP
-  #pragma omp parallel for 
+  #pragma omp parallel for schedule(dynamic, 1)
+#endif
+  for(size_t n = 0; n < num_jobs; ++n){
+    const size_t job = patience ? n : num_jobs - 1 - n;
+    const size_t cl = job/restarts + 1;
+
+    bool skip;
+#ifdef _OPENMP
+    #pragma omp critical(sweep)
+#endif
+    skip = cl > last_cl;
+    if(skip)
+      continue;
+
+#ifdef _OPENMP
+    #pragma omp critical(sweep)
 #endif
- for(size_t cl = 1; cl <= max_cl; ++cl){
     cerr << "Calculating k = " << cl << "...\n";
-    ics[cl - 1] = cluster(in,cl, kmeans_init[cl - 1]);
+    // Streaming, EM starts from the k-means centers, and otherwise from
+    // the assignment of the samples to them
+    vector <size_t> assignment;
+    const vector <vector <double> > *centers = 0;
+    if(own_init){
+      centers = &kmeans_chains[job%restarts]->centers(in, cl, bench);
+      if(batch == 0)
+        nearest_assignment(in, *centers, assignment);
+    }
+    const vector <size_t> &init = own_init ? assignment : kmeans_init[job];
+
+    double ic;
+    {
+      PhaseTimer t(bench, "cluster", num_samples);
+#ifdef GMM_WITH_CUDA
+      if(gpu_samples)
+        ic = cluster_gpu(in, *gpu_samples, cl, init, model, bench);
+      else
+#endif
+      ic = batch > 0 ?
+        cluster_stream(*binary, batch, *centers, model, bench) :
+        cluster(in, cl, init, model, bench);
+    }
+
+#ifdef _OPENMP
+    #pragma omp critical(sweep)
+#endif
+    {
+      if(restarts_left[cl - 1] == restarts || ic < ics[cl - 1])
+        ics[cl - 1] = ic;
+      --restarts_left[cl - 1];
+      while(done_cl < last_cl && restarts_left[done_cl] == 0){
+        ++done_cl;
+        rises = (done_cl > 1 && ics[done_cl - 1] > ics[done_cl - 2]) ?
+          rises + 1 : 0;
+        if(patience && rises >= patience)
+          last_cl = done_cl;
+      }
+    }
   }
 
   size_t which_min = 0;
-  for(size_t i = 0; i < max_cl; ++i)
+  for(size_t i = 0; i < last_cl; ++i)
     cout << i+1 << "\t" << ics[i] << "\n";
   
-  for(size_t i = 1; i < max_cl; ++i)
+  for(size_t i = 1; i < last_cl; ++i)
     if(ics[i] < ics[which_min])
       which_min = i;
 
   cout << "Number of clusters: " << which_min + 1 << endl;
-}
 
+  bench.add("total", BenchReport::now() - start, num_samples);
+  bench.write();
+  delete binary;
+  for(size_t r = 0; r < kmeans_chains.size(); ++r)
+    delete kmeans_chains[r];
+#ifdef GMM_WITH_CUDA
+  delete gpu_samples;
+#endif
+}
@@ -0,0 +1,315 @@
+/* gmm_cuda: the E-step and the sufficient statistics of gmm on a GPU
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "gmm_cuda.hpp"
+#include "cuda_reduce.cuh"
+
+#include <cuda_runtime.h>
+
+#include <iostream>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+
+using std::vector;
+using std::cerr;
+using std::endl;
+using std::min;
+
+// The E-step has a thread per sample, in at most this many blocks of
+// block_size (see cuda_reduce.cuh)
+static const size_t max_blocks = 65535;
+
+// As with the errors of the input, gmm stops on any error of the device
+static void
+check(const cudaError_t e, const char *what){
+  if(e != cudaSuccess){
+    cerr << "ERROR:\t" << what << ": " << cudaGetErrorString(e) << endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+template <typename T>
+static T *
+device_alloc(const size_t n){
+  void *ptr = 0;
+  check(cudaMalloc(&ptr, n*sizeof(T)), "cudaMalloc");
+  return static_cast<T*>(ptr);
+}
+
+////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////
+/// #    # ####### ######  #     # ####### #       #####
+/// #   #  #       #     # ##    # #       #      #     #
+/// #  #   #       #     # # #   # #       #      #
+/// ###    #####   ######  #  #  # #####   #       #####
+/// #  #   #       #   #   #   # # #       #            #
+/// #   #  #       #    #  #    ## #       #      #     #
+/// #    # ####### #     # #     # ####### ######  #####
+////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////
+
+// The E-step of sample i, as log_densities and e_step in gmm.cpp: the log
+// densities go to gamma, which then becomes the responsibilities. solved
+// is the work space of the triangular solves
+__global__ static void
+e_step_kernel(const double *x, const size_t num_samples,
+              const size_t num_dims, const size_t num_clusters,
+              const double *pi, const double *means,
+              const double *factors, const double *det, const int kind,
+              double *solved, double *gamma, double *sample_loglik){
+  const size_t n = num_samples;
+  const double log_2pi = double(num_dims)*log(2*M_PI);
+  for(size_t i = blockIdx.x*block_size + threadIdx.x; i < n;
+      i += gridDim.x*block_size){
+
+    // With a tied covariance, L^{-1} x once for all clusters
+    if(kind == gpu_tied)
+      for(size_t j = 0; j < num_dims; ++j){
+        double v = x[j*n + i];
+        for(size_t jp = 0; jp < j; ++jp)
+          v -= factors[j*num_dims + jp]*solved[jp*n + i];
+        solved[j*n + i] = v/factors[j*num_dims + j];
+      }
+
+    for(size_t k = 0; k < num_clusters; ++k){
+      const double *mu = means + k*num_dims;
+      double exp_val = 0.0;
+      if(kind == gpu_tied){
+        for(size_t j = 0; j < num_dims; ++j){
+          const double d = solved[j*n + i] - mu[j];
+          exp_val += d*d;
+        }
+      } else if(kind == gpu_diagonal){
+        const double *sd = factors + k*num_dims;
+        for(size_t j = 0; j < num_dims; ++j){
+          const double d = (x[j*n + i] - mu[j])*(1.0/sd[j]);
+          exp_val += d*d;
+        }
+      } else {
+        // L z = x - mu by forward substitution
+        const double *l = factors + k*num_dims*num_dims;
+        for(size_t j = 0; j < num_dims; ++j){
+          double v = x[j*n + i] - mu[j];
+          for(size_t jp = 0; jp < j; ++jp)
+            v -= l[j*num_dims + jp]*solved[jp*n + i];
+          v /= l[j*num_dims + j];
+          solved[j*n + i] = v;
+          exp_val += v*v;
+        }
+      }
+      gamma[k*n + i] = -0.5*(det[k] + log_2pi + exp_val);
+    }
+
+    // Summation of small exps, as log_sum_of_exps
+    size_t which_max = 0;
+    for(size_t k = 1; k < num_clusters; ++k)
+      if(gamma[k*n + i] > gamma[which_max*n + i])
+        which_max = k;
+    const double top = gamma[which_max*n + i];
+    double ans = 0.0;
+    for(size_t k = 0; k < num_clusters; ++k)
+      ans += pi[k]*exp(gamma[k*n + i] - top);
+    const double sum = top + log(ans);
+
+    sample_loglik[i] = sum;
+    for(size_t k = 0; k < num_clusters; ++k)
+      gamma[k*n + i] = (pi[k] == 0.0) ? 0.0 :
+        exp((log(pi[k]) + gamma[k*n + i]) - sum);
+  }
+}
+
+// One statistic of one cluster per block: the responsibilities times
+// the coordinates stat_dims[2s] and stat_dims[2s + 1] of the shifted
+// samples (1 for -1), summed over the samples
+__global__ static void
+stats_kernel(const double *x, const double *gamma, const double *shift,
+             const int *stat_dims, const size_t num_samples,
+             const size_t num_dims, const size_t num_stats,
+             double *values){
+  const size_t n = num_samples;
+  const size_t k = blockIdx.x/num_stats, s = blockIdx.x % num_stats;
+  const int a = stat_dims[2*s], b = stat_dims[2*s + 1];
+  const double *w = gamma + k*n;
+  double ans = 0.0;
+  for(size_t i = threadIdx.x; i < n; i += block_size){
+    double v = w[i];
+    if(a >= 0)
+      v *= x[a*n + i] - shift[k*num_dims + a];
+    if(b >= 0)
+      v *= x[b*n + i] - shift[k*num_dims + b];
+    ans += v;
+  }
+  ans = block_sum(ans);
+  if(threadIdx.x == 0)
+    values[blockIdx.x] = ans;
+}
+
+////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////
+
+GpuSamples::GpuSamples(const MatrixView &in){
+  num_samples = in.n_rows;
+  num_dims = in.n_cols;
+  vector <double> columns(num_samples*num_dims);
+  for(size_t i = 0; i < num_samples; ++i)
+    for(size_t j = 0; j < num_dims; ++j)
+      columns[j*num_samples + i] = in[i][j];
+  x = device_alloc<double>(columns.size());
+  check(cudaMemcpy(x, &columns[0], columns.size()*sizeof(double),
+                   cudaMemcpyHostToDevice), "cudaMemcpy");
+}
+
+GpuSamples::~GpuSamples(){
+  cudaFree(x);
+}
+
+GpuEM::GpuEM(const GpuSamples &s, const size_t k, const bool diagonal_stats)
+  : samples(s), num_clusters(k){
+  const size_t n = samples.num_samples, d = samples.num_dims;
+  num_entries = diagonal_stats ? d : d*(d + 1)/2;
+  num_stats = 1 + d + num_entries;
+
+  cudaStream_t st;
+  check(cudaStreamCreate(&st), "cudaStreamCreate");
+  stream = st;
+  gamma = device_alloc<double>(num_clusters*n);
+  solved = device_alloc<double>(d*n);
+  // the last entry is the total
+  sample_loglik = device_alloc<double>(n + 1);
+  params = device_alloc<double>(num_clusters*(2 + 2*d + d*d));
+  stat_values = device_alloc<double>(num_clusters*num_stats);
+
+  // weight, then sum, then outer in the order of SufficientStats
+  vector <int> dims;
+  dims.push_back(-1);
+  dims.push_back(-1);
+  for(size_t j = 0; j < d; ++j){
+    dims.push_back(j);
+    dims.push_back(-1);
+  }
+  for(size_t j = 0; j < d; ++j)
+    for(size_t jp = j; jp < (diagonal_stats ? j + 1 : d); ++jp){
+      dims.push_back(j);
+      dims.push_back(jp);
+    }
+  stat_dims = device_alloc<int>(dims.size());
+  check(cudaMemcpyAsync(stat_dims, &dims[0], dims.size()*sizeof(int),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+  check(cudaStreamSynchronize(st), "cudaStreamSynchronize");
+}
+
+GpuEM::~GpuEM(){
+  cudaFree(gamma);
+  cudaFree(solved);
+  cudaFree(sample_loglik);
+  cudaFree(params);
+  cudaFree(stat_dims);
+  cudaFree(stat_values);
+  cudaStreamDestroy(static_cast<cudaStream_t>(stream));
+}
+
+void
+GpuEM::set_assignment(const vector <size_t> &which_cluster){
+  const size_t n = samples.num_samples;
+  vector <double> init(num_clusters*n, 0.0);
+  for(size_t i = 0; i < n; ++i)
+    init[which_cluster[i]*n + i] = 1.0;
+  cudaStream_t st = static_cast<cudaStream_t>(stream);
+  check(cudaMemcpyAsync(gamma, &init[0], init.size()*sizeof(double),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+  check(cudaStreamSynchronize(st), "cudaStreamSynchronize");
+}
+
+double
+GpuEM::e_step(const vector <double> &pi,
+              const vector <double> &means,
+              const vector <double> &factors,
+              const vector <double> &det,
+              const GpuCovariance kind){
+  const size_t n = samples.num_samples, d = samples.num_dims;
+  cudaStream_t st = static_cast<cudaStream_t>(stream);
+
+  double *pi_d = params, *means_d = pi_d + num_clusters,
+    *factors_d = means_d + num_clusters*d,
+    *det_d = factors_d + num_clusters*d*d;
+  check(cudaMemcpyAsync(pi_d, &pi[0], num_clusters*sizeof(double),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+  check(cudaMemcpyAsync(means_d, &means[0], means.size()*sizeof(double),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+  check(cudaMemcpyAsync(factors_d, &factors[0],
+                        factors.size()*sizeof(double),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+  check(cudaMemcpyAsync(det_d, &det[0], num_clusters*sizeof(double),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+
+  const size_t blocks = min(max_blocks, (n + block_size - 1)/block_size);
+  e_step_kernel<<<blocks, block_size, 0, st>>>(samples.x, n, d,
+                                               num_clusters, pi_d, means_d,
+                                               factors_d, det_d, kind,
+                                               solved, gamma,
+                                               sample_loglik);
+  check(cudaGetLastError(), "e_step_kernel");
+  sum_kernel<<<1, block_size, 0, st>>>(sample_loglik, n, false,
+                                       sample_loglik + n);
+  check(cudaGetLastError(), "sum_kernel");
+
+  double loglik;
+  check(cudaMemcpyAsync(&loglik, sample_loglik + n, sizeof(double),
+                        cudaMemcpyDeviceToHost, st), "cudaMemcpy");
+  check(cudaStreamSynchronize(st), "cudaStreamSynchronize");
+  return loglik;
+}
+
+void
+GpuEM::stats(const vector <double> &shift,
+             vector <double> &weight,
+             vector <double> &sum,
+             vector <double> &outer){
+  const size_t n = samples.num_samples, d = samples.num_dims;
+  cudaStream_t st = static_cast<cudaStream_t>(stream);
+
+  double *shift_d = params + num_clusters*(2 + d + d*d);
+  check(cudaMemcpyAsync(shift_d, &shift[0], num_clusters*d*sizeof(double),
+                        cudaMemcpyHostToDevice, st), "cudaMemcpy");
+  stats_kernel<<<num_clusters*num_stats, block_size, 0, st>>>(samples.x,
+                                                              gamma, shift_d,
+                                                              stat_dims, n,
+                                                              d, num_stats,
+                                                              stat_values);
+  check(cudaGetLastError(), "stats_kernel");
+
+  vector <double> values(num_clusters*num_stats);
+  check(cudaMemcpyAsync(&values[0], stat_values,
+                        values.size()*sizeof(double),
+                        cudaMemcpyDeviceToHost, st), "cudaMemcpy");
+  check(cudaStreamSynchronize(st), "cudaStreamSynchronize");
+
+  weight.resize(num_clusters);
+  sum.resize(num_clusters*d);
+  outer.resize(num_clusters*num_entries);
+  for(size_t k = 0; k < num_clusters; ++k){
+    const double *v = &values[k*num_stats];
+    weight[k] = v[0];
+    for(size_t j = 0; j < d; ++j)
+      sum[k*d + j] = v[1 + j];
+    for(size_t e = 0; e < num_entries; ++e)
+      outer[k*num_entries + e] = v[1 + d + e];
+  }
+}
@@ -0,0 +1,112 @@
+/* gmm_cuda: the E-step and the sufficient statistics of gmm on a GPU
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// Built with GMM_WITH_CUDA (make CUDA=1). The samples go to the device
+// once for all the jobs of the sweep, and the responsibilities of an EM
+// run never leave it: every iteration sends the parameters, O(K D^2),
+// and gets back the log likelihood and the sufficient statistics of the
+// M-step, also O(K D^2), while the O(N K D^2) work stays on the device.
+// The Cholesky factors of the M-step are still found on the host. This
+// header does not need the CUDA headers, so gmm.cpp is still compiled by
+// the host compiler.
+
+#ifndef GMM_CUDA_HPP
+#define GMM_CUDA_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "matrix.hpp"
+
+// The samples on the device, column-major, so the threads of a warp, one
+// per sample, read consecutive entries
+class
+GpuSamples{
+public:
+  explicit GpuSamples(const MatrixView &in);
+  ~GpuSamples();
+
+  size_t num_samples;
+  size_t num_dims;
+  double *x;
+
+private:
+  GpuSamples(const GpuSamples &);
+  GpuSamples &operator=(const GpuSamples &);
+};
+
+// How the factors given to GpuEM::e_step are used: the Cholesky factor of
+// each cluster, only its diagonal, or one factor for all clusters
+enum GpuCovariance {gpu_full, gpu_diagonal, gpu_tied};
+
+// The responsibilities of one EM run, and the work space of its steps,
+// on a stream of its own, so the jobs of all threads share the device
+class
+GpuEM{
+public:
+  GpuEM(const GpuSamples &samples, const size_t num_clusters,
+        const bool diagonal_stats);
+  ~GpuEM();
+
+  // Responsibilities of 1 in the cluster of each sample
+  void set_assignment(const std::vector <size_t> &which_cluster);
+
+  // The responsibilities of the parameters, as e_step in gmm.cpp, and
+  // the log likelihood. means and factors are row-major, one cluster
+  // after the other: factors has the K Cholesky factors for gpu_full, K
+  // diagonals for gpu_diagonal, and the one factor L for gpu_tied, with
+  // which the means are then L^{-1} mu. det is the log determinant of
+  // each covariance
+  double e_step(const std::vector <double> &pi,
+                const std::vector <double> &means,
+                const std::vector <double> &factors,
+                const std::vector <double> &det,
+                const GpuCovariance kind);
+
+  // The sufficient statistics of the responsibilities for the samples
+  // minus shift (K x D), in the layout of SufficientStats in gmm.cpp
+  void stats(const std::vector <double> &shift,
+             std::vector <double> &weight,
+             std::vector <double> &sum,
+             std::vector <double> &outer);
+
+private:
+  const GpuSamples &samples;
+  size_t num_clusters;
+  size_t num_entries;
+  // weight, sum and outer of a cluster
+  size_t num_stats;
+  void *stream;
+  // K x N: row k has the responsibilities of cluster k
+  double *gamma;
+  // D x N, the samples solved against a Cholesky factor
+  double *solved;
+  double *sample_loglik;
+  // pi, means, factors and det of the last e_step, then the shift of
+  // the last stats
+  double *params;
+  // the two coordinates of the samples in each statistic, -1 for none
+  int *stat_dims;
+  double *stat_values;
+
+  GpuEM(const GpuEM &);
+  GpuEM &operator=(const GpuEM &);
+};
+
+#endif
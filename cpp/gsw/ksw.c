@@ -25,6 +25,7 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <assert.h>
 #include <emmintrin.h>
 #include "ksw.h"
@@ -44,6 +45,48 @@
 
 const kswr_t g_defr = { 0, -1, -1, -1, -1, -1, -1 };
 
+typedef struct {
+	size_t m;
+	void *p;
+} kswbuf_t;
+
+// scratch memory reused across calls; every block grows with realloc(), so
+// the malloc_wrap.h hooks see all of it
+struct _ksw_ctx_t {
+	kswbuf_t q, qr; // query profile and profile of the reversed query for KSW_XSTART
+	kswbuf_t rs;    // reversed prefixes of the query and the target for KSW_XSTART
+	kswbuf_t b;     // row maxima of ksw_u8()/ksw_i16()
+	kswbuf_t eh, qp, z;
+};
+
+// a 16-byte aligned block of at least size bytes from b; the contents are not kept
+static void *ksw_buf(kswbuf_t *b, size_t size)
+{
+	if (size + 15 > b->m) {
+		b->m = size + 15 > b->m<<1? size + 15 : b->m<<1;
+		b->p = realloc(b->p, b->m);
+	}
+	return (void*)(((size_t)b->p + 15) >> 4 << 4);
+}
+
+ksw_ctx_t *ksw_ctx_init(void)
+{
+	return (ksw_ctx_t*)calloc(1, sizeof(ksw_ctx_t));
+}
+
+static void ksw_ctx_free(ksw_ctx_t *ctx)
+{
+	free(ctx->q.p); free(ctx->qr.p); free(ctx->rs.p); free(ctx->b.p);
+	free(ctx->eh.p); free(ctx->qp.p); free(ctx->z.p);
+}
+
+void ksw_ctx_destroy(ksw_ctx_t *ctx)
+{
+	if (ctx == 0) return;
+	ksw_ctx_free(ctx);
+	free(ctx);
+}
+
 struct _kswq_t {
 	int qlen, slen;
 	uint8_t shift, mdiff, max, size;
@@ -58,18 +101,21 @@ struct _kswq_t {
  * @param query  Query sequence
  * @param m      Size of the alphabet
  * @param mat    Scoring matrix in a one-dimension array
+ * @param buf    Memory to reuse for the profile; if 0, it is allocated
  *
  * @return       Query data structure
  */
-kswq_t *ksw_qinit(int size, int qlen, const uint8_t *query, int m, const int8_t *mat)
+static kswq_t *ksw_qinit_buf(kswbuf_t *buf, int size, int qlen, const uint8_t *query, int m, const int8_t *mat)
 {
 	kswq_t *q;
 	int slen, a, tmp, p;
+	size_t len;
 
 	size = size > 1? 2 : 1;
 	p = 8 * (3 - size); // # values per __m128i
 	slen = (qlen + p - 1) / p; // segmented length
-	q = (kswq_t*)malloc(sizeof(kswq_t) + 256 + 16 * slen * (m + 4)); // a single block of memory
+	len = sizeof(kswq_t) + 256 + 16 * slen * (m + 4);
+	q = (kswq_t*)(buf? ksw_buf(buf, len) : malloc(len)); // a single block of memory
 	q->qp = (__m128i*)(((size_t)q + sizeof(kswq_t) + 15) >> 4 << 4); // align memory
 	q->H0 = q->qp + slen * m;
 	q->H1 = q->H0 + slen;
@@ -109,7 +155,18 @@ kswq_t *ksw_qinit(int size, int qlen, const uint8_t *query, int m, const int8_t
 	return q;
 }
 
-kswr_t ksw_u8(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) // the first gap costs -(_o+_e)
+kswq_t *ksw_qinit(int size, int qlen, const uint8_t *query, int m, const int8_t *mat)
+{
+	return ksw_qinit_buf(0, size, qlen, query, m, mat);
+}
+
+kswq_t *ksw_ctx_qinit(ksw_ctx_t *ctx, int size, int qlen, const uint8_t *query, int m, const int8_t *mat)
+{
+	return ksw_qinit_buf(&ctx->q, size, qlen, query, m, mat);
+}
+
+// bb keeps the b array across calls; if 0, it is freed on return
+static kswr_t ksw_u8_buf(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra, kswbuf_t *bb) // the first gap costs -(_o+_e)
 {
 	int slen, i, m_b, n_b, te = -1, gmax = 0, minsc, endsc;
 	uint64_t *b;
@@ -128,7 +185,8 @@ kswr_t ksw_u8(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del
 	r = g_defr;
 	minsc = (xtra&KSW_XSUBO)? xtra&0xffff : 0x10000;
 	endsc = (xtra&KSW_XSTOP)? xtra&0xffff : 0x10000;
-	m_b = n_b = 0; b = 0;
+	n_b = 0;
+	m_b = bb? bb->m / 8 : 0; b = bb? (uint64_t*)bb->p : 0;
 	zero = _mm_set1_epi32(0);
 	oe_del = _mm_set1_epi8(_o_del + _e_del);
 	e_del = _mm_set1_epi8(_e_del);
@@ -216,7 +274,7 @@ end_loop16:
 			if ((int)*t > max) max = *t, r.qe = i / 16 + i % 16 * slen;
 			else if ((int)*t == max && (tmp = i / 16 + i % 16 * slen) < r.qe) r.qe = tmp; 
 		//printf("%d,%d\n", max, gmax);
-		if (b) {
+		if (n_b) {
 			i = (r.score + q->max - 1) / q->max;
 			low = te - i; high = te + i;
 			for (i = 0; i < n_b; ++i) {
@@ -226,11 +284,13 @@ end_loop16:
 			}
 		}
 	}
-	free(b);
+	if (bb) bb->p = b, bb->m = (size_t)m_b * 8;
+	else free(b);
 	return r;
 }
 
-kswr_t ksw_i16(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra) // the first gap costs -(_o+_e)
+// bb keeps the b array across calls; if 0, it is freed on return
+static kswr_t ksw_i16_buf(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra, kswbuf_t *bb) // the first gap costs -(_o+_e)
 {
 	int slen, i, m_b, n_b, te = -1, gmax = 0, minsc, endsc;
 	uint64_t *b;
@@ -248,7 +308,8 @@ kswr_t ksw_i16(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_de
 	r = g_defr;
 	minsc = (xtra&KSW_XSUBO)? xtra&0xffff : 0x10000;
 	endsc = (xtra&KSW_XSTOP)? xtra&0xffff : 0x10000;
-	m_b = n_b = 0; b = 0;
+	n_b = 0;
+	m_b = bb? bb->m / 8 : 0; b = bb? (uint64_t*)bb->p : 0;
 	zero = _mm_set1_epi32(0);
 	oe_del = _mm_set1_epi16(_o_del + _e_del);
 	e_del = _mm_set1_epi16(_e_del);
@@ -320,7 +381,7 @@ end_loop8:
 		for (i = 0, r.qe = -1; i < qlen; ++i, ++t)
 			if ((int)*t > max) max = *t, r.qe = i / 8 + i % 8 * slen;
 			else if ((int)*t == max && (tmp = i / 8 + i % 8 * slen) < r.qe) r.qe = tmp; 
-		if (b) {
+		if (n_b) {
 			i = (r.score + q->max - 1) / q->max;
 			low = te - i; high = te + i;
 			for (i = 0; i < n_b; ++i) {
@@ -330,38 +391,65 @@ end_loop8:
 			}
 		}
 	}
-	free(b);
+	if (bb) bb->p = b, bb->m = (size_t)m_b * 8;
+	else free(b);
 	return r;
 }
 
-static inline void revseq(int l, uint8_t *s)
+kswr_t ksw_u8(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra)
 {
-	int i, t;
-	for (i = 0; i < l>>1; ++i)
-		t = s[i], s[i] = s[l - 1 - i], s[l - 1 - i] = t;
+	return ksw_u8_buf(q, tlen, target, _o_del, _e_del, _o_ins, _e_ins, xtra, 0);
+}
+
+kswr_t ksw_i16(kswq_t *q, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra)
+{
+	return ksw_i16_buf(q, tlen, target, _o_del, _e_del, _o_ins, _e_ins, xtra, 0);
+}
+
+static inline void revcpy(int l, const uint8_t *s, uint8_t *d)
+{
+	int i;
+	for (i = 0; i < l; ++i)
+		d[i] = s[l - 1 - i];
+}
+
+// find the start positions of r by aligning the reversed prefixes ending at r->te and r->qe;
+// the reversed copies live in the context, so query and target are left untouched
+static void ksw_start(ksw_ctx_t *ctx, kswr_t *r, int size, const uint8_t *query, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins)
+{
+	kswq_t *q;
+	kswr_t rr;
+	int ql = r->qe + 1, tl = r->te + 1; // +1 because qe/te points to the exact end, not the position after the end
+	uint8_t *rq = (uint8_t*)ksw_buf(&ctx->rs, ql + tl), *rt = rq + ql;
+	revcpy(ql, query, rq); revcpy(tl, target, rt);
+	q = ksw_qinit_buf(&ctx->qr, size, ql, rq, m, mat);
+	rr = (size == 2? ksw_i16_buf : ksw_u8_buf)(q, tl, rt, o_del, e_del, o_ins, e_ins, KSW_XSTOP | r->score, &ctx->b);
+	if (r->score == rr.score)
+		r->tb = r->te - rr.te, r->qb = r->qe - rr.qe;
+}
+
+kswr_t ksw_align2_ctx(ksw_ctx_t *ctx, int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswq_t *q)
+{
+	kswr_t r;
+
+	if (q == 0) q = ksw_ctx_qinit(ctx, (xtra&KSW_XBYTE)? 1 : 2, qlen, query, m, mat);
+	r = (q->size == 2? ksw_i16_buf : ksw_u8_buf)(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra, &ctx->b);
+	if ((xtra&KSW_XSTART) == 0 || ((xtra&KSW_XSUBO) && r.score < (xtra&0xffff))) return r;
+	ksw_start(ctx, &r, q->size, query, target, m, mat, o_del, e_del, o_ins, e_ins);
+	return r;
 }
 
 kswr_t ksw_align2(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswq_t **qry)
 {
-	int size;
+	ksw_ctx_t ctx = {{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}};
 	kswq_t *q;
-	kswr_t r, rr;
-	kswr_t (*func)(kswq_t*, int, const uint8_t*, int, int, int, int, int);
+	kswr_t r;
 
 	q = (qry && *qry)? *qry : ksw_qinit((xtra&KSW_XBYTE)? 1 : 2, qlen, query, m, mat);
 	if (qry && *qry == 0) *qry = q;
-	func = q->size == 2? ksw_i16 : ksw_u8;
-	size = q->size;
-	r = func(q, tlen, target, o_del, e_del, o_ins, e_ins, xtra);
+	r = ksw_align2_ctx(&ctx, qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, xtra, q);
 	if (qry == 0) free(q);
-	if ((xtra&KSW_XSTART) == 0 || ((xtra&KSW_XSUBO) && r.score < (xtra&0xffff))) return r;
-	revseq(r.qe + 1, query); revseq(r.te + 1, target); // +1 because qe/te points to the exact end, not the position after the end
-	q = ksw_qinit(size, r.qe + 1, query, m, mat);
-	rr = func(q, tlen, target, o_del, e_del, o_ins, e_ins, KSW_XSTOP | r.score);
-	revseq(r.qe + 1, query); revseq(r.te + 1, target);
-	free(q);
-	if (r.score == rr.score)
-		r.tb = r.te - rr.te, r.qb = r.qe - rr.qe;
+	ksw_ctx_free(&ctx);
 	return r;
 }
 
@@ -370,6 +458,236 @@ kswr_t ksw_align(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, con
 	return ksw_align2(qlen, query, tlen, target, m, mat, gapo, gape, gapo, gape, xtra, qry);
 }
 
+/************************************
+ *** Inter-sequence batch SW (SIMD) ***
+ ************************************/
+
+/* Every lane of a register holds a different query, all aligned against the
+ * same target, so the query dimension needs no striping and no lazy-F loop:
+ * F is carried from one column to the next in the same register. This pays
+ * off for many short queries, where the striped loop of ksw_u8() is only a
+ * few vectors long. Scores are unsigned bytes shifted as in ksw_u8(); with
+ * AVX2 there are 32 lanes per register, otherwise 16 (SSE2). */
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#define KB_LANES 32
+typedef __m256i kb_vec_t;
+#define kb_zero()        _mm256_setzero_si256()
+#define kb_set1(x)       _mm256_set1_epi8(x)
+#define kb_load(p)       _mm256_load_si256(p)
+#define kb_store(p, x)   _mm256_store_si256((p), (x))
+#define kb_adds(a, b)    _mm256_adds_epu8((a), (b))
+#define kb_subs(a, b)    _mm256_subs_epu8((a), (b))
+#define kb_max(a, b)     _mm256_max_epu8((a), (b))
+#define kb_and(a, b)     _mm256_and_si256((a), (b))
+#define kb_blend(m, a, b) _mm256_blendv_epi8((b), (a), (m)) // m? a : b, bytewise
+#else
+#define KB_LANES 16
+typedef __m128i kb_vec_t;
+#define kb_zero()        _mm_setzero_si128()
+#define kb_set1(x)       _mm_set1_epi8(x)
+#define kb_load(p)       _mm_load_si128(p)
+#define kb_store(p, x)   _mm_store_si128((p), (x))
+#define kb_adds(a, b)    _mm_adds_epu8((a), (b))
+#define kb_subs(a, b)    _mm_subs_epu8((a), (b))
+#define kb_max(a, b)     _mm_max_epu8((a), (b))
+#define kb_and(a, b)     _mm_and_si128((a), (b))
+#define kb_blend(m, a, b) _mm_or_si128(_mm_and_si128((m), (a)), _mm_andnot_si128((m), (b)))
+#endif
+
+struct _kswb_t {
+	int n, n_grp, m;
+	uint8_t shift, max;
+	int *qmax;      // length of the longest query of each group
+	size_t *off;    // offset of the vectors of each group from base
+	kb_vec_t *base; // per group: qp[m*qmax], V[qmax], H[qmax], E[qmax], Hmax[qmax]
+};
+
+int ksw_batch_width(void) { return KB_LANES; }
+
+/**
+ * Initialize the batch profile of n queries, KB_LANES queries per group.
+ * V[j] has all bits set in the lanes whose query is longer than j.
+ */
+kswb_t *ksw_binit(int n, const int *qlens, uint8_t *const *queries, int m, const int8_t *mat)
+{
+	kswb_t *b;
+	int g, a, j, k, n_grp = (n + KB_LANES - 1) / KB_LANES, min = 127, max = 0;
+	size_t n_vec = 0, head;
+
+	for (g = 0; g < n_grp; ++g) {
+		int qmax = 0;
+		for (k = g * KB_LANES; k < n && k < (g + 1) * KB_LANES; ++k)
+			qmax = qmax > qlens[k]? qmax : qlens[k];
+		n_vec += (size_t)qmax * (m + 4);
+	}
+	head = sizeof(kswb_t) + n_grp * (sizeof(int) + sizeof(size_t));
+	b = (kswb_t*)malloc(head + sizeof(kb_vec_t) * (n_vec + 1)); // a single block of memory
+	b->n = n; b->n_grp = n_grp; b->m = m;
+	b->off = (size_t*)((uint8_t*)b + sizeof(kswb_t));
+	b->qmax = (int*)(b->off + n_grp);
+	b->base = (kb_vec_t*)(((size_t)b + head + sizeof(kb_vec_t) - 1) / sizeof(kb_vec_t) * sizeof(kb_vec_t)); // align memory
+	for (a = 0; a < m * m; ++a) {
+		min = min < mat[a]? min : mat[a];
+		max = max > mat[a]? max : mat[a];
+	}
+	b->shift = 256 - (uint8_t)min; b->max = max;
+	for (g = 0, n_vec = 0; g < n_grp; ++g) {
+		int k0 = g * KB_LANES, qmax = 0;
+		uint8_t *t;
+		for (k = k0; k < n && k < k0 + KB_LANES; ++k)
+			qmax = qmax > qlens[k]? qmax : qlens[k];
+		b->qmax[g] = qmax; b->off[g] = n_vec;
+		t = (uint8_t*)(b->base + n_vec);
+		for (a = 0; a < m; ++a) // profile; lanes past the end of their query score the minimum
+			for (j = 0; j < qmax; ++j)
+				for (k = k0; k < k0 + KB_LANES; ++k)
+					*t++ = (k < n && j < qlens[k]? mat[a * m + queries[k][j]] : min) + b->shift;
+		for (j = 0; j < qmax; ++j)
+			for (k = k0; k < k0 + KB_LANES; ++k)
+				*t++ = k < n && j < qlens[k]? 0xff : 0;
+		n_vec += (size_t)qmax * (m + 4);
+	}
+	return b;
+}
+
+typedef struct {
+	int n, m;
+	uint64_t *a; // row maxima above minsc, as in the b array of ksw_u8()
+} kb_rowmax_t;
+
+// one group of queries against the target; r and ql point to the first query of the group
+static void ksw_batch_u8(const kswb_t *b, int g, int n, const int *ql, int tlen, const uint8_t *target, int _o_del, int _e_del, int _o_ins, int _e_ins, int xtra, kswr_t *r, int *overflow)
+{
+	const int qmax = b->qmax[g];
+	kb_vec_t *qp = b->base + b->off[g], *V = qp + b->m * qmax, *H = V + qmax, *E = H + qmax, *Hmax = E + qmax;
+	kb_vec_t zero, oe_del, e_del, oe_ins, e_ins, shift;
+	int i, j, k, n_active, minsc, endsc, gmax[KB_LANES], te[KB_LANES];
+	uint8_t active[KB_LANES];
+	kb_rowmax_t rm[KB_LANES];
+	union { kb_vec_t v; uint8_t u[KB_LANES]; } mx, mk;
+
+	minsc = (xtra&KSW_XSUBO)? xtra&0xffff : 0x10000;
+	endsc = (xtra&KSW_XSTOP)? xtra&0xffff : 0x10000;
+	zero = kb_zero();
+	oe_del = kb_set1(_o_del + _e_del); e_del = kb_set1(_e_del);
+	oe_ins = kb_set1(_o_ins + _e_ins); e_ins = kb_set1(_e_ins);
+	shift = kb_set1(b->shift);
+	for (j = 0; j < qmax; ++j) {
+		kb_store(H + j, zero);
+		kb_store(E + j, zero);
+		kb_store(Hmax + j, zero);
+	}
+	for (k = n_active = 0; k < KB_LANES; ++k) {
+		gmax[k] = 0, te[k] = -1;
+		rm[k].n = rm[k].m = 0, rm[k].a = 0;
+		active[k] = k < n && ql[k] > 0;
+		n_active += active[k];
+	}
+	// the core loop
+	for (i = 0; i < tlen && n_active > 0; ++i) {
+		kb_vec_t e, h, t, d = zero, f = zero, max = zero; // d=H(i-1,j-1)
+		const kb_vec_t *S = qp + target[i] * qmax;
+		int any = 0;
+		for (j = 0; LIKELY(j < qmax); ++j) {
+			h = kb_subs(kb_adds(d, kb_load(S + j)), shift); // H(i-1,j-1)+S(i,j)
+			e = kb_load(E + j);
+			h = kb_max(h, e);
+			h = kb_max(h, f); // H(i,j)
+			d = kb_load(H + j);
+			kb_store(H + j, h);
+			max = kb_max(max, kb_and(h, kb_load(V + j))); // cells past the end of a query do not count
+			t = kb_subs(h, oe_del);
+			e = kb_max(kb_subs(e, e_del), t); // E(i+1,j)
+			kb_store(E + j, e);
+			t = kb_subs(h, oe_ins);
+			f = kb_max(kb_subs(f, e_ins), t); // F(i,j+1)
+		}
+		kb_store(&mx.v, max);
+		for (k = 0; k < KB_LANES; ++k) {
+			int imax = mx.u[k];
+			mk.u[k] = 0;
+			if (!active[k]) continue;
+			if (imax >= minsc) { // same bookkeeping as the b array of ksw_u8()
+				kb_rowmax_t *p = &rm[k];
+				if (p->n == 0 || (int32_t)p->a[p->n-1] + 1 != i) {
+					if (p->n == p->m) {
+						p->m = p->m? p->m<<1 : 8;
+						p->a = (uint64_t*)realloc(p->a, 8 * p->m);
+					}
+					p->a[p->n++] = (uint64_t)imax<<32 | i;
+				} else if ((int)(p->a[p->n-1]>>32) < imax) p->a[p->n-1] = (uint64_t)imax<<32 | i;
+			}
+			if (imax > gmax[k]) {
+				gmax[k] = imax, te[k] = i, mk.u[k] = 0xff, any = 1;
+				if (gmax[k] + b->shift >= 255 || gmax[k] >= endsc)
+					active[k] = 0, --n_active;
+			}
+		}
+		if (any) { // keep the H row of the lanes that reached a new maximum
+			kb_vec_t m = kb_load(&mk.v);
+			for (j = 0; LIKELY(j < qmax); ++j)
+				kb_store(Hmax + j, kb_blend(m, kb_load(H + j), kb_load(Hmax + j)));
+		}
+	}
+	// per-query results, as ksw_u8() reports them
+	for (k = 0; k < n; ++k) {
+		kswr_t *p = &r[k];
+		*p = g_defr;
+		overflow[k] = 0;
+		if (gmax[k] + b->shift >= 255) {
+			p->score = 255, p->te = te[k];
+			overflow[k] = 1;
+		} else {
+			const uint8_t *t = (const uint8_t*)Hmax;
+			int low, high;
+			p->score = gmax[k], p->te = te[k];
+			for (j = 0; j < ql[k]; ++j)
+				if (t[j * KB_LANES + k] == gmax[k]) { p->qe = j; break; }
+			if (rm[k].a) {
+				i = (p->score + b->max - 1) / b->max;
+				low = te[k] - i; high = te[k] + i;
+				for (i = 0; i < rm[k].n; ++i) {
+					int e = (int32_t)rm[k].a[i];
+					if ((e < low || e > high) && (int)(rm[k].a[i]>>32) > p->score2)
+						p->score2 = rm[k].a[i]>>32, p->te2 = e;
+				}
+			}
+		}
+	}
+	for (k = 0; k < KB_LANES; ++k) free(rm[k].a);
+}
+
+void ksw_batch2(int n, const int *qlens, uint8_t **queries, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswb_t **bq, kswr_t *r)
+{
+	ksw_ctx_t ctx = {{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}};
+	kswb_t *b;
+	int g, k, overflow[KB_LANES];
+
+	b = (bq && *bq)? *bq : ksw_binit(n, qlens, queries, m, mat);
+	if (bq && *bq == 0) *bq = b;
+	for (g = 0; g < b->n_grp; ++g) {
+		int k0 = g * KB_LANES, n_g = n - k0 < KB_LANES? n - k0 : KB_LANES;
+		ksw_batch_u8(b, g, n_g, qlens + k0, tlen, target, o_del, e_del, o_ins, e_ins, xtra, r + k0, overflow);
+		for (k = k0; k < k0 + n_g; ++k) {
+			if (overflow[k - k0] && !(xtra&KSW_XBYTE)) { // redo with 16-bit scores, as ksw_align2() would
+				r[k] = ksw_align2(qlens[k], queries[k], tlen, target, m, mat, o_del, e_del, o_ins, e_ins, xtra, 0);
+				continue;
+			}
+			if ((xtra&KSW_XSTART) == 0 || ((xtra&KSW_XSUBO) && r[k].score < (xtra&0xffff))) continue;
+			ksw_start(&ctx, &r[k], (xtra&KSW_XBYTE)? 1 : 2, queries[k], target, m, mat, o_del, e_del, o_ins, e_ins);
+		}
+	}
+	ksw_ctx_free(&ctx);
+	if (bq == 0) free(b);
+}
+
+void ksw_batch(int n, const int *qlens, uint8_t **queries, int tlen, uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int xtra, kswb_t **bq, kswr_t *r)
+{
+	ksw_batch2(n, qlens, queries, tlen, target, m, mat, gapo, gape, gapo, gape, xtra, bq, r);
+}
+
 /********************
  *** SW extension ***
  ********************/
@@ -378,15 +696,16 @@ typedef struct {
 	int32_t h, e;
 } eh_t;
 
-int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off)
+int ksw_extend2_ctx(ksw_ctx_t *ctx, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off)
 {
 	eh_t *eh; // score array
 	int8_t *qp; // query profile
 	int i, j, k, oe_del = o_del + e_del, oe_ins = o_ins + e_ins, beg, end, max, max_i, max_j, max_ins, max_del, max_ie, gscore, max_off;
 	assert(h0 > 0);
-	// allocate memory
-	qp = malloc(qlen * m);
-	eh = calloc(qlen + 1, 8);
+	// get memory from the context
+	qp = (int8_t*)ksw_buf(&ctx->qp, qlen * m);
+	eh = (eh_t*)ksw_buf(&ctx->eh, (qlen + 1) * 8);
+	memset(eh, 0, (qlen + 1) * 8);
 	// generate the query profile
 	for (k = i = 0; k < m; ++k) {
 		const int8_t *p = &mat[k * m];
@@ -470,7 +789,6 @@ int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 		end = j + 2 < qlen? j + 2 : qlen;
 		//beg = 0; end = qlen; // uncomment this line for debugging
 	}
-	free(eh); free(qp);
 	if (_qle) *_qle = max_j + 1;
 	if (_tle) *_tle = max_i + 1;
 	if (_gtle) *_gtle = max_ie + 1;
@@ -479,6 +797,14 @@ int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	return max;
 }
 
+int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *_qle, int *_tle, int *_gtle, int *_gscore, int *_max_off)
+{
+	ksw_ctx_t ctx = {{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}};
+	int score = ksw_extend2_ctx(&ctx, qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, end_bonus, zdrop, h0, _qle, _tle, _gtle, _gscore, _max_off);
+	ksw_ctx_free(&ctx);
+	return score;
+}
+
 int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off)
 {
 	return ksw_extend2(qlen, query, tlen, target, m, mat, gapo, gape, gapo, gape, w, end_bonus, zdrop, h0, qle, tle, gtle, gscore, max_off);
@@ -502,7 +828,7 @@ static inline uint32_t *push_cigar(int *n_cigar, int *m_cigar, uint32_t *cigar,
 	return cigar;
 }
 
-int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar_, uint32_t **cigar_)
+int ksw_global2_ctx(ksw_ctx_t *ctx, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar_, uint32_t **cigar_)
 {
 	eh_t *eh;
 	int8_t *qp; // query profile
@@ -511,9 +837,10 @@ int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 	if (n_cigar_) *n_cigar_ = 0;
 	// allocate memory
 	n_col = qlen < 2*w+1? qlen : 2*w+1; // maximum #columns of the backtrack matrix
-	z = n_cigar_ && cigar_? malloc((long)n_col * tlen) : 0;
-	qp = malloc(qlen * m);
-	eh = calloc(qlen + 1, 8);
+	z = n_cigar_ && cigar_? (uint8_t*)ksw_buf(&ctx->z, (long)n_col * tlen) : 0;
+	qp = (int8_t*)ksw_buf(&ctx->qp, qlen * m);
+	eh = (eh_t*)ksw_buf(&ctx->eh, (qlen + 1) * 8);
+	memset(eh, 0, (qlen + 1) * 8);
 	// generate the query profile
 	for (k = i = 0; k < m; ++k) {
 		const int8_t *p = &mat[k * m];
@@ -602,7 +929,14 @@ int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 			tmp = cigar[i], cigar[i] = cigar[n_cigar-1-i], cigar[n_cigar-1-i] = tmp;
 		*n_cigar_ = n_cigar, *cigar_ = cigar;
 	}
-	free(eh); free(qp); free(z);
+	return score;
+}
+
+int ksw_global2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar_, uint32_t **cigar_)
+{
+	ksw_ctx_t ctx = {{0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}, {0, 0}};
+	int score = ksw_global2_ctx(&ctx, qlen, query, tlen, target, m, mat, o_del, e_del, o_ins, e_ins, w, n_cigar_, cigar_);
+	ksw_ctx_free(&ctx);
 	return score;
 }
 
@@ -619,7 +953,12 @@ int ksw_global(int qlen, const uint8_t *query, int tlen, const uint8_t *target,
 
 #include <unistd.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <zlib.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "kseq.h"
 KSEQ_INIT(gzFile, err_gzread)
 
@@ -642,17 +981,216 @@ unsigned char seq_nt4_table[256] = {
 	4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4,  4, 4, 4, 4
 };
 
+typedef struct {
+	int n, m;
+	char **name;
+	int *len;
+	uint8_t **seq;
+} tstore_t; // targets, read and encoded once and shared read-only by all threads
+
+typedef struct {
+	char *name;
+	int len;
+	uint8_t *seq, *rseq; // rseq is the reverse complement, or 0 with -f
+	size_t l, m;
+	char *out; // output lines of this query
+} query_t;
+
+typedef struct {
+	const tstore_t *t;
+	query_t *q;
+	int n_q, unit, next, n_out;
+	uint8_t *done;
+	FILE *fp;
+	const int8_t *mat;
+	int gapo, gape, minsc, xtra, batch;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_t lock;
+#endif
+} worker_t;
+
+static void tstore_load(tstore_t *t, kseq_t *ks)
+{
+	int i;
+	memset(t, 0, sizeof(tstore_t));
+	while (kseq_read(ks) > 0) {
+		if (t->n == t->m) {
+			t->m = t->m? t->m<<1 : 16;
+			t->name = (char**)realloc(t->name, t->m * sizeof(char*));
+			t->len = (int*)realloc(t->len, t->m * sizeof(int));
+			t->seq = (uint8_t**)realloc(t->seq, t->m * sizeof(uint8_t*));
+		}
+		t->name[t->n] = strdup(ks->name.s);
+		t->len[t->n] = ks->seq.l;
+		t->seq[t->n] = (uint8_t*)malloc(ks->seq.l + 1);
+		for (i = 0; i < (int)ks->seq.l; ++i) t->seq[t->n][i] = seq_nt4_table[(int)ks->seq.s[i]];
+		++t->n;
+	}
+}
+
+static void tstore_destroy(tstore_t *t)
+{
+	int i;
+	for (i = 0; i < t->n; ++i) free(t->name[i]), free(t->seq[i]);
+	free(t->name); free(t->len); free(t->seq);
+}
+
+// reads up to n queries into q; returns the number read
+static int read_queries(kseq_t *ks, int n, query_t *q, int forward_only)
+{
+	int i, j, k;
+	for (k = 0; k < n && kseq_read(ks) > 0; ++k) {
+		query_t *p = &q[k];
+		int l = ks->seq.l;
+		free(p->name); free(p->seq); free(p->rseq);
+		memset(p, 0, sizeof(query_t));
+		p->name = strdup(ks->name.s);
+		p->len = l;
+		p->seq = (uint8_t*)malloc(l + 1);
+		for (i = 0; i < l; ++i) p->seq[i] = seq_nt4_table[(int)ks->seq.s[i]];
+		if (!forward_only) {
+			p->rseq = (uint8_t*)malloc(l + 1);
+			for (i = 0, j = l - 1; i < l; ++i, --j)
+				p->rseq[j] = p->seq[i] == 4? 4 : 3 - p->seq[i];
+		}
+	}
+	return k;
+}
+
+static void add_hit(query_t *q, const char *tname, int rev, const kswr_t *r)
+{
+	int l;
+	for (;;) {
+		size_t avail = q->m - q->l;
+		if (rev) l = snprintf(q->out + q->l, avail, "%s\t%d\t%d\t%s\t%d\t%d\t%d\t%d\t%d\n", tname, r->tb, r->te+1, q->name, q->len - r->qb, q->len - 1 - r->qe, r->score, r->score2, r->te2);
+		else l = snprintf(q->out + q->l, avail, "%s\t%d\t%d\t%s\t%d\t%d\t%d\t%d\t%d\n", tname, r->tb, r->te+1, q->name, r->qb, r->qe+1, r->score, r->score2, r->te2);
+		if ((size_t)l < avail) break;
+		q->m = q->m + l + 1 > q->m<<1? q->m + l + 1 : q->m<<1;
+		q->out = (char*)realloc(q->out, q->m);
+	}
+	q->l += l;
+}
+
+// queries [k0,k1) against every target
+static void align_queries(worker_t *w, ksw_ctx_t *ctx[2], int k0, int k1, kswr_t *br)
+{
+	const tstore_t *t = w->t;
+	int i, j, k;
+	if (w->batch) { // both strands of each query in adjacent lanes of ksw_batch()
+		int n_s = w->q[k0].rseq? 2 : 1, n = (k1 - k0) * n_s, qlens[KB_LANES];
+		uint8_t *seqs[KB_LANES];
+		kswb_t *bq = 0;
+		for (k = k0; k < k1; ++k) {
+			seqs[(k - k0) * n_s] = w->q[k].seq, qlens[(k - k0) * n_s] = w->q[k].len;
+			if (n_s == 2) seqs[(k - k0) * 2 + 1] = w->q[k].rseq, qlens[(k - k0) * 2 + 1] = w->q[k].len;
+		}
+		for (i = 0; i < t->n; ++i)
+			ksw_batch(n, qlens, seqs, t->len[i], t->seq[i], 5, w->mat, w->gapo, w->gape, w->xtra, &bq, br + (size_t)i * n);
+		free(bq);
+		for (k = k0; k < k1; ++k)
+			for (i = 0; i < t->n; ++i)
+				for (j = 0; j < n_s; ++j) {
+					const kswr_t *r = &br[(size_t)i * n + (k - k0) * n_s + j];
+					if (r->score >= w->minsc) add_hit(&w->q[k], t->name[i], j, r);
+				}
+		return;
+	}
+	for (k = k0; k < k1; ++k) {
+		query_t *q = &w->q[k];
+		int size = (w->xtra&KSW_XBYTE)? 1 : 2;
+		kswq_t *qp[2];
+		qp[0] = ksw_ctx_qinit(ctx[0], size, q->len, q->seq, 5, w->mat);
+		qp[1] = q->rseq? ksw_ctx_qinit(ctx[1], size, q->len, q->rseq, 5, w->mat) : 0;
+		for (i = 0; i < t->n; ++i) {
+			kswr_t r = ksw_align2_ctx(ctx[0], q->len, q->seq, t->len[i], t->seq[i], 5, w->mat, w->gapo, w->gape, w->gapo, w->gape, w->xtra, qp[0]);
+			if (r.score >= w->minsc) add_hit(q, t->name[i], 0, &r);
+			if (q->rseq) {
+				r = ksw_align2_ctx(ctx[1], q->len, q->rseq, t->len[i], t->seq[i], 5, w->mat, w->gapo, w->gape, w->gapo, w->gape, w->xtra, qp[1]);
+				if (r.score >= w->minsc) add_hit(q, t->name[i], 1, &r);
+			}
+		}
+	}
+}
+
+// takes units of w->unit queries until the batch is done; finished queries are written in input order
+static void *worker(void *data)
+{
+	worker_t *w = (worker_t*)data;
+	ksw_ctx_t *ctx[2];
+	kswr_t *br = w->batch? (kswr_t*)malloc((size_t)w->t->n * KB_LANES * sizeof(kswr_t)) : 0;
+	int k, k0;
+	ctx[0] = ksw_ctx_init(); ctx[1] = ksw_ctx_init();
+	for (;;) {
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&w->lock);
+#endif
+		k0 = w->next, w->next += w->unit;
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&w->lock);
+#endif
+		if (k0 >= w->n_q) break;
+		align_queries(w, ctx, k0, k0 + w->unit < w->n_q? k0 + w->unit : w->n_q, br);
+#ifdef HAVE_PTHREAD
+		pthread_mutex_lock(&w->lock);
+#endif
+		for (k = k0; k < k0 + w->unit && k < w->n_q; ++k) w->done[k] = 1;
+		for (; w->n_out < w->n_q && w->done[w->n_out]; ++w->n_out) {
+			query_t *q = &w->q[w->n_out];
+			if (q->l) err_fwrite(q->out, 1, q->l, w->fp);
+			free(q->out); q->out = 0; q->l = q->m = 0;
+		}
+#ifdef HAVE_PTHREAD
+		pthread_mutex_unlock(&w->lock);
+#endif
+	}
+	ksw_ctx_destroy(ctx[0]); ksw_ctx_destroy(ctx[1]);
+	free(br);
+	return 0;
+}
+
+/* The checkpoint file holds the number of queries whose output is complete
+ * and the size of the output file at that point. It is replaced atomically
+ * after every batch, so a restarted job truncates the output to that size
+ * and continues with the next query. */
+static int read_checkpoint(const char *fn, long *n_done, long *offset)
+{
+	FILE *fp = fopen(fn, "r");
+	int ret;
+	if (fp == 0) return 0;
+	ret = fscanf(fp, "%ld\t%ld", n_done, offset) == 2;
+	fclose(fp);
+	if (!ret) err_fatal(__func__, "malformatted checkpoint file '%s'", fn);
+	return 1;
+}
+
+static void write_checkpoint(const char *fn, long n_done, long offset)
+{
+	char *tmp = (char*)malloc(strlen(fn) + 5);
+	FILE *fp;
+	strcpy(tmp, fn); strcat(tmp, ".tmp");
+	fp = xopen(tmp, "w");
+	err_fprintf(fp, "%ld\t%ld\n", n_done, offset);
+	err_fflush(fp);
+	err_fclose(fp);
+	if (rename(tmp, fn) != 0) err_fatal(__func__, "fail to rename '%s': %s", tmp, strerror(errno));
+	free(tmp);
+}
+
 int main(int argc, char *argv[])
 {
-	int c, sa = 1, sb = 3, i, j, k, forward_only = 0, max_rseq = 0;
+	int c, sa = 1, sb = 3, i, j, k, forward_only = 0, batch = 0, n_threads = 1, batch_size = 1024, n;
 	int8_t mat[25];
 	int gapo = 5, gape = 2, minsc = 0, xtra = KSW_XSTART;
-	uint8_t *rseq = 0;
+	long n_done = 0, offset = 0;
+	const char *out_fn = 0, *ckpt_fn = 0;
 	gzFile fpt, fpq;
 	kseq_t *kst, *ksq;
+	tstore_t t;
+	query_t *q;
+	worker_t w;
 
 	// parse command line
-	while ((c = getopt(argc, argv, "a:b:q:r:ft:1")) >= 0) {
+	while ((c = getopt(argc, argv, "a:b:q:r:ft:1BT:n:o:C:")) >= 0) {
 		switch (c) {
 			case 'a': sa = atoi(optarg); break;
 			case 'b': sb = atoi(optarg); break;
@@ -661,12 +1199,27 @@ int main(int argc, char *argv[])
 			case 't': minsc = atoi(optarg); break;
 			case 'f': forward_only = 1; break;
 			case '1': xtra |= KSW_XBYTE; break;
+			case 'B': batch = 1; break;
+			case 'T': n_threads = atoi(optarg); break;
+			case 'n': batch_size = atoi(optarg); break;
+			case 'o': out_fn = optarg; break;
+			case 'C': ckpt_fn = optarg; break;
 		}
 	}
 	if (optind + 2 > argc) {
-		fprintf(stderr, "Usage: ksw [-1] [-f] [-a%d] [-b%d] [-q%d] [-r%d] [-t%d] <target.fa> <query.fa>\n", sa, sb, gapo, gape, minsc);
+		fprintf(stderr, "Usage: ksw [-1] [-f] [-B] [-a%d] [-b%d] [-q%d] [-r%d] [-t%d] [-T%d] [-n%d] [-o out.txt] [-C ckpt] <target.fa> <query.fa>\n", sa, sb, gapo, gape, minsc, n_threads, batch_size);
+		return 1;
+	}
+	if (ckpt_fn && out_fn == 0) {
+		fprintf(stderr, "[E::%s] -C requires the output file to be given with -o\n", __func__);
 		return 1;
 	}
+	if (n_threads < 1) n_threads = 1;
+#ifndef HAVE_PTHREAD
+	if (n_threads > 1) fprintf(stderr, "[W::%s] compiled without HAVE_PTHREAD; using one thread\n", __func__);
+	n_threads = 1;
+#endif
+	if (batch_size < 1) batch_size = 1;
 	if (minsc > 0xffff) minsc = 0xffff;
 	xtra |= KSW_XSUBO | minsc;
 	// initialize scoring matrix
@@ -676,39 +1229,57 @@ int main(int argc, char *argv[])
 		mat[k++] = 0; // ambiguous base
 	}
 	for (j = 0; j < 5; ++j) mat[k++] = 0;
-	// open file
-	fpt = xzopen(argv[optind],   "r"); kst = kseq_init(fpt);
+	// targets are read once
+	fpt = xzopen(argv[optind], "r"); kst = kseq_init(fpt);
+	tstore_load(&t, kst);
+	kseq_destroy(kst); err_gzclose(fpt);
+	// resume from the checkpoint: drop the output past the last complete batch and skip its queries
 	fpq = xzopen(argv[optind+1], "r"); ksq = kseq_init(fpq);
-	// all-pair alignment
-	while (kseq_read(ksq) > 0) {
-		kswq_t *q[2] = {0, 0};
-		kswr_t r;
-		for (i = 0; i < (int)ksq->seq.l; ++i) ksq->seq.s[i] = seq_nt4_table[(int)ksq->seq.s[i]];
-		if (!forward_only) { // reverse
-			if ((int)ksq->seq.m > max_rseq) {
-				max_rseq = ksq->seq.m;
-				rseq = (uint8_t*)realloc(rseq, max_rseq);
-			}
-			for (i = 0, j = ksq->seq.l - 1; i < (int)ksq->seq.l; ++i, --j)
-				rseq[j] = ksq->seq.s[i] == 4? 4 : 3 - ksq->seq.s[i];
-		}
-		gzrewind(fpt); kseq_rewind(kst);
-		while (kseq_read(kst) > 0) {
-			for (i = 0; i < (int)kst->seq.l; ++i) kst->seq.s[i] = seq_nt4_table[(int)kst->seq.s[i]];
-			r = ksw_align(ksq->seq.l, (uint8_t*)ksq->seq.s, kst->seq.l, (uint8_t*)kst->seq.s, 5, mat, gapo, gape, xtra, &q[0]);
-			if (r.score >= minsc)
-				err_printf("%s\t%d\t%d\t%s\t%d\t%d\t%d\t%d\t%d\n", kst->name.s, r.tb, r.te+1, ksq->name.s, r.qb, r.qe+1, r.score, r.score2, r.te2);
-			if (rseq) {
-				r = ksw_align(ksq->seq.l, rseq, kst->seq.l, (uint8_t*)kst->seq.s, 5, mat, gapo, gape, xtra, &q[1]);
-				if (r.score >= minsc)
-					err_printf("%s\t%d\t%d\t%s\t%d\t%d\t%d\t%d\t%d\n", kst->name.s, r.tb, r.te+1, ksq->name.s, (int)ksq->seq.l - r.qb, (int)ksq->seq.l - 1 - r.qe, r.score, r.score2, r.te2);
-			}
+	memset(&w, 0, sizeof(worker_t));
+	if (ckpt_fn && read_checkpoint(ckpt_fn, &n_done, &offset)) {
+		w.fp = xopen(out_fn, "r+");
+		if (ftruncate(fileno(w.fp), offset) != 0) err_fatal(__func__, "fail to truncate '%s': %s", out_fn, strerror(errno));
+		err_fseek(w.fp, 0, SEEK_END);
+		for (n = 0; n < n_done && kseq_read(ksq) > 0; ++n);
+		fprintf(stderr, "[M::%s] resuming after %ld queries\n", __func__, n_done);
+	} else w.fp = out_fn? xopen(out_fn, "w") : stdout;
+	// all-pair alignment, batch by batch
+	q = (query_t*)calloc(batch_size, sizeof(query_t));
+	w.done = (uint8_t*)malloc(batch_size);
+	w.t = &t; w.q = q; w.mat = mat;
+	w.gapo = gapo, w.gape = gape, w.minsc = minsc, w.xtra = xtra, w.batch = batch;
+	w.unit = batch? ksw_batch_width() / (forward_only? 1 : 2) : 1;
+#ifdef HAVE_PTHREAD
+	pthread_mutex_init(&w.lock, 0);
+#endif
+	while ((n = read_queries(ksq, batch_size, q, forward_only)) > 0) {
+		w.n_q = n, w.next = w.n_out = 0;
+		memset(w.done, 0, n);
+#ifdef HAVE_PTHREAD
+		if (n_threads > 1) {
+			pthread_t *tid = (pthread_t*)calloc(n_threads, sizeof(pthread_t));
+			for (i = 0; i < n_threads; ++i) pthread_create(&tid[i], 0, worker, &w);
+			for (i = 0; i < n_threads; ++i) pthread_join(tid[i], 0);
+			free(tid);
+		} else worker(&w);
+#else
+		worker(&w);
+#endif
+		n_done += n;
+		if (ckpt_fn) {
+			err_fflush(w.fp);
+			write_checkpoint(ckpt_fn, n_done, err_ftell(w.fp));
 		}
-		free(q[0]); free(q[1]);
 	}
-	free(rseq);
-	kseq_destroy(kst); err_gzclose(fpt);
+#ifdef HAVE_PTHREAD
+	pthread_mutex_destroy(&w.lock);
+#endif
+	for (k = 0; k < batch_size; ++k) free(q[k].name), free(q[k].seq), free(q[k].rseq), free(q[k].out);
+	free(q); free(w.done);
+	tstore_destroy(&t);
 	kseq_destroy(ksq); err_gzclose(fpq);
+	if (w.fp != stdout) err_fclose(w.fp);
+	else err_fflush(stdout);
 	return 0;
 }
 #endif
@@ -11,6 +11,12 @@
 struct _kswq_t;
 typedef struct _kswq_t kswq_t;
 
+struct _kswb_t;
+typedef struct _kswb_t kswb_t;
+
+struct _ksw_ctx_t;
+typedef struct _ksw_ctx_t ksw_ctx_t;
+
 typedef struct {
 	int score; // best score
 	int te, qe; // target end and query end
@@ -63,6 +69,33 @@ extern "C" {
 	kswr_t ksw_align(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int xtra, kswq_t **qry);
 	kswr_t ksw_align2(int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswq_t **qry);
 
+	/**
+	 * Aligning a batch of queries against one target
+	 *
+	 * @param n       number of queries
+	 * @param qlens   lengths of the queries
+	 * @param queries query sequences with 0 <= queries[k][i] < m
+	 * @param bq      batch profile (see below)
+	 * @param r       (out) n results, one per query
+	 *
+	 * The other parameters and the KSW_X* flags are as in ksw_align(). Queries
+	 * are aligned ksw_batch_width() at a time, one query per lane of a vector
+	 * register (16 with SSE2, 32 when compiled with AVX2), instead of striping
+	 * one query across the register. This is faster than ksw_align() for many
+	 * short queries. Scores are computed in unsigned bytes; queries that
+	 * overflow are realigned with ksw_align2() unless KSW_XBYTE is set, in
+	 * which case their score is set to 255. The results match ksw_align(),
+	 * except that score2 only considers cells inside the query, while
+	 * ksw_align() also counts the padding at the end of its striped profile.
+	 *
+	 * *bq works as *qry in ksw_align(): when *bq==NULL, the batch profile is
+	 * computed and *bq points to it on return, so that the same queries can be
+	 * aligned against more targets. It is deallocated by free(). bq can be 0.
+	 */
+	int ksw_batch_width(void);
+	void ksw_batch(int n, const int *qlens, uint8_t **queries, int tlen, uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int xtra, kswb_t **bq, kswr_t *r);
+	void ksw_batch2(int n, const int *qlens, uint8_t **queries, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswb_t **bq, kswr_t *r);
+
 	/**
 	 * Banded global alignment
 	 *
@@ -107,6 +140,32 @@ extern "C" {
 	int ksw_extend(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int gapo, int gape, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 	int ksw_extend2(int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
 
+	/**
+	 * Aligner context
+	 *
+	 * A context holds the scratch memory of the functions below: the query
+	 * profiles of ksw_align2_ctx(), the DP rows and profiles of
+	 * ksw_extend2_ctx() and ksw_global2_ctx(), and the backtrack matrix.
+	 * Buffers grow as needed and are kept between calls, so a caller that
+	 * owns one context per thread stops allocating once the buffers are
+	 * large enough. All memory is obtained with malloc()/realloc()/calloc(),
+	 * which go through malloc_wrap.h when ksw.c is compiled with
+	 * USE_MALLOC_WRAPPERS. A context must not be used by two threads at once.
+	 *
+	 * ksw_ctx_qinit() builds the profile of a query inside the context. The
+	 * profile stays valid until the next ksw_ctx_qinit() on the same context
+	 * and must not be freed. The _ctx functions compute the same results as
+	 * the functions without the suffix, which now run on a temporary context.
+	 * When q is 0, ksw_align2_ctx() builds the profile itself, the way
+	 * ksw_align2() does with qry==0.
+	 */
+	ksw_ctx_t *ksw_ctx_init(void);
+	void ksw_ctx_destroy(ksw_ctx_t *ctx);
+	kswq_t *ksw_ctx_qinit(ksw_ctx_t *ctx, int size, int qlen, const uint8_t *query, int m, const int8_t *mat);
+	kswr_t ksw_align2_ctx(ksw_ctx_t *ctx, int qlen, uint8_t *query, int tlen, uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int xtra, kswq_t *q);
+	int ksw_extend2_ctx(ksw_ctx_t *ctx, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int end_bonus, int zdrop, int h0, int *qle, int *tle, int *gtle, int *gscore, int *max_off);
+	int ksw_global2_ctx(ksw_ctx_t *ctx, int qlen, const uint8_t *query, int tlen, const uint8_t *target, int m, const int8_t *mat, int o_del, int e_del, int o_ins, int e_ins, int w, int *n_cigar, uint32_t **cigar);
+
 #ifdef __cplusplus
 }
 #endif
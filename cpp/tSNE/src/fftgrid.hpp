@@ -0,0 +1,286 @@
+/* fftgrid: repulsive forces of tSNE by interpolation on a grid and FFT
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef FFTGRID_HPP
+#define FFTGRID_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <gsl/gsl_fft_complex.h>
+
+// Sums of the kernel K(yi, yj) = 1/(1 + |yi - yj|^2)^2 over all points
+// of the embedding, as in FIt-SNE (Linderman et al., 2019). The points
+// are spread onto a regular grid by Lagrange interpolation from the
+// interp_points nodes of the box each point falls in, the grid is
+// convolved with the kernel by FFT, and the result is interpolated back
+// to the points. With the charges 1, yj and |yj|^2 these sums give both
+// the repulsive force and the sum of 1/(1 + |yi - yj|^2), since the
+// latter is K(yi, yj)(1 + |yi - yj|^2). The cost is linear in the number
+// of points plus that of the FFT, which only depends on the grid.
+class FFTGrid {
+public:
+  // the grid has boxes^dim nodes, so only one or two dimensions
+  static const size_t max_dim = 2;
+
+  // y has n points of dim coordinates each, one after the other
+  FFTGrid(const double *y, const size_t n, const size_t dim) :
+    points(y), n_points(n), dim(dim), n_charges(dim + 2) {
+    if (n == 0)
+      throw std::runtime_error("empty embedding");
+    if (dim < 1 || dim > max_dim)
+      throw std::runtime_error("the FFT engine needs an embedding of "
+                               "dimension 1 or 2");
+
+    // a square (in 2D) bounding box of boxes of width at most 1, centered
+    // at 0 so the charges stay small
+    double lo = y[0], hi = y[0];
+    for (size_t i = 0; i < n*dim; ++i) {
+      lo = std::min(lo, y[i]);
+      hi = std::max(hi, y[i]);
+    }
+    center = (lo + hi)/2;
+    const double width = std::max(hi - lo, 1e-5)*(1 + 1e-5);
+    // the padded grid has (2*interp_points*boxes)^dim nodes
+    const size_t max_boxes = static_cast<size_t>(
+      std::pow(double(max_padded_nodes), 1.0/dim))/(2*interp_points);
+    n_boxes = fft_length(std::max(size_t(min_boxes), size_t(ceil(width))));
+    n_boxes = std::min(n_boxes, max_boxes);
+    box_width = width/n_boxes;
+    lo_edge = center - width/2;
+    spacing = box_width/interp_points;
+    n_nodes = n_boxes*interp_points;
+    padded = 2*n_nodes;
+    padded_size = 1;
+    for (size_t a = 0; a < dim; ++a)
+      padded_size *= padded;
+
+    interpolation_weights();
+
+    gsl_fft_complex_wavetable *wt = gsl_fft_complex_wavetable_alloc(padded);
+    // the circulant embedding of the kernel on the grid, transformed
+    std::vector<double> kernel(2*padded_size, 0.0);
+    for (size_t e = 0; e < padded_size; ++e) {
+      double d2 = 0.0;
+      for (size_t a = 0, r = e; a < dim; ++a, r /= padded) {
+        const size_t t = r % padded;
+        const double off = (t <= n_nodes ? double(t) : double(t) - padded);
+        d2 += (off*spacing)*(off*spacing);
+      }
+      kernel[2*e] = 1/((1 + d2)*(1 + d2));
+    }
+    fft(kernel, wt, true);
+
+    potentials.assign(n_charges, std::vector<double>());
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, 1)
+#endif
+    for (size_t c = 0; c < n_charges; ++c)
+      spread(c, potentials[c]);
+
+    for (size_t c = 0; c < n_charges; ++c) {
+      std::vector<double> &w = potentials[c];
+      fft(w, wt, true);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+      for (size_t e = 0; e < padded_size; ++e) {
+        const double re = w[2*e]*kernel[2*e] - w[2*e + 1]*kernel[2*e + 1];
+        const double im = w[2*e]*kernel[2*e + 1] + w[2*e + 1]*kernel[2*e];
+        w[2*e] = re;
+        w[2*e + 1] = im;
+      }
+      fft(w, wt, false);
+    }
+    gsl_fft_complex_wavetable_free(wt);
+  }
+
+  // Puts in neg_f the repulsive force on point i, the sum over j of
+  // (yi - yj)/(1 + |yi - yj|^2)^2, and in sum_q the sum over j of
+  // 1/(1 + |yi - yj|^2), both without the j = i term
+  void repulsive(const size_t i, double *neg_f, double &sum_q) const {
+    double phi[max_dim + 2];
+    interpolate(i, phi);
+    const double *yi = points + i*dim;
+    double sq_norm = 0.0, dot = 0.0;
+    for (size_t k = 0; k < dim; ++k) {
+      const double x = yi[k] - center;
+      sq_norm += x*x;
+      dot += x*phi[1 + k];
+      neg_f[k] = x*phi[0] - phi[1 + k];
+    }
+    // K(yi, yi) = 1 is the j = i term
+    sum_q = (1 + sq_norm)*phi[0] - 2*dot + phi[dim + 1] - 1;
+  }
+
+  size_t boxes() const {return n_boxes;}
+
+private:
+  static const size_t interp_points = 3;
+  static const size_t min_boxes = 50;
+  static const size_t max_padded_nodes = size_t(1) << 22;
+
+  // the smallest n >= x with no prime factor above 5, which GSL
+  // transforms fastest
+  static size_t fft_length(size_t x) {
+    for (;; ++x) {
+      size_t r = x;
+      for (size_t f = 2; f <= 5; ++f)
+        while (r % f == 0)
+          r /= f;
+      if (r == 1)
+        return x;
+    }
+  }
+
+  // For each point and axis, the first grid node of its box and the
+  // Lagrange weights of the interp_points nodes of the box there
+  void interpolation_weights() {
+    first_node.resize(n_points*dim);
+    weights.resize(n_points*dim*interp_points);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+    for (size_t e = 0; e < n_points*dim; ++e) {
+      const double x = points[e];
+      const size_t box = std::min(
+        size_t((x - lo_edge)/box_width), n_boxes - 1);
+      first_node[e] = box*interp_points;
+      // x in units of the node spacing from the first node of the box
+      const double u = (x - lo_edge)/spacing - first_node[e] - 0.5;
+      for (size_t k = 0; k < interp_points; ++k) {
+        double l = 1.0;
+        for (size_t m = 0; m < interp_points; ++m)
+          if (m != k)
+            l *= (u - double(m))/(double(k) - double(m));
+        weights[e*interp_points + k] = l;
+      }
+    }
+  }
+
+  double charge(const size_t c, const size_t i) const {
+    const double *yi = points + i*dim;
+    if (c == 0)
+      return 1.0;
+    if (c <= dim)
+      return yi[c - 1] - center;
+    double ans = 0.0;
+    for (size_t k = 0; k < dim; ++k)
+      ans += (yi[k] - center)*(yi[k] - center);
+    return ans;
+  }
+
+  // index in the padded grid of the node at the given corner offset of
+  // the box of point i, and the product of the weights of that node
+  size_t node(const size_t i, size_t corner, double &weight) const {
+    size_t ans = 0;
+    weight = 1.0;
+    for (size_t a = 0; a < dim; ++a, corner /= interp_points) {
+      const size_t k = corner % interp_points;
+      ans = ans*padded + first_node[i*dim + a] + k;
+      weight *= weights[(i*dim + a)*interp_points + k];
+    }
+    return ans;
+  }
+
+  size_t n_corners() const {
+    size_t ans = 1;
+    for (size_t a = 0; a < dim; ++a)
+      ans *= interp_points;
+    return ans;
+  }
+
+  // the c-th charges of all points, spread onto the padded grid
+  void spread(const size_t c, std::vector<double> &w) const {
+    w.assign(2*padded_size, 0.0);
+    const size_t corners = n_corners();
+    for (size_t i = 0; i < n_points; ++i) {
+      const double q = charge(c, i);
+      for (size_t corner = 0; corner < corners; ++corner) {
+        double weight;
+        const size_t e = node(i, corner, weight);
+        w[2*e] += weight*q;
+      }
+    }
+  }
+
+  // the potentials of all charges at point i
+  void interpolate(const size_t i, double *phi) const {
+    std::fill(phi, phi + n_charges, 0.0);
+    const size_t corners = n_corners();
+    for (size_t corner = 0; corner < corners; ++corner) {
+      double weight;
+      const size_t e = node(i, corner, weight);
+      for (size_t c = 0; c < n_charges; ++c)
+        phi[c] += weight*potentials[c][2*e];
+    }
+  }
+
+  // in place transform of the padded grid, one axis after the other
+  void fft(std::vector<double> &w, const gsl_fft_complex_wavetable *wt,
+           const bool forward) const {
+    for (size_t a = 0, stride = padded_size/padded; a < dim;
+         ++a, stride /= padded) {
+      const size_t n_lines = padded_size/padded;
+#ifdef _OPENMP
+#pragma omp parallel
+#endif
+      {
+        gsl_fft_complex_workspace *work =
+          gsl_fft_complex_workspace_alloc(padded);
+#ifdef _OPENMP
+#pragma omp for
+#endif
+        for (size_t q = 0; q < n_lines; ++q) {
+          const size_t start = (q/stride)*stride*padded + q % stride;
+          if (forward)
+            gsl_fft_complex_forward(&w[2*start], stride, padded, wt, work);
+          else
+            gsl_fft_complex_inverse(&w[2*start], stride, padded, wt, work);
+        }
+        gsl_fft_complex_workspace_free(work);
+      }
+    }
+  }
+
+  const double *points;
+  size_t n_points;
+  size_t dim;
+  size_t n_charges;
+
+  double center;
+  double lo_edge;
+  double box_width;
+  double spacing;
+  size_t n_boxes;
+  size_t n_nodes;
+  size_t padded;
+  size_t padded_size;
+
+  std::vector<size_t> first_node;
+  std::vector<double> weights;
+  std::vector<std::vector<double> > potentials;
+
+  FFTGrid(const FFTGrid &);
+  FFTGrid &operator=(const FFTGrid &);
+};
+
+#endif
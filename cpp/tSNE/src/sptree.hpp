@@ -0,0 +1,182 @@
+/* sptree: space-partitioning tree for the Barnes-Hut tSNE gradient
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef SPTREE_HPP
+#define SPTREE_HPP
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// Quadtree (dim = 2) or octree (dim = 3) over the points of the
+// embedding. Every cell keeps the number of points under it and their
+// center of mass, so a far away cell can stand in for all its points
+// when summing the repulsive forces (van der Maaten, 2014).
+class SPTree {
+public:
+  static const size_t max_dim = 3;
+
+  // y has n points of dim coordinates each, one after the other
+  SPTree(const double *y, const size_t n, const size_t dim) : dim(dim) {
+    if (n == 0)
+      throw std::runtime_error("empty embedding");
+    if (dim < 2 || dim > max_dim)
+      throw std::runtime_error("Barnes-Hut needs an embedding of "
+                               "dimension 2 or 3");
+    n_children = size_t(1) << dim;
+
+    // root is the bounding box of all points
+    Cell root;
+    for (size_t k = 0; k < dim; ++k) {
+      double lo = y[k], hi = y[k];
+      for (size_t i = 1; i < n; ++i) {
+        lo = std::min(lo, y[i*dim + k]);
+        hi = std::max(hi, y[i*dim + k]);
+      }
+      root.center[k] = (lo + hi)/2;
+      // slightly wider so points on the border fall inside
+      root.half_width[k] = std::max((hi - lo)/2, 1e-5) * (1 + 1e-5);
+    }
+    cells.reserve(2*n);
+    cells.push_back(root);
+    for (size_t i = 0; i < n; ++i)
+      insert(y + i*dim);
+  }
+
+  // Accumulates into neg_f the repulsive force on yi, the sum over j of
+  // (yi - yj)/(1 + |yi - yj|^2)^2, and into sum_q the sum over j of
+  // 1/(1 + |yi - yj|^2), both without the j = i term. A cell is
+  // summarized by its center of mass when its width divided by the
+  // distance to it is below theta, so theta = 0 is exact.
+  void repulsive(const double *yi, const double theta,
+                 double *neg_f, double &sum_q) const {
+    repulsive(0, yi, theta, neg_f, sum_q);
+  }
+
+  size_t size() const {return cells.size();}
+
+private:
+  struct Cell {
+    double center[max_dim];
+    double half_width[max_dim];
+    double center_of_mass[max_dim];
+    size_t n_points;
+    // leaves hold copies of a single location
+    bool leaf;
+    // children are never the root, so 0 means no child
+    size_t children[size_t(1) << max_dim];
+
+    Cell() : n_points(0), leaf(true) {
+      std::fill(center, center + max_dim, 0.0);
+      std::fill(half_width, half_width + max_dim, 0.0);
+      std::fill(center_of_mass, center_of_mass + max_dim, 0.0);
+      std::fill(children, children + (size_t(1) << max_dim), 0);
+    }
+  };
+
+  void repulsive(const size_t c, const double *yi, const double theta,
+                 double *neg_f, double &sum_q) const {
+    const Cell &cell = cells[c];
+    if (cell.n_points == 0)
+      return;
+
+    double diff[max_dim];
+    double d = 0.0;
+    for (size_t k = 0; k < dim; ++k) {
+      diff[k] = yi[k] - cell.center_of_mass[k];
+      d += diff[k]*diff[k];
+    }
+
+    const double width =
+      2*(*std::max_element(cell.half_width, cell.half_width + dim));
+    if (cell.leaf || width < theta*std::sqrt(d)) {
+      // a leaf at distance 0 holds yi itself
+      const double n = (cell.leaf && d == 0.0) ?
+        cell.n_points - 1.0 : double(cell.n_points);
+      const double w = 1/(1 + d);
+      sum_q += n*w;
+      for (size_t k = 0; k < dim; ++k)
+        neg_f[k] += n*w*w*diff[k];
+    }
+    else {
+      for (size_t ch = 0; ch < n_children; ++ch)
+        if (cell.children[ch])
+          repulsive(cell.children[ch], yi, theta, neg_f, sum_q);
+    }
+  }
+
+  size_t child_index(const size_t c, const double *point) const {
+    size_t ch = 0;
+    for (size_t k = 0; k < dim; ++k)
+      if (point[k] > cells[c].center[k])
+        ch |= size_t(1) << k;
+    return ch;
+  }
+
+  // returns the child of c in orthant ch, creating it if needed
+  size_t child(const size_t c, const size_t ch) {
+    if (cells[c].children[ch])
+      return cells[c].children[ch];
+    Cell sub;
+    for (size_t k = 0; k < dim; ++k) {
+      sub.half_width[k] = cells[c].half_width[k]/2;
+      sub.center[k] = cells[c].center[k] +
+        (((ch >> k) & 1) ? sub.half_width[k] : -sub.half_width[k]);
+    }
+    cells.push_back(sub);
+    cells[c].children[ch] = cells.size() - 1;
+    return cells.size() - 1;
+  }
+
+  void insert(const double *point) {
+    size_t c = 0;
+    for (;;) {
+      Cell &cell = cells[c];
+      if (cell.leaf && (cell.n_points == 0 ||
+          std::equal(point, point + dim, cell.center_of_mass))) {
+        std::copy(point, point + dim, cell.center_of_mass);
+        ++cell.n_points;
+        return;
+      }
+
+      const double n = cell.n_points;
+      double old[max_dim];
+      std::copy(cell.center_of_mass, cell.center_of_mass + dim, old);
+      for (size_t k = 0; k < dim; ++k)
+        cell.center_of_mass[k] = (n*old[k] + point[k])/(n + 1);
+      ++cell.n_points;
+
+      if (cell.leaf) {
+        // move the points already here down to a new leaf
+        cell.leaf = false;
+        const size_t sub = child(c, child_index(c, old));
+        std::copy(old, old + dim, cells[sub].center_of_mass);
+        cells[sub].n_points = n;
+      }
+      c = child(c, child_index(c, point));
+    }
+  }
+
+  size_t dim;
+  size_t n_children;
+  std::vector<Cell> cells;
+};
+
+#endif
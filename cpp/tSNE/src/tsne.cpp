@@ -21,6 +21,17 @@
 #include "smithlab_utils.hpp"
 #include "smithlab_os.hpp"
 
+#include "sptree.hpp"
+#include "fftgrid.hpp"
+#include "vptree.hpp"
+#include "binary_matrix.hpp"
+#include "bench_report.hpp"
+#include "fixed_dim.hpp"
+#include "matrix.hpp"
+#ifdef TSNE_WITH_CUDA
+#include "tsne_cuda.hpp"
+#endif
+
 #include <iostream>
 #include <numeric>
 #include <cmath>
@@ -29,6 +40,12 @@
 #include <cassert>
 #include <fstream>
 #include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cstdint>
+#include <memory>
 
 using std::vector;
 using std::cerr;
@@ -38,6 +55,10 @@ using std::ifstream;
 using std::ofstream;
 using std::string;
 
+// Rows of the pairwise loops are processed in tiles of this many, so
+// the rows of a tile stay in cache while a thread goes over the others
+static const size_t tile_size = 64;
+
 // ============================================================
 // ================== PRINT AND DEBUG =========================
 // ============================================================
@@ -46,53 +67,57 @@ using std::string;
 // Input file has two numbers r and c in the first row (rows and columns)
 // the next r rows have c numbers
 static void
-read_mtx(const string &filename, vector<vector<double> > &v) {
+read_mtx(const string &filename, Matrix &v) {
   std::ifstream is(filename);
   size_t n_cells, n_dims;
   is >> n_cells >> n_dims;
-  v = vector<vector<double> >(n_cells, vector<double>(n_dims, 0.0));
+  v = Matrix(n_cells, n_dims);
   for (size_t i = 0; i < n_cells; ++i)
     for (size_t j = 0; j < n_dims; ++j)
       is >> v[i][j];
 }
 
+// Sparse matrix in compressed sparse row form: row i has the entries
+// col[row_ptr[i]], ..., col[row_ptr[i + 1] - 1], with values in val
+struct SparseMatrix {
+  vector<size_t> row_ptr;
+  vector<size_t> col;
+  vector<double> val;
+
+  size_t n_rows() const {return row_ptr.empty() ? 0 : row_ptr.size() - 1;}
+};
+
 // Preallocates all matrices
 static void
 allocate(const size_t n_cells, const size_t low_dim,
-         const double eta_init,
-         vector<vector<double> > &p,
-         vector<vector<double> > &q,
+         const double eta_init, const bool sparse,
+         Matrix &p,
+         Matrix &q,
+         Matrix &grads,
          vector<double> &eta,
-         vector<double> &deltabar,
-         vector<double> &grad,
-         vector<double> &denom) {
+         vector<double> &deltabar) {
 
   // Vector
   eta = vector<double>(low_dim, eta_init);
   deltabar = vector<double>(low_dim,  0.0);
-  grad = vector<double> (low_dim,0.0);
-  denom = vector<double>(n_cells,0.0);
 
-  // Matrices
-  p = vector<vector<double> >(n_cells, vector<double> (n_cells,0.0));
-  q = vector<vector<double> >(n_cells, vector<double> (n_cells,0.0));
+  // Matrices, the approximate gradients use a sparse p and no q
+  grads = Matrix(n_cells, low_dim);
+  if (!sparse) {
+    p = Matrix(n_cells, n_cells);
+    q = Matrix(n_cells, n_cells);
+  }
 }
 
 // ============================================================
 // ======== AUXILIARY DISTANCE/PROB FUNCTIONS =================
 // ============================================================
 
-// Computes the square Euclidean distance between two vectors
+// Sum of the values in order, so partial sums computed in parallel add
+// up to the same total for any number of threads
 static double
-sq_dist(const vector<double> &a, const vector<double> &b) {
-  size_t sa = a.size(), sb = b.size();
-  assert(sa == sb);
-  double ans = 0.0, _tmp;
-  for(size_t i = 0; i < sa; ++i){
-    _tmp = a[i] - b[i];
-    ans += (_tmp)*(_tmp);
-  }
-  return ans;
+ordered_sum(const vector<double> &x) {
+  return std::accumulate(begin(x), end(x), 0.0);
 }
 
 // ============================================================
@@ -100,73 +125,99 @@ sq_dist(const vector<double> &a, const vector<double> &b) {
 // ============================================================
 
 static double
-get_average_nn(const vector<vector<double> > &p){
-  double sum_nn = 0.0, tmp;
-  for(size_t i = 0; i < p.size(); ++i){
-    tmp = 0.0;
-    for(size_t j = 0; j < p[0].size(); ++j){
+get_average_nn(const Matrix &p){
+  const size_t n_cells = p.n_rows;
+  vector<double> nn(n_cells, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for(size_t i = 0; i < n_cells; ++i){
+    double tmp = 0.0;
+    for(size_t j = 0; j < n_cells; ++j){
       if(i != j){
         if(p[i][j] > 0) //0log(0) = 0
           tmp -= p[i][j] * log2(p[i][j]);
       }
     }
-    sum_nn += pow(2, tmp);
+    nn[i] = pow(2, tmp);
   }
 
-  return sum_nn/p.size();
+  return ordered_sum(nn)/n_cells;
 }
 
-// KL divergence between two matrices
+// KL divergence between two matrices, p divided by the exaggeration
 static double
-kl(const vector<vector<double> > &p, const vector<vector<double> > &q) {
-  double ans = 0;
-  size_t sz = p.size();
+kl(const Matrix &p, const Matrix &q, const double exaggeration = 1.0) {
+  const size_t sz = p.n_rows;
+  vector<double> row_kl(sz, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
   for (size_t i = 0 ; i < sz; ++i) {
+    double ans = 0;
     for (size_t j = 0; j < sz; ++j) {
+      const double pij = p[i][j]/exaggeration;
       if (i != j) {
-        if (p[i][j] > 0)
-          ans += p[i][j] * (log(p[i][j]) - log(q[i][j]));
+        if (pij > 0)
+          ans += pij * (log(pij) - log(q[i][j]));
       }
     }
+    row_kl[i] = ans;
   }
-  return ans;
+  return ordered_sum(row_kl);
 }
 
 
 // Computes the conditional probability that a high-dimension point was generated
 // from the distribution of one of the other points with uniform prior
 static void
-cond_prob (vector<vector<double> > &p,
-           const vector<vector<double> > &cells,
+cond_prob (Matrix &p,
+           const MatrixView &cells,
            const double sigma,
            const bool symmetrize = true){
 
-  size_t n_cells = cells.size();
+  const size_t n_cells = cells.n_rows, n_dims = cells.n_cols;
   const double denom = -2*sigma*sigma;
 
-
-  // Calculates row sums and exp euclidean distance
-  vector<double> rowsums = vector<double>(n_cells, 0.0);
-  for(size_t i = 0; i < n_cells - 1; ++i){
-    for(size_t j = i+1; j < n_cells; ++j){
-      double d = exp(sq_dist(cells[i], cells[j]) / denom);
-      rowsums[i] += d;
-      rowsums[j] += d;
-      p[i][j] = p[j][i] = d;
+  // Each thread fills whole rows, a tile at a time, so no entry is
+  // written twice and every rowsum is added up in the same order
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(size_t ib = 0; ib < n_cells; ib += tile_size){
+    const size_t ie = std::min(n_cells, ib + tile_size);
+    for(size_t jb = 0; jb < n_cells; jb += tile_size){
+      const size_t je = std::min(n_cells, jb + tile_size);
+      for(size_t i = ib; i < ie; ++i)
+        for(size_t j = jb; j < je; ++j)
+          p[i][j] = sq_dist<0>(cells[i], cells[j], n_dims);
     }
-  }
 
-  // Now divide rows by row sums
-  for(size_t i = 0; i < n_cells; ++i){
-    for(size_t j = 0; j < n_cells; ++j){
-      if(rowsums[i]>0)
-        p[i][j] = exp(log(p[i][j]) - log(rowsums[i]));
+    // exp euclidean distance, then divide rows by row sums
+    for(size_t i = ib; i < ie; ++i){
+      double *row = p[i];
+#ifdef _OPENMP
+#pragma omp simd
+#endif
+      for(size_t j = 0; j < n_cells; ++j)
+        row[j] = exp(row[j] / denom);
+      row[i] = 0.0;
+
+      double rowsum = 0.0;
+      for(size_t j = 0; j < n_cells; ++j)
+        rowsum += row[j];
+      if(rowsum > 0)
+        for(size_t j = 0; j < n_cells; ++j)
+          row[j] /= rowsum;
     }
   }
 
   // Only symmetrize when not searching for sigma
   if(symmetrize){
-    for(size_t i = 0; i < n_cells - 1; ++i){
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, tile_size)
+#endif
+    for(size_t i = 0; i < n_cells; ++i){
       for(size_t j = i+1; j < n_cells; ++j){
         p[i][j] = p[j][i] = (p[i][j] + p[j][i])/(2*n_cells);
       }
@@ -174,22 +225,24 @@ cond_prob (vector<vector<double> > &p,
   }
 }
 
-// Finds sigma given perplexity
+// Finds sigma given perplexity by bisection, with average_nn_at(sigma)
+// the average number of neighbors at sigma, adding the steps to n_steps
+template <class AverageNN>
 static double
-find_sigma(vector<vector<double> > &p,
-           const double perplexity,
-           const vector<vector<double> > &v){
+bisect_sigma(const double perplexity,
+             AverageNN average_nn_at,
+             size_t &n_steps){
   double sigma_min = 0.00001;
   double sigma_max = 100;
-  double mid;
+  double mid = (sigma_min + sigma_max)/2.0;
   // double ent;
   double average_nn;
 
   while(sigma_max - sigma_min > 0.0000001){
     mid = (sigma_min + sigma_max)/2.0;
-    cond_prob(p, v, mid, false);
+    n_steps++;
 
-    average_nn = get_average_nn(p);
+    average_nn = average_nn_at(mid);
 
     // Entropy too high -> decrease sigma
     if(average_nn > perplexity){
@@ -201,74 +254,273 @@ find_sigma(vector<vector<double> > &p,
 
   return mid;
 }
-//
+
+static double
+find_sigma(Matrix &p,
+           const double perplexity,
+           const MatrixView &v,
+           size_t &n_steps){
+  return bisect_sigma(perplexity, [&](const double sigma) {
+      cond_prob(p, v, sigma, false);
+      return get_average_nn(p);
+    }, n_steps);
+}
+
+// ============================================================
+// ==================== SPARSE AFFINITIES =====================
+// ============================================================
+
+// Finds the k nearest neighbors of each cell. The neighbors of cell i
+// and their squared distances are in positions i*k, ..., i*k + k - 1
+static void
+nearest_neighbors(const MatrixView &cells, const size_t k,
+                  vector<size_t> &nn, vector<double> &nn_dist) {
+  const size_t n_cells = cells.n_rows;
+  const VPTree tree(cells.data, n_cells, cells.n_cols);
+  nn.resize(n_cells*k);
+  nn_dist.resize(n_cells*k);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, tile_size)
+#endif
+  for (size_t i = 0; i < n_cells; ++i) {
+    vector<size_t> neighbors;
+    vector<double> sq_dists;
+    tree.search(i, k, neighbors, sq_dists);
+    copy(begin(neighbors), end(neighbors), begin(nn) + i*k);
+    copy(begin(sq_dists), end(sq_dists), begin(nn_dist) + i*k);
+  }
+}
+
+// Conditional probabilities over the nearest neighbors, with a sigma
+// for each cell such that the perplexity of its row is the given one.
+// Row i of p has the k nearest neighbors of cell i, and all others are
+// taken to be 0. Each row is an independent binary search on
+// beta = 1/(2 sigma^2), so rows are calibrated in parallel.
+static void
+cond_prob(SparseMatrix &p,
+          vector<double> &sigmas,
+          const double perplexity,
+          const vector<size_t> &nn,
+          const vector<double> &nn_dist,
+          const size_t k,
+          size_t &n_steps){
+  const size_t n_cells = nn.size()/k;
+  const double target_entropy = log(perplexity);
+  const double tolerance = 1e-5;
+  const size_t max_steps = 200;
+
+  p.row_ptr.resize(n_cells + 1);
+  p.col = nn;
+  p.val.resize(nn.size());
+  for(size_t i = 0; i <= n_cells; ++i)
+    p.row_ptr[i] = i*k;
+  sigmas.resize(n_cells);
+
+  size_t total_steps = 0;
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, tile_size) reduction(+:total_steps)
+#endif
+  for(size_t i = 0; i < n_cells; ++i){
+    const double *d = &nn_dist[i*k];
+    double *row = &p.val[i*k];
+    double beta = 1.0;
+    double beta_min = 0.0, beta_max = HUGE_VAL;
+    double row_beta = beta;
+
+    for(size_t step = 0; step < max_steps; ++step){
+      total_steps++;
+      row_beta = beta;
+      // distances relative to the nearest neighbor, so the exp does not
+      // underflow for large beta
+      double rowsum = 0.0, weighted = 0.0;
+      for(size_t j = 0; j < k; ++j){
+        row[j] = exp(-beta*(d[j] - d[0]));
+        rowsum += row[j];
+        weighted += row[j]*(d[j] - d[0]);
+      }
+      const double entropy = beta*weighted/rowsum + log(rowsum);
+      if(fabs(entropy - target_entropy) < tolerance)
+        break;
+
+      // Entropy too high -> decrease sigma
+      if(entropy > target_entropy){
+        beta_min = beta;
+        beta = (beta_max == HUGE_VAL) ? 2*beta : (beta + beta_max)/2;
+      } else {
+        beta_max = beta;
+        beta = (beta + beta_min)/2;
+      }
+    }
+
+    double rowsum = 0.0;
+    for(size_t j = 0; j < k; ++j)
+      rowsum += row[j];
+    for(size_t j = 0; j < k; ++j)
+      row[j] /= rowsum;
+    sigmas[i] = sqrt(1/(2*row_beta));
+  }
+  n_steps += total_steps;
+}
+
+// Replaces p by (p + p^T)/(2n), whose rows have the union of the
+// neighbors in p and its transpose
+static void
+symmetrize(SparseMatrix &p){
+  const size_t n_cells = p.n_rows();
+
+  // every entry (i, j) of p is also an entry (j, i)
+  vector<size_t> row_size(n_cells, 0);
+  for(size_t i = 0; i < n_cells; ++i)
+    for(size_t j = p.row_ptr[i]; j < p.row_ptr[i + 1]; ++j){
+      ++row_size[i];
+      ++row_size[p.col[j]];
+    }
+
+  SparseMatrix s;
+  s.row_ptr.resize(n_cells + 1, 0);
+  for(size_t i = 0; i < n_cells; ++i)
+    s.row_ptr[i + 1] = s.row_ptr[i] + row_size[i];
+  vector<std::pair<size_t, double> > entries(s.row_ptr[n_cells]);
+  vector<size_t> fill(begin(s.row_ptr), end(s.row_ptr) - 1);
+  for(size_t i = 0; i < n_cells; ++i)
+    for(size_t j = p.row_ptr[i]; j < p.row_ptr[i + 1]; ++j){
+      entries[fill[i]++] = std::make_pair(p.col[j], p.val[j]);
+      entries[fill[p.col[j]]++] = std::make_pair(i, p.val[j]);
+    }
+
+  // sorts each row and adds up p_ij and p_ji when both are there
+  size_t n_entries = 0;
+  for(size_t i = 0; i < n_cells; ++i){
+    const size_t first = n_entries;
+    std::sort(begin(entries) + s.row_ptr[i], begin(entries) + s.row_ptr[i + 1]);
+    for(size_t j = s.row_ptr[i]; j < s.row_ptr[i + 1]; ++j){
+      if(n_entries > first && s.col.back() == entries[j].first)
+        s.val.back() += entries[j].second;
+      else {
+        s.col.push_back(entries[j].first);
+        s.val.push_back(entries[j].second);
+        ++n_entries;
+      }
+    }
+    s.row_ptr[i] = first;
+  }
+  s.row_ptr[n_cells] = n_entries;
+  for(size_t j = 0; j < n_entries; ++j)
+    s.val[j] /= 2*n_cells;
+  std::swap(p, s);
+}
+
 // ============================================================
 // ============================ Y =============================
 // ============================================================
 
-// Random initial guess for Y
+// Random initial guess for Y, seeded from the system if seed < 0
 static void
 y_init(const size_t n_cells, const size_t dim, const double sd,
-       vector<vector<double> > &y) {
+       const int seed, Matrix &y) {
   std::random_device rd;
-  std::mt19937 gen(rd());
+  std::mt19937 gen(seed < 0 ? rd() : seed);
   std::normal_distribution<> d(0, sd);
 
-  y = vector<vector<double> >(n_cells, vector<double>(dim));
+  y = Matrix(n_cells, dim);
   for (size_t i = 0; i < n_cells; ++i)
     for (size_t j = 0; j < dim; ++j)
       y[i][j] = d(gen);
 }
 
-// Conditional distribution of a set of t-distributed points
-static void  y_q (vector<vector<double> > &q,
-                  const vector<vector<double> > &y){
+// Conditional distribution of a set of t-distributed points, with the
+// dimension of y fixed at compile time (see fixed_dim.hpp)
+template <size_t Dim>
+static void  y_q_dim (Matrix &q,
+                      const Matrix &y){
 
-  size_t n_cells = y.size();
-  double sum = 0.0;
+  const size_t n_cells = y.n_rows, low_dim = fixed_dim<Dim>(y.n_cols);
+  vector<double> rowsums(n_cells, 0.0);
 
-  for(size_t i = 0; i < n_cells - 1; ++i){
-    for(size_t j = i+1; j < n_cells; ++j){
-      q[i][j] = q[j][i] = 1/(1 + sq_dist(y[i],y[j]));
-      sum += 2*q[i][j];
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(size_t ib = 0; ib < n_cells; ib += tile_size){
+    const size_t ie = std::min(n_cells, ib + tile_size);
+    for(size_t jb = 0; jb < n_cells; jb += tile_size){
+      const size_t je = std::min(n_cells, jb + tile_size);
+      for(size_t i = ib; i < ie; ++i)
+        for(size_t j = jb; j < je; ++j)
+          q[i][j] = (i == j) ? 0.0 : 1/(1 + sq_dist<Dim>(y[i], y[j], low_dim));
     }
+    for(size_t i = ib; i < ie; ++i)
+      for(size_t j = 0; j < n_cells; ++j)
+        rowsums[i] += q[i][j];
   }
 
-  for(size_t i = 0; i < n_cells - 1; ++i){
-    for(size_t j = i+1; j < n_cells; ++j){
-      if(i != j){
-        q[i][j] = q[j][i] = q[i][j]/sum;
-       }
-    }
-  }
+  const double sum = ordered_sum(rowsums);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for(size_t i = 0; i < n_cells; ++i)
+    for(size_t j = 0; j < n_cells; ++j)
+      q[i][j] /= sum;
+}
+
+static void
+y_q (Matrix &q, const Matrix &y){
+  if(y.n_cols == 2)
+    y_q_dim<2>(q, y);
+  else if(y.n_cols == 3)
+    y_q_dim<3>(q, y);
+  else
+    y_q_dim<0>(q, y);
 }
 
 // ============================================================
 // =================== GRADIENT DESCENT =======================
 // ============================================================
 
-// Equation 5 from the tSNE paper
+// Equation 5 from the tSNE paper, for all points. Each thread computes
+// whole rows, so the gradients do not depend on the number of threads
+template <size_t Dim>
 static void
-gradient (vector<double> &grad,
-          vector<double> &denom,
-          const vector<vector<double> > &p,
-          const vector<vector<double> > &q,
-          const vector<vector<double> > &y,
-          size_t i){
-  size_t low_dim = y[0].size(),
-    n_cells = p.size();
-
-  for(size_t j = 0; j < n_cells; j++)
-    denom[j] = (1 + sq_dist(y[i],y[j]));
-
-  for(size_t k = 0; k < low_dim; ++k){
-    grad[k] = 0.0;
-    for(size_t j = 0; j < n_cells; ++j){
-      grad[k] += (p[i][j] - q[i][j])*(y[i][k] - y[j][k])/denom[j];
+gradient_dim (Matrix &grads,
+              const Matrix &p,
+              const Matrix &q,
+              const Matrix &y){
+  const size_t low_dim = fixed_dim<Dim>(y.n_cols),
+    n_cells = p.n_rows;
+
+  std::fill(begin(grads.data), end(grads.data), 0.0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic)
+#endif
+  for(size_t ib = 0; ib < n_cells; ib += tile_size){
+    const size_t ie = std::min(n_cells, ib + tile_size);
+    for(size_t jb = 0; jb < n_cells; jb += tile_size){
+      const size_t je = std::min(n_cells, jb + tile_size);
+      for(size_t i = ib; i < ie; ++i){
+        double *grad = grads[i];
+        for(size_t j = jb; j < je; ++j){
+          const double denom = 1 + sq_dist<Dim>(y[i], y[j], low_dim);
+          const double mult = (p[i][j] - q[i][j])/denom;
+          for(size_t k = 0; k < low_dim; ++k)
+            grad[k] += mult*(y[i][k] - y[j][k]);
+        }
+      }
     }
   }
 }
 
+static void
+gradient (Matrix &grads,
+          const Matrix &p,
+          const Matrix &q,
+          const Matrix &y){
+  if(y.n_cols == 2)
+    gradient_dim<2>(grads, p, q, y);
+  else if(y.n_cols == 3)
+    gradient_dim<3>(grads, p, q, y);
+  else
+    gradient_dim<0>(grads, p, q, y);
+}
+
 //Delta-bar-delta method described by Jacobs, 1988
 static void
 update_eta (double &eta, double &deltabar, const double &grad){
@@ -285,26 +537,338 @@ update_eta (double &eta, double &deltabar, const double &grad){
   deltabar = (1 - theta)*grad + theta*deltabar;
 }
 
-// Computes next y based on gradient descent
-static void 
-next_y(vector<vector<double> > &y,
-       const vector<vector<double> > &p,
-       const vector<vector<double> > &q,
+// Computes next y based on gradient descent, with all gradients
+// computed from the old y
+static void
+next_y(Matrix &y,
+       const Matrix &grads,
        vector<double> &eta,
-       vector<double> &deltabar,
-       vector<double> &grad,
-       vector<double> &denom){
-
-  size_t n_cells = y.size(), n_dims = y[0].size();
+       vector<double> &deltabar){
+  const size_t n_cells = y.n_rows, n_dims = y.n_cols;
   for(size_t i = 0; i < n_cells; ++i){
-    gradient(grad,denom,p,q,y,i);
     for(size_t j = 0; j < n_dims; ++j){
-      update_eta(eta[j], deltabar[j], grad[j]);
-      y[i][j] -= eta[j]*grad[j];
+      update_eta(eta[j], deltabar[j], grads[i][j]);
+      y[i][j] -= eta[j]*grads[i][j];
     }
   }
 }
 
+// Parameters of the optimizer with early exaggeration, momentum and
+// gains (van der Maaten, 2014), which replaces delta-bar-delta
+struct MomentumOptions {
+  double learning_rate;
+  double exaggeration;
+  // P is exaggerated, and momentum is low, for this many iterations
+  size_t exaggeration_iter;
+  double initial_momentum;
+  double final_momentum;
+
+  MomentumOptions() : learning_rate(200.0), exaggeration(12.0),
+                      exaggeration_iter(250), initial_momentum(0.5),
+                      final_momentum(0.8) {}
+};
+
+// Euclidean norm of all gradients together
+static double
+gradient_norm(const Matrix &grads){
+  double ans = 0.0;
+  for(size_t i = 0; i < grads.data.size(); ++i)
+    ans += grads.data[i]*grads.data[i];
+  return sqrt(ans);
+}
+
+// Multiplies all entries of p by the factor
+static void
+scale(Matrix &p, const double factor){
+  for(size_t i = 0; i < p.data.size(); ++i)
+    p.data[i] *= factor;
+}
+
+static void
+scale(SparseMatrix &p, const double factor){
+  for(size_t i = 0; i < p.val.size(); ++i)
+    p.val[i] *= factor;
+}
+
+// Same step as next_y with momentum and a gain for each coordinate,
+// raised while the gradient keeps its sign relative to the last step
+// and lowered when it flips. The gradients are those of equation 5 up to
+// the factor of 4, which is applied here. Y is then centered at 0.
+static void
+next_y_momentum(Matrix &y,
+                const Matrix &grads,
+                const double learning_rate,
+                const double momentum,
+                Matrix &velocity,
+                Matrix &gains){
+  const double min_gain = 0.01;
+  const size_t n_cells = y.n_rows, n_dims = y.n_cols;
+  for(size_t e = 0; e < y.data.size(); ++e){
+    const double g = 4*grads.data[e];
+    double &gain = gains.data[e], &v = velocity.data[e];
+    gain = ((g > 0) != (v > 0)) ? gain + 0.2 : gain*0.8;
+    gain = std::max(gain, min_gain);
+    v = momentum*v - learning_rate*gain*g;
+    y.data[e] += v;
+  }
+
+  for(size_t j = 0; j < n_dims; ++j){
+    double mean = 0.0;
+    for(size_t i = 0; i < n_cells; ++i)
+      mean += y[i][j];
+    mean /= n_cells;
+    for(size_t i = 0; i < n_cells; ++i)
+      y[i][j] -= mean;
+  }
+}
+
+// ============================================================
+// ======================= BARNES-HUT =========================
+// ============================================================
+
+// Puts in grad the attractive part of the gradient of point i, exact
+// over the entries of row i of p
+template <size_t Dim>
+static inline void
+attractive(double *grad, const SparseMatrix &p, const Matrix &y,
+           const size_t i){
+  const size_t low_dim = fixed_dim<Dim>(y.n_cols);
+  std::fill(grad, grad + low_dim, 0.0);
+  for(size_t e = p.row_ptr[i]; e < p.row_ptr[i + 1]; ++e){
+    const size_t j = p.col[e];
+    const double w = p.val[e]/(1 + sq_dist<Dim>(y[i], y[j], low_dim));
+    for(size_t k = 0; k < low_dim; ++k)
+      grad[k] += w*(y[i][k] - y[j][k]);
+  }
+}
+
+// Gradient of every point, with the repulsive part of equation 5 split
+// off as in van der Maaten (2014): q_ij (y_i - y_j)/denom_j is
+// (y_i - y_j)/denom_j^2 divided by the sum of 1/denom over all pairs,
+// and both sums are estimated from a tree. The attractive part is
+// exact over the entries of p. Returns the sum over all pairs, which
+// normalizes q.
+template <size_t Dim>
+static double
+gradient_bh_dim(Matrix &grads,
+                const SparseMatrix &p,
+                const Matrix &y,
+                const double theta){
+  const size_t n_cells = y.n_rows, low_dim = fixed_dim<Dim>(y.n_cols);
+  const SPTree tree(&y.data[0], n_cells, low_dim);
+
+  Matrix neg_f(n_cells, low_dim);
+  vector<double> sum_q(n_cells, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, tile_size)
+#endif
+  for(size_t i = 0; i < n_cells; ++i){
+    tree.repulsive(y[i], theta, neg_f[i], sum_q[i]);
+    attractive<Dim>(grads[i], p, y, i);
+  }
+
+  const double total_q = ordered_sum(sum_q);
+  for(size_t i = 0; i < n_cells; ++i)
+    for(size_t k = 0; k < low_dim; ++k)
+      grads[i][k] -= neg_f[i][k]/total_q;
+  return total_q;
+}
+
+static double
+gradient_bh(Matrix &grads,
+            const SparseMatrix &p,
+            const Matrix &y,
+            const double theta){
+  if(y.n_cols == 2)
+    return gradient_bh_dim<2>(grads, p, y, theta);
+  if(y.n_cols == 3)
+    return gradient_bh_dim<3>(grads, p, y, theta);
+  return gradient_bh_dim<0>(grads, p, y, theta);
+}
+
+// Same as gradient_bh, with the sums of the repulsive part interpolated
+// from a grid convolved by FFT instead of estimated from a tree
+template <size_t Dim>
+static double
+gradient_fft_dim(Matrix &grads,
+                 const SparseMatrix &p,
+                 const Matrix &y){
+  const size_t n_cells = y.n_rows, low_dim = fixed_dim<Dim>(y.n_cols);
+  const FFTGrid grid(&y.data[0], n_cells, low_dim);
+
+  Matrix neg_f(n_cells, low_dim);
+  vector<double> sum_q(n_cells, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(dynamic, tile_size)
+#endif
+  for(size_t i = 0; i < n_cells; ++i){
+    grid.repulsive(i, neg_f[i], sum_q[i]);
+    attractive<Dim>(grads[i], p, y, i);
+  }
+
+  const double total_q = ordered_sum(sum_q);
+  for(size_t i = 0; i < n_cells; ++i)
+    for(size_t k = 0; k < low_dim; ++k)
+      grads[i][k] -= neg_f[i][k]/total_q;
+  return total_q;
+}
+
+static double
+gradient_fft(Matrix &grads,
+             const SparseMatrix &p,
+             const Matrix &y){
+  if(y.n_cols == 2)
+    return gradient_fft_dim<2>(grads, p, y);
+  return gradient_fft_dim<0>(grads, p, y);
+}
+
+// KL divergence between p (divided by the exaggeration) and the q of y,
+// given its normalizing sum
+template <size_t Dim>
+static double
+kl_bh_dim(const SparseMatrix &p,
+          const Matrix &y,
+          const double sum_q,
+          const double exaggeration) {
+  const size_t n_cells = p.n_rows(), low_dim = fixed_dim<Dim>(y.n_cols);
+  vector<double> row_kl(n_cells, 0.0);
+#ifdef _OPENMP
+#pragma omp parallel for
+#endif
+  for (size_t i = 0 ; i < n_cells; ++i) {
+    double ans = 0;
+    for (size_t e = p.row_ptr[i]; e < p.row_ptr[i + 1]; ++e) {
+      const double pij = p.val[e]/exaggeration;
+      if (pij > 0)
+        ans += pij *
+          (log(pij) + log(sum_q*(1 + sq_dist<Dim>(y[i], y[p.col[e]], low_dim))));
+    }
+    row_kl[i] = ans;
+  }
+  return ordered_sum(row_kl);
+}
+
+static double
+kl_bh(const SparseMatrix &p,
+      const Matrix &y,
+      const double sum_q,
+      const double exaggeration = 1.0) {
+  if(y.n_cols == 2)
+    return kl_bh_dim<2>(p, y, sum_q, exaggeration);
+  if(y.n_cols == 3)
+    return kl_bh_dim<3>(p, y, sum_q, exaggeration);
+  return kl_bh_dim<0>(p, y, sum_q, exaggeration);
+}
+
+// Memory used by the entries of a matrix, in MB
+static double
+memory_mb(const Matrix &m) {
+  return m.data.capacity()*sizeof(double)/1048576.0;
+}
+
+static double
+memory_mb(const SparseMatrix &m) {
+  return (m.row_ptr.capacity()*sizeof(size_t) +
+          m.col.capacity()*sizeof(size_t) +
+          m.val.capacity()*sizeof(double))/1048576.0;
+}
+
+// ============================================================
+// ======================= CHECKPOINTS ========================
+// ============================================================
+
+// Everything the optimization needs to carry on from an iteration
+struct Checkpoint {
+  size_t n_iter;
+  double prev_kl;
+  double cur_kl;
+  vector<double> eta;
+  vector<double> deltabar;
+  Matrix y;
+  // state of the momentum optimizer, empty with delta-bar-delta
+  Matrix velocity;
+  Matrix gains;
+};
+
+static const char checkpoint_magic[8] = {'T','S','N','E','C','K','P','2'};
+
+// Writes the checkpoint to a temporary file and renames it, so a job
+// killed while writing leaves the previous checkpoint in place
+static void
+write_checkpoint(const string &filename, const Checkpoint &c) {
+  const string tmp = filename + ".tmp";
+  {
+    std::ofstream out(tmp.c_str(), std::ios::binary);
+    if (!out)
+      throw std::runtime_error("could not open file: " + tmp);
+    const uint64_t momentum = !c.velocity.data.empty();
+    const uint64_t header[4] = {c.y.n_rows, c.y.n_cols, c.n_iter, momentum};
+    out.write(checkpoint_magic, sizeof(checkpoint_magic));
+    out.write(reinterpret_cast<const char*>(header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(&c.prev_kl), sizeof(double));
+    out.write(reinterpret_cast<const char*>(&c.cur_kl), sizeof(double));
+    out.write(reinterpret_cast<const char*>(&c.eta[0]),
+              c.eta.size()*sizeof(double));
+    out.write(reinterpret_cast<const char*>(&c.deltabar[0]),
+              c.deltabar.size()*sizeof(double));
+    out.write(reinterpret_cast<const char*>(&c.y.data[0]),
+              c.y.data.size()*sizeof(double));
+    if (momentum) {
+      out.write(reinterpret_cast<const char*>(&c.velocity.data[0]),
+                c.velocity.data.size()*sizeof(double));
+      out.write(reinterpret_cast<const char*>(&c.gains.data[0]),
+                c.gains.data.size()*sizeof(double));
+    }
+    if (!out)
+      throw std::runtime_error("could not write checkpoint: " + tmp);
+  }
+  if (rename(tmp.c_str(), filename.c_str()) != 0)
+    throw std::runtime_error("could not rename " + tmp + " to " + filename);
+}
+
+// Reads a checkpoint of an embedding of n_cells points in low_dim,
+// written by the momentum optimizer or by delta-bar-delta
+static void
+read_checkpoint(const string &filename, const size_t n_cells,
+                const size_t low_dim, const bool momentum, Checkpoint &c) {
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+    throw std::runtime_error("could not open file: " + filename);
+  char magic[sizeof(checkpoint_magic)];
+  uint64_t header[4];
+  in.read(magic, sizeof(magic));
+  in.read(reinterpret_cast<char*>(header), sizeof(header));
+  if (!in || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0)
+    throw std::runtime_error("malformatted checkpoint file: " + filename);
+  if (header[0] != n_cells || header[1] != low_dim)
+    throw std::runtime_error("checkpoint does not match the input: " +
+                             filename);
+  if (header[3] != momentum)
+    throw std::runtime_error("checkpoint was written by the other "
+                             "optimizer: " + filename);
+
+  c.n_iter = header[2];
+  c.eta.resize(low_dim);
+  c.deltabar.resize(low_dim);
+  c.y = Matrix(n_cells, low_dim);
+  in.read(reinterpret_cast<char*>(&c.prev_kl), sizeof(double));
+  in.read(reinterpret_cast<char*>(&c.cur_kl), sizeof(double));
+  in.read(reinterpret_cast<char*>(&c.eta[0]), low_dim*sizeof(double));
+  in.read(reinterpret_cast<char*>(&c.deltabar[0]), low_dim*sizeof(double));
+  in.read(reinterpret_cast<char*>(&c.y.data[0]),
+          c.y.data.size()*sizeof(double));
+  if (momentum) {
+    c.velocity = Matrix(n_cells, low_dim);
+    c.gains = Matrix(n_cells, low_dim);
+    in.read(reinterpret_cast<char*>(&c.velocity.data[0]),
+            c.velocity.data.size()*sizeof(double));
+    in.read(reinterpret_cast<char*>(&c.gains.data[0]),
+            c.gains.data.size()*sizeof(double));
+  }
+  if (!in)
+    throw std::runtime_error("truncated checkpoint file: " + filename);
+}
+
 // ===========================================================
 // ================= MAIN FOR TESTING ========================
 // ===========================================================
@@ -317,11 +881,25 @@ main(int argc, const char **argv) {
     double sigma = 0.0;
     double low_sigma = 1.0;
     double eta_init = 100.0;
+    double theta = 0.0;
+    bool fft = false;
 
     size_t low_dim = 2;
+    size_t max_iter = 0;
+    int seed = -1;
+    double min_grad = 1e-7;
+
+    bool momentum = false;
+    MomentumOptions mopt;
+    size_t kl_every = 0;
 
     /* FILES */
     string outfile;
+    string checkpoint_file;
+    string trace_file;
+    size_t checkpoint_every = 100;
+    bool resume = false;
+    bool use_gpu = false;
     bool VERBOSE = false;
 
     /****************** GET COMMAND LINE ARGUMENTS ***************************/
@@ -329,6 +907,41 @@ main(int argc, const char **argv) {
     opt_parse.add_opt("output", 'o', "output file (default: stdout)",
                       false , outfile);
     opt_parse.add_opt("perp", 'p', "perplexity", false , perplexity);
+    opt_parse.add_opt("dim", 'd', "dimension of the output", false , low_dim);
+    opt_parse.add_opt("theta", 't', "Barnes-Hut accuracy, 0 for the exact "
+                      "gradient (default: 0)", false , theta);
+    opt_parse.add_opt("fft", 'f', "repulsive forces interpolated on a grid "
+                      "by FFT instead of Barnes-Hut, for dimension 1 or 2",
+                      false , fft);
+    opt_parse.add_opt("max-iter", 'n', "stop after this many iterations "
+                      "(default: when kl stops decreasing, 1000 with "
+                      "--momentum)", false , max_iter);
+    opt_parse.add_opt("min-grad", 'g', "stop when the norm of the gradient "
+                      "is below this (default: 1e-7)", false , min_grad);
+    opt_parse.add_opt("momentum", 'm', "optimize with early exaggeration, "
+                      "momentum and gains instead of delta-bar-delta",
+                      false , momentum);
+    opt_parse.add_opt("exaggeration", 'x', "early exaggeration of p with "
+                      "--momentum (default: 12)", false , mopt.exaggeration);
+    opt_parse.add_opt("exag-iter", 'X', "iterations of early exaggeration "
+                      "(default: 250)", false , mopt.exaggeration_iter);
+    opt_parse.add_opt("learning-rate", 'l', "learning rate of --momentum "
+                      "(default: 200)", false , mopt.learning_rate);
+    opt_parse.add_opt("kl-every", 'k', "with --momentum, iterations between "
+                      "kl reports with -v (default: only at the end)",
+                      false , kl_every);
+    opt_parse.add_opt("seed", 's', "seed of the initial solution "
+                      "(default: random)", false , seed);
+    opt_parse.add_opt("checkpoint", 'c', "write the state of the "
+                      "optimization to this file", false , checkpoint_file);
+    opt_parse.add_opt("every", 'e', "iterations between checkpoints "
+                      "(default: 100)", false , checkpoint_every);
+    opt_parse.add_opt("resume", 'r', "carry on from the checkpoint file",
+                      false , resume);
+    opt_parse.add_opt("gpu", 'G', "run the exact mode on the GPU (needs "
+                      "a build with CUDA=1)", false , use_gpu);
+    opt_parse.add_opt("trace", 'T', "write the time, gradient norm and kl "
+                      "of every iteration to this file", false , trace_file);
     opt_parse.add_opt("verbose", 'v', "print more run info",
                       false , VERBOSE);
     vector<string> leftover_args;
@@ -350,72 +963,411 @@ main(int argc, const char **argv) {
       return EXIT_SUCCESS;
     }
     const string matrix_file(leftover_args.front());
+    const bool barnes_hut = (theta > 0.0 && !fft);
+    // both approximations use the sparse p of the nearest neighbors
+    const bool sparse = (barnes_hut || fft);
+    if (low_dim == 0) {
+      cerr << "output dimension must be positive" << endl;
+      return EXIT_FAILURE;
+    }
+    if (barnes_hut && (low_dim < 2 || low_dim > SPTree::max_dim)) {
+      cerr << "Barnes-Hut needs an output dimension of 2 or 3" << endl;
+      return EXIT_FAILURE;
+    }
+    if (fft && low_dim > FFTGrid::max_dim) {
+      cerr << "--fft needs an output dimension of 1 or 2" << endl;
+      return EXIT_FAILURE;
+    }
+    if ((resume && checkpoint_file.empty()) || checkpoint_every == 0) {
+      cerr << "--resume needs a checkpoint file and --every must be "
+           << "positive" << endl;
+      return EXIT_FAILURE;
+    }
+    if (use_gpu && sparse) {
+      cerr << "--gpu only runs the exact mode, without -t or -f" << endl;
+      return EXIT_FAILURE;
+    }
+#ifndef TSNE_WITH_CUDA
+    if (use_gpu) {
+      cerr << "--gpu needs tsne to be built with CUDA=1" << endl;
+      return EXIT_FAILURE;
+    }
+#endif
+    if (momentum && max_iter == 0)
+      max_iter = 1000;
     /**********************************************************************/
 
     // Matrices
-    vector<vector<double> > v;
-    // Fills the v vector with input matrix
-    read_mtx (matrix_file, v);
-    const size_t n_cells = v.size();
+    // Fills the v vector with input matrix, a binary matrix file is used
+    // in place
+    // with -v, the time of every phase is printed at the end
+    BenchReport bench("tsne");
+    if (VERBOSE)
+      bench.collect();
+    const double start = BenchReport::now();
+    Matrix v_text;
+    std::unique_ptr<BinaryMatrix> v_binary;
+    if (is_binary_matrix(matrix_file))
+      v_binary.reset(new BinaryMatrix(matrix_file));
+    else
+      read_mtx (matrix_file, v_text);
+    const MatrixView v = v_binary ?
+      MatrixView(v_binary->rows(), v_binary->n_rows(), v_binary->n_cols()) :
+      MatrixView(v_text);
+    const size_t n_cells = v.n_rows;
+    bench.add("parse", BenchReport::now() - start, n_cells);
+    bench.set_size(n_cells, v.n_cols);
     if (VERBOSE)
       cerr << "n_cells=" << n_cells << endl;
 
+#ifdef TSNE_WITH_CUDA
+    // With --gpu p only lives on the device, and y and the momentum
+    // between the device and the host (see tsne_cuda.hpp)
+    std::unique_ptr<ExactGpu> gpu;
+    if (use_gpu) {
+      PhaseTimer t(bench, "gpu_init", n_cells);
+      gpu.reset(new ExactGpu(v, low_dim));
+    }
+#endif
+
     // Vectors
-    vector<double> eta, deltabar, grad, denom;
-    vector<vector<double> > p,q,y;
-    // Preallocates all matrices
-    allocate(n_cells, low_dim, eta_init,
-             p, q,
+    vector<double> eta, deltabar;
+    Matrix p,q,y,grads;
+    // Preallocates all matrices, p and q are not needed on the host with
+    // --gpu
+    allocate(n_cells, low_dim, eta_init, sparse || use_gpu,
+             p, q, grads,
              // y,
-             eta, deltabar, grad, denom);
+             eta, deltabar);
 
     // Binary search to convert perplexity to sigma
-    if (VERBOSE)
-      cerr << "Finding sigma for perplexity = " << perplexity << "...\n";
-    sigma = find_sigma(p,perplexity,v);
-    if (VERBOSE)
-      cerr << "Perplexity = " << perplexity << " -> Sigma = " << sigma << "\n";
+    SparseMatrix p_sparse;
+    vector<size_t> nn;
+    vector<double> nn_dist;
+    size_t bisection_steps = 0;
+    if (sparse) {
+      // only the 3*perplexity nearest neighbors of each cell
+      const size_t k = std::min(n_cells - 1, size_t(3*perplexity));
+      if (k == 0)
+        throw std::runtime_error("need at least two cells");
+      if (VERBOSE)
+        cerr << "Finding " << k << " nearest neighbors...\n";
+      {
+        PhaseTimer t(bench, "neighbors", n_cells);
+        nearest_neighbors(v, k, nn, nn_dist);
+      }
+      if (VERBOSE)
+        cerr << "Finding sigmas for perplexity = " << perplexity << "...\n";
+      vector<double> sigmas;
+      {
+        PhaseTimer t(bench, "sigma", n_cells);
+        cond_prob(p_sparse, sigmas, perplexity, nn, nn_dist, k,
+                  bisection_steps);
+      }
+      sigma = std::accumulate(begin(sigmas), end(sigmas), 0.0)/n_cells;
+      PhaseTimer t(bench, "p", n_cells);
+      symmetrize(p_sparse);
+    }
+    else {
+      if (VERBOSE)
+        cerr << "Finding sigma for perplexity = " << perplexity << "...\n";
+#ifdef TSNE_WITH_CUDA
+      if (gpu) {
+        {
+          PhaseTimer t(bench, "sigma", n_cells);
+          sigma = bisect_sigma(perplexity, [&](const double s) {
+              return gpu->average_nn(s);
+            }, bisection_steps);
+        }
+        PhaseTimer t(bench, "p", n_cells);
+        gpu->cond_prob(sigma);
+      }
+      else
+#endif
+      {
+        {
+          PhaseTimer t(bench, "sigma", n_cells);
+          sigma = find_sigma(p,perplexity,v,bisection_steps);
+        }
 
-    // Calculates conditional probabilities from high dimension data
-    cond_prob(p, v, sigma);
+        // Calculates conditional probabilities from high dimension data
+        PhaseTimer t(bench, "p", n_cells);
+        cond_prob(p, v, sigma);
+      }
+    }
+    if (VERBOSE)
+      cerr << "Perplexity = " << perplexity << " -> Sigma = " << sigma
+           << (sparse ? " (mean)" : "") << "\n"
+           << "bisection_steps=" << bisection_steps << "\n"
+           << "memory_p_mb=" << (sparse ? memory_mb(p_sparse) : memory_mb(p))
+           << "\n"
+           << "memory_q_mb=" << memory_mb(q) << "\n";
+#ifdef TSNE_WITH_CUDA
+    if (VERBOSE && gpu)
+      cerr << "memory_gpu_mb=" << gpu->memory_bytes()/1048576.0 << "\n";
+#endif
 
     // Initial random solution for y
     // TODO: implement an educated guess
-    y_init(n_cells, low_dim, low_sigma, y);
-
     size_t n_iter = 0;
     double prev_kl = 1e9; // MAGIC!
     double cur_kl = 1e5; // MAGIC!
-    for (; cur_kl < prev_kl; n_iter++) {
-      // Calculates q matrix
-      y_q(q,y);
-
-      // Calculates kl divergence between p and q
-      const double tmp_kl = kl(p,q);
-      if (n_iter % 100 == 0) {
-        prev_kl = cur_kl;
-        cur_kl = tmp_kl;
-        if (VERBOSE)
+    Matrix velocity, gains;
+    if (resume) {
+      Checkpoint c;
+      read_checkpoint(checkpoint_file, n_cells, low_dim, momentum, c);
+      n_iter = c.n_iter;
+      prev_kl = c.prev_kl;
+      cur_kl = c.cur_kl;
+      eta = c.eta;
+      deltabar = c.deltabar;
+      y = std::move(c.y);
+      velocity = std::move(c.velocity);
+      gains = std::move(c.gains);
+      if (VERBOSE)
+        cerr << "Resuming from iteration " << n_iter << endl;
+    }
+    else {
+      // the momentum optimizer starts from a tight ball, as in bhtsne
+      y_init(n_cells, low_dim, momentum ? 1e-4 : low_sigma, seed, y);
+      if (momentum) {
+        velocity = Matrix(n_cells, low_dim, 0.0);
+        gains = Matrix(n_cells, low_dim, 1.0);
+      }
+    }
+#ifdef TSNE_WITH_CUDA
+    if (gpu) {
+      gpu->set_y(y);
+      if (momentum)
+        gpu->set_momentum(velocity, gains);
+    }
+#endif
+
+    // exaggerates p during the first iterations
+    double exaggeration = 1.0;
+    if (momentum && n_iter < mopt.exaggeration_iter) {
+      exaggeration = mopt.exaggeration;
+#ifdef TSNE_WITH_CUDA
+      if (gpu)
+        gpu->scale_p(exaggeration);
+      else
+#endif
+      if (sparse)
+        scale(p_sparse, exaggeration);
+      else
+        scale(p, exaggeration);
+    }
+
+    // KL is only computed when it is needed: every 100 iterations as the
+    // stopping rule of delta-bar-delta, or as asked for by --kl-every
+    const size_t first_iter = n_iter;
+    double sum_q = 0.0;
+    std::ofstream trace;
+    if (!trace_file.empty()) {
+      trace.open(trace_file.c_str());
+      if (!trace)
+        throw std::runtime_error("could not open file: " + trace_file);
+      trace << "iteration\tseconds\tgradient_norm\tkl\n";
+    }
+    // iterations per second since the last kl printed
+    size_t report_iter = n_iter;
+    double report_time = BenchReport::now();
+    for (; (momentum || cur_kl < prev_kl) &&
+           (max_iter == 0 || n_iter < max_iter); n_iter++) {
+      const double iter_start = BenchReport::now();
+      if (!checkpoint_file.empty() && n_iter != first_iter &&
+          n_iter % checkpoint_every == 0) {
+#ifdef TSNE_WITH_CUDA
+        // only here, and at the end, does y leave the device
+        if (gpu) {
+          gpu->get_y(y);
+          if (momentum)
+            gpu->get_momentum(velocity, gains);
+        }
+#endif
+        // the matrices are lent to the checkpoint, not copied
+        Checkpoint c = {n_iter, prev_kl, cur_kl, eta, deltabar, std::move(y),
+                        std::move(velocity), std::move(gains)};
+        write_checkpoint(checkpoint_file, c);
+        y = std::move(c.y);
+        velocity = std::move(c.velocity);
+        gains = std::move(c.gains);
+      }
+      if (momentum && n_iter == mopt.exaggeration_iter &&
+          exaggeration != 1.0) {
+#ifdef TSNE_WITH_CUDA
+        if (gpu)
+          gpu->scale_p(1/exaggeration);
+        else
+#endif
+        if (sparse)
+          scale(p_sparse, 1/exaggeration);
+        else
+          scale(p, 1/exaggeration);
+        exaggeration = 1.0;
+      }
+
+      const bool want_kl = momentum ?
+        (VERBOSE && kl_every > 0 && n_iter % kl_every == 0) :
+        (n_iter % 100 == 0);
+      double tmp_kl = 0.0;
+#ifdef TSNE_WITH_CUDA
+      if (gpu) {
+        // q is recomputed from y by the kernels that need it
+        {
+          PhaseTimer t(bench, "gradient", n_cells);
+          gpu->gradient();
+        }
+        if (want_kl) {
+          PhaseTimer t(bench, "kl", n_cells);
+          tmp_kl = gpu->kl(exaggeration);
+        }
+      }
+      else
+#endif
+      if (sparse) {
+        // q is only known through its normalizing sum
+        {
+          PhaseTimer t(bench, "gradient", n_cells);
+          sum_q = fft ? gradient_fft(grads, p_sparse, y) :
+            gradient_bh(grads, p_sparse, y, theta);
+        }
+        if (want_kl) {
+          PhaseTimer t(bench, "kl", n_cells);
+          tmp_kl = kl_bh(p_sparse, y, sum_q, exaggeration);
+        }
+      }
+      else {
+        // Calculates q matrix
+        {
+          PhaseTimer t(bench, "q", n_cells);
+          y_q(q,y);
+        }
+
+        // Calculates kl divergence between p and q
+        if (want_kl) {
+          PhaseTimer t(bench, "kl", n_cells);
+          tmp_kl = kl(p, q, exaggeration);
+        }
+        PhaseTimer t(bench, "gradient", n_cells);
+        gradient(grads, p, q, y);
+      }
+      if (want_kl) {
+        if (!momentum) {
+          prev_kl = cur_kl;
+          cur_kl = tmp_kl;
+        }
+        if (VERBOSE) {
           cerr << "iteration=" << n_iter << endl
-               << "kl_divergence= " << cur_kl << endl;
+               << "kl_divergence= " << tmp_kl << endl;
+          const double now = BenchReport::now();
+          if (n_iter > report_iter)
+            cerr << "iterations_per_second="
+                 << (n_iter - report_iter)/(now - report_time) << endl;
+          report_iter = n_iter;
+          report_time = now;
+        }
+      }
+
+#ifdef TSNE_WITH_CUDA
+      const double grad_norm = gpu ? gpu->gradient_norm() :
+        gradient_norm(grads);
+#else
+      const double grad_norm = gradient_norm(grads);
+#endif
+      if (grad_norm < min_grad) {
+        if (VERBOSE)
+          cerr << "gradient norm below " << min_grad << endl;
+        break;
+      }
+      {
+        PhaseTimer t(bench, "step", n_cells);
+#ifdef TSNE_WITH_CUDA
+        // delta-bar-delta updates the rates in order of the cells, so its
+        // steps are taken on the host
+        if (gpu && momentum)
+          gpu->step_momentum(mopt.learning_rate,
+                             n_iter < mopt.exaggeration_iter ?
+                             mopt.initial_momentum : mopt.final_momentum);
+        else if (gpu) {
+          gpu->get_gradients(grads);
+          next_y(y, grads, eta, deltabar);
+          gpu->set_y(y);
+        }
+        else
+#endif
+        if (momentum)
+          next_y_momentum(y, grads, mopt.learning_rate,
+                          n_iter < mopt.exaggeration_iter ?
+                          mopt.initial_momentum : mopt.final_momentum,
+                          velocity, gains);
+        else
+          next_y(y, grads, eta, deltabar);
+      }
+
+      if (trace.is_open()) {
+        trace << n_iter << '\t' << BenchReport::now() - iter_start << '\t'
+              << grad_norm << '\t';
+        if (want_kl)
+          trace << tmp_kl << '\n';
+        else
+          trace << "NA\n";
       }
-      next_y(y, p, q, eta, deltabar, grad, denom);
     }
 
-    if (VERBOSE)
+    if (VERBOSE) {
+      if (momentum) {
+        // final kl of the last y, on the unexaggerated p
+        if (exaggeration != 1.0) {
+#ifdef TSNE_WITH_CUDA
+          if (gpu)
+            gpu->scale_p(1/exaggeration);
+          else
+#endif
+          if (sparse)
+            scale(p_sparse, 1/exaggeration);
+          else
+            scale(p, 1/exaggeration);
+        }
+#ifdef TSNE_WITH_CUDA
+        if (gpu) {
+          gpu->gradient();
+          cur_kl = gpu->kl(1.0);
+        }
+        else
+#endif
+        if (sparse) {
+          sum_q = fft ? gradient_fft(grads, p_sparse, y) :
+            gradient_bh(grads, p_sparse, y, theta);
+          cur_kl = kl_bh(p_sparse, y, sum_q);
+        }
+        else {
+          y_q(q, y);
+          cur_kl = kl(p, q);
+        }
+      }
       cerr << "iteration=" << n_iter << endl
            << "kl_divergence= " << cur_kl << endl;
+    }
 
+#ifdef TSNE_WITH_CUDA
+    if (gpu)
+      gpu->get_y(y);
+#endif
     std::ofstream of;
     if (!outfile.empty()) of.open(outfile.c_str());
     std::ostream out(outfile.empty() ? std::cout.rdbuf() : of.rdbuf());
 
-    for (size_t i = 0; i < y.size(); ++i) {
+    for (size_t i = 0; i < y.n_rows; ++i) {
       // out << row_names[i];
-      copy(begin(y[i]), end(y[i]),
+      copy(y[i], y[i] + y.n_cols,
            std::ostream_iterator<double>(out, "\t"));
       out << endl;
     }
+    bench.add("total", BenchReport::now() - start, n_cells);
+    if (VERBOSE)
+      bench.print(cerr);
+    bench.write();
   }
   catch (std::exception &e) {
     cerr << "ERROR:\t" << e.what() << endl;
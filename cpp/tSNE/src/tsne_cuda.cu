@@ -0,0 +1,374 @@
+/* tsne_cuda: the O(N^2) loops of the exact mode of tsne on a GPU
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#include "tsne_cuda.hpp"
+#include "cuda_reduce.cuh"
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+
+using std::string;
+
+// The pairwise kernels have a block per row of p, whose block_size
+// threads (see cuda_reduce.cuh) go over the columns, so the reads of p
+// are coalesced. The others have a thread per entry, in at most this
+// many blocks
+static const size_t max_blocks = 65535;
+
+static void
+check(const cudaError_t e, const char *what) {
+  if (e != cudaSuccess)
+    throw std::runtime_error(string(what) + ": " + cudaGetErrorString(e));
+}
+
+static size_t
+entry_blocks(const size_t n_entries) {
+  return std::min(max_blocks, (n_entries + block_size - 1)/block_size);
+}
+
+// ============================================================
+// ========================= KERNELS ==========================
+// ============================================================
+
+__device__ static double
+sq_dist(const double *a, const double *b, const size_t n) {
+  double ans = 0.0;
+  for (size_t k = 0; k < n; ++k) {
+    const double diff = a[k] - b[k];
+    ans += diff*diff;
+  }
+  return ans;
+}
+
+__global__ static void
+scale_kernel(double *x, const size_t n, const double factor) {
+  for (size_t e = blockIdx.x*block_size + threadIdx.x; e < n;
+       e += gridDim.x*block_size)
+    x[e] *= factor;
+}
+
+// d[i][j] = |x_i - x_j|^2
+__global__ static void
+sq_dist_kernel(double *d, const double *x, const size_t n,
+               const size_t n_dims) {
+  const size_t i = blockIdx.x;
+  for (size_t j = threadIdx.x; j < n; j += block_size)
+    d[i*n + j] = sq_dist(x + i*n_dims, x + j*n_dims, n_dims);
+}
+
+// nn[i] = 2^H of row i of the conditional p, from the squared distances
+__global__ static void
+average_nn_kernel(const double *d, double *nn, const size_t n,
+                  const double denom) {
+  const size_t i = blockIdx.x;
+  const double *row = d + i*n;
+  double rowsum = 0.0;
+  for (size_t j = threadIdx.x; j < n; j += block_size)
+    if (j != i)
+      rowsum += exp(row[j]/denom);
+  rowsum = block_sum(rowsum);
+
+  double ent = 0.0;
+  if (rowsum > 0)
+    for (size_t j = threadIdx.x; j < n; j += block_size) {
+      const double pij = exp(row[j]/denom)/rowsum;
+      if (j != i && pij > 0) //0log(0) = 0
+        ent -= pij*log2(pij);
+    }
+  ent = block_sum(ent);
+  if (threadIdx.x == 0)
+    nn[i] = pow(2.0, ent);
+}
+
+// The squared distances of row i become its conditional p
+__global__ static void
+cond_prob_kernel(double *d, const size_t n, const double denom) {
+  const size_t i = blockIdx.x;
+  double *row = d + i*n;
+  double rowsum = 0.0;
+  for (size_t j = threadIdx.x; j < n; j += block_size) {
+    row[j] = (j == i) ? 0.0 : exp(row[j]/denom);
+    rowsum += row[j];
+  }
+  rowsum = block_sum(rowsum);
+  if (rowsum > 0)
+    for (size_t j = threadIdx.x; j < n; j += block_size)
+      row[j] /= rowsum;
+}
+
+// Row i does the pairs (i, j) with j > i, so each pair is done once
+__global__ static void
+symmetrize_kernel(double *p, const size_t n) {
+  const size_t i = blockIdx.x;
+  for (size_t j = i + 1 + threadIdx.x; j < n; j += block_size)
+    p[i*n + j] = p[j*n + i] = (p[i*n + j] + p[j*n + i])/(2*n);
+}
+
+// rowsums[i] is the sum of the unnormalized q of row i
+__global__ static void
+q_sum_kernel(const double *y, const size_t n, const size_t low_dim,
+             double *rowsums) {
+  const size_t i = blockIdx.x;
+  double ans = 0.0;
+  for (size_t j = threadIdx.x; j < n; j += block_size)
+    if (j != i)
+      ans += 1/(1 + sq_dist(y + i*low_dim, y + j*low_dim, low_dim));
+  ans = block_sum(ans);
+  if (threadIdx.x == 0)
+    rowsums[i] = ans;
+}
+
+// Equation 5 from the tSNE paper for row i, with sum_q[0] the sum of q
+__global__ static void
+gradient_kernel(const double *p, const double *y, const size_t n,
+                const size_t low_dim, const double *sum_q,
+                double *grads) {
+  const size_t i = blockIdx.x;
+  const double sum = sum_q[0];
+  double yi[ExactGpu::max_dim], grad[ExactGpu::max_dim];
+  for (size_t k = 0; k < low_dim; ++k) {
+    yi[k] = y[i*low_dim + k];
+    grad[k] = 0.0;
+  }
+  for (size_t j = threadIdx.x; j < n; j += block_size) {
+    if (j == i)
+      continue;
+    const double *yj = y + j*low_dim;
+    const double denom = 1 + sq_dist(yi, yj, low_dim);
+    const double mult = (p[i*n + j] - (1/denom)/sum)/denom;
+    for (size_t k = 0; k < low_dim; ++k)
+      grad[k] += mult*(yi[k] - yj[k]);
+  }
+  for (size_t k = 0; k < low_dim; ++k) {
+    const double g = block_sum(grad[k]);
+    if (threadIdx.x == 0)
+      grads[i*low_dim + k] = g;
+  }
+}
+
+// rowkl[i] is the KL divergence of row i, p divided by the exaggeration
+__global__ static void
+kl_kernel(const double *p, const double *y, const size_t n,
+          const size_t low_dim, const double *sum_q,
+          const double exaggeration, double *rowkl) {
+  const size_t i = blockIdx.x;
+  const double sum = sum_q[0];
+  double ans = 0.0;
+  for (size_t j = threadIdx.x; j < n; j += block_size) {
+    const double pij = p[i*n + j]/exaggeration;
+    if (j != i && pij > 0) {
+      const double qij =
+        (1/(1 + sq_dist(y + i*low_dim, y + j*low_dim, low_dim)))/sum;
+      ans += pij*(log(pij) - log(qij));
+    }
+  }
+  ans = block_sum(ans);
+  if (threadIdx.x == 0)
+    rowkl[i] = ans;
+}
+
+// The step of next_y_momentum for every coordinate
+__global__ static void
+momentum_kernel(double *y, const double *grads, double *velocity,
+                double *gains, const size_t n, const double learning_rate,
+                const double momentum) {
+  const double min_gain = 0.01;
+  for (size_t e = blockIdx.x*block_size + threadIdx.x; e < n;
+       e += gridDim.x*block_size) {
+    const double g = 4*grads[e];
+    double gain = gains[e], v = velocity[e];
+    gain = ((g > 0) != (v > 0)) ? gain + 0.2 : gain*0.8;
+    gain = max(gain, min_gain);
+    v = momentum*v - learning_rate*gain*g;
+    gains[e] = gain;
+    velocity[e] = v;
+    y[e] += v;
+  }
+}
+
+// Column blockIdx.x of y goes to mean 0
+__global__ static void
+center_kernel(double *y, const size_t n, const size_t low_dim) {
+  const size_t k = blockIdx.x;
+  double mean = 0.0;
+  for (size_t i = threadIdx.x; i < n; i += block_size)
+    mean += y[i*low_dim + k];
+  mean = block_sum(mean)/n;
+  for (size_t i = threadIdx.x; i < n; i += block_size)
+    y[i*low_dim + k] -= mean;
+}
+
+// ============================================================
+// ========================= ExactGpu =========================
+// ============================================================
+
+static double *
+device_alloc(const size_t n) {
+  void *ptr = 0;
+  check(cudaMalloc(&ptr, n*sizeof(double)), "cudaMalloc");
+  return static_cast<double*>(ptr);
+}
+
+static void
+to_device(double *dst, const double *src, const size_t n) {
+  check(cudaMemcpy(dst, src, n*sizeof(double), cudaMemcpyHostToDevice),
+        "cudaMemcpy");
+}
+
+static void
+to_host(double *dst, const double *src, const size_t n) {
+  check(cudaMemcpy(dst, src, n*sizeof(double), cudaMemcpyDeviceToHost),
+        "cudaMemcpy");
+}
+
+ExactGpu::ExactGpu(const MatrixView &cells, const size_t dim) :
+  n_cells(cells.n_rows), low_dim(dim) {
+  if (low_dim > max_dim)
+    throw std::runtime_error("the GPU gradient needs a dimension of at "
+                             "most " + std::to_string(max_dim));
+  p = device_alloc(n_cells*n_cells);
+  y = device_alloc(n_cells*low_dim);
+  grads = device_alloc(n_cells*low_dim);
+  velocity = device_alloc(n_cells*low_dim);
+  gains = device_alloc(n_cells*low_dim);
+  row_sums = device_alloc(n_cells);
+  scalars = device_alloc(2);
+
+  double *x = device_alloc(n_cells*cells.n_cols);
+  to_device(x, cells.data, n_cells*cells.n_cols);
+  sq_dist_kernel<<<n_cells, block_size>>>(p, x, n_cells, cells.n_cols);
+  check(cudaGetLastError(), "sq_dist_kernel");
+  check(cudaFree(x), "cudaFree");
+}
+
+ExactGpu::~ExactGpu() {
+  cudaFree(p);
+  cudaFree(y);
+  cudaFree(grads);
+  cudaFree(velocity);
+  cudaFree(gains);
+  cudaFree(row_sums);
+  cudaFree(scalars);
+}
+
+double
+ExactGpu::reduce(const double *x, const size_t n, const bool squares) const {
+  sum_kernel<<<1, block_size>>>(x, n, squares, scalars + 1);
+  check(cudaGetLastError(), "sum_kernel");
+  double ans;
+  to_host(&ans, scalars + 1, 1);
+  return ans;
+}
+
+double
+ExactGpu::average_nn(const double sigma) {
+  average_nn_kernel<<<n_cells, block_size>>>(p, row_sums, n_cells,
+                                             -2*sigma*sigma);
+  check(cudaGetLastError(), "average_nn_kernel");
+  return reduce(row_sums, n_cells)/n_cells;
+}
+
+void
+ExactGpu::cond_prob(const double sigma) {
+  cond_prob_kernel<<<n_cells, block_size>>>(p, n_cells, -2*sigma*sigma);
+  check(cudaGetLastError(), "cond_prob_kernel");
+  symmetrize_kernel<<<n_cells, block_size>>>(p, n_cells);
+  check(cudaGetLastError(), "symmetrize_kernel");
+}
+
+void
+ExactGpu::scale_p(const double factor) {
+  const size_t n = n_cells*n_cells;
+  scale_kernel<<<entry_blocks(n), block_size>>>(p, n, factor);
+  check(cudaGetLastError(), "scale_kernel");
+}
+
+void
+ExactGpu::set_y(const Matrix &m) {
+  to_device(y, m.data.data(), n_cells*low_dim);
+}
+
+void
+ExactGpu::get_y(Matrix &m) const {
+  m = Matrix(n_cells, low_dim);
+  to_host(m.data.data(), y, n_cells*low_dim);
+}
+
+void
+ExactGpu::set_momentum(const Matrix &v, const Matrix &g) {
+  to_device(velocity, v.data.data(), n_cells*low_dim);
+  to_device(gains, g.data.data(), n_cells*low_dim);
+}
+
+void
+ExactGpu::get_momentum(Matrix &v, Matrix &g) const {
+  v = Matrix(n_cells, low_dim);
+  g = Matrix(n_cells, low_dim);
+  to_host(v.data.data(), velocity, n_cells*low_dim);
+  to_host(g.data.data(), gains, n_cells*low_dim);
+}
+
+void
+ExactGpu::gradient() {
+  q_sum_kernel<<<n_cells, block_size>>>(y, n_cells, low_dim, row_sums);
+  check(cudaGetLastError(), "q_sum_kernel");
+  sum_kernel<<<1, block_size>>>(row_sums, n_cells, false, scalars);
+  check(cudaGetLastError(), "sum_kernel");
+  gradient_kernel<<<n_cells, block_size>>>(p, y, n_cells, low_dim, scalars,
+                                           grads);
+  check(cudaGetLastError(), "gradient_kernel");
+}
+
+double
+ExactGpu::kl(const double exaggeration) const {
+  kl_kernel<<<n_cells, block_size>>>(p, y, n_cells, low_dim, scalars,
+                                     exaggeration, row_sums);
+  check(cudaGetLastError(), "kl_kernel");
+  return reduce(row_sums, n_cells);
+}
+
+double
+ExactGpu::gradient_norm() const {
+  return sqrt(reduce(grads, n_cells*low_dim, true));
+}
+
+void
+ExactGpu::get_gradients(Matrix &m) const {
+  to_host(m.data.data(), grads, n_cells*low_dim);
+}
+
+void
+ExactGpu::step_momentum(const double learning_rate, const double momentum) {
+  const size_t n = n_cells*low_dim;
+  momentum_kernel<<<entry_blocks(n), block_size>>>(y, grads, velocity, gains,
+                                                   n, learning_rate,
+                                                   momentum);
+  check(cudaGetLastError(), "momentum_kernel");
+  center_kernel<<<low_dim, block_size>>>(y, n_cells, low_dim);
+  check(cudaGetLastError(), "center_kernel");
+}
+
+size_t
+ExactGpu::memory_bytes() const {
+  return (n_cells*n_cells + 4*n_cells*low_dim + n_cells + 2)*sizeof(double);
+}
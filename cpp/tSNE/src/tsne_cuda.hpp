@@ -0,0 +1,90 @@
+/* tsne_cuda: the O(N^2) loops of the exact mode of tsne on a GPU
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+// Built with TSNE_WITH_CUDA (make CUDA=1). p, y and the state of the
+// momentum optimizer stay on the device for the whole run, and each
+// iteration only brings back a few scalars: y goes back to the host for
+// checkpoints and at the end. q is never stored, as each of its entries
+// is recomputed from y where it is needed. This header does not need the
+// CUDA headers, so tsne.cpp is still compiled by the host compiler.
+
+#ifndef TSNE_CUDA_HPP
+#define TSNE_CUDA_HPP
+
+#include <cstddef>
+
+#include "matrix.hpp"
+
+class ExactGpu {
+public:
+  // the gradient keeps this many coordinates of a row in registers
+  static const size_t max_dim = 16;
+
+  // Copies the cells to the device, for the distances and nothing else
+  ExactGpu(const MatrixView &cells, const size_t low_dim);
+  ~ExactGpu();
+
+  // Average number of neighbors of the cells at this sigma, as
+  // get_average_nn of cond_prob(p, cells, sigma, false). Only valid
+  // before cond_prob
+  double average_nn(const double sigma);
+  // Symmetric p of the cells at this sigma, in place of the distances
+  void cond_prob(const double sigma);
+  void scale_p(const double factor);
+
+  void set_y(const Matrix &y);
+  void get_y(Matrix &y) const;
+  void set_momentum(const Matrix &velocity, const Matrix &gains);
+  void get_momentum(Matrix &velocity, Matrix &gains) const;
+
+  // Gradients of equation 5 at the current y, and the sum of q
+  void gradient();
+  // After gradient, as the other functions on the host
+  double kl(const double exaggeration) const;
+  double gradient_norm() const;
+  void get_gradients(Matrix &grads) const;
+  // next_y_momentum on the device, with the last gradients
+  void step_momentum(const double learning_rate, const double momentum);
+
+  // bytes held on the device
+  size_t memory_bytes() const;
+
+private:
+  size_t n_cells;
+  size_t low_dim;
+  // n_cells x n_cells: squared distances of the cells, then p
+  double *p;
+  double *y;
+  double *grads;
+  double *velocity;
+  double *gains;
+  // one entry per cell, for the sums over rows
+  double *row_sums;
+  // [0] is the sum of q of the last gradient, [1] the last reduction
+  double *scalars;
+
+  // sum of the n entries of x (or of their squares) on the device
+  double reduce(const double *x, const size_t n,
+                const bool squares = false) const;
+
+  ExactGpu(const ExactGpu &);
+  ExactGpu &operator=(const ExactGpu &);
+};
+
+#endif
@@ -0,0 +1,159 @@
+/* vptree: vantage-point tree for the nearest neighbors of tSNE input
+ *
+ * Copyright (C) 2019 Guilherme De Sena Brandine
+ *                    Andrew D. Smith
+ *
+ * Authors: Guilherme De Sena Brandine
+ *          Andrew D. Smith
+ *
+ * This program is free software: you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation, either version 3 of the
+ * License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ */
+
+#ifndef VPTREE_HPP
+#define VPTREE_HPP
+
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <limits>
+#include <random>
+#include <cmath>
+#include <utility>
+
+// Vantage-point tree (Yianilos, 1993) over the rows of a row-major
+// matrix, with Euclidean distance. Each node splits the points below it
+// into those closer to its vantage point than the median distance and
+// those farther, so a k nearest neighbor query only visits the subtrees
+// that can hold a point closer than the k-th best so far.
+class VPTree {
+public:
+  // x has n rows of dim entries each
+  VPTree(const double *x, const size_t n, const size_t dim) :
+    points(x), dim(dim) {
+    index.resize(n);
+    for (size_t i = 0; i < index.size(); ++i)
+      index[i] = i;
+    // fixed seed so the tree, and ties between neighbors, are reproducible
+    std::mt19937 gen(0);
+    nodes.reserve(n);
+    build(0, index.size(), gen);
+  }
+
+  // Puts in neighbors the k nearest rows to row i, other than i, closest
+  // first, and their squared distances to row i in sq_dists
+  void search(const size_t i, const size_t k,
+              std::vector<size_t> &neighbors,
+              std::vector<double> &sq_dists) const {
+    std::priority_queue<std::pair<double, size_t> > heap;
+    double tau = std::numeric_limits<double>::max();
+    if (!nodes.empty())
+      search(0, i, k + 1, heap, tau);
+
+    neighbors.clear();
+    sq_dists.clear();
+    for (; !heap.empty(); heap.pop())
+      if (heap.top().second != i) {
+        neighbors.push_back(heap.top().second);
+        sq_dists.push_back(heap.top().first*heap.top().first);
+      }
+    // i itself is not always in the heap when there are duplicates of i
+    if (neighbors.size() > k) {
+      neighbors.erase(neighbors.begin());
+      sq_dists.erase(sq_dists.begin());
+    }
+    std::reverse(neighbors.begin(), neighbors.end());
+    std::reverse(sq_dists.begin(), sq_dists.end());
+  }
+
+private:
+  struct Node {
+    size_t point;
+    double threshold;
+    // 0 means no child, as the root is never a child
+    size_t inside, outside;
+  };
+
+  double dist(const size_t a, const size_t b) const {
+    const double *pa = points + a*dim, *pb = points + b*dim;
+    double ans = 0.0;
+    for (size_t k = 0; k < dim; ++k) {
+      const double d = pa[k] - pb[k];
+      ans += d*d;
+    }
+    return std::sqrt(ans);
+  }
+
+  // builds the subtree of index[lo, hi) and returns its node
+  size_t build(const size_t lo, const size_t hi, std::mt19937 &gen) {
+    const size_t node = nodes.size();
+    nodes.push_back(Node());
+    nodes[node].inside = nodes[node].outside = 0;
+    nodes[node].threshold = 0.0;
+
+    std::uniform_int_distribution<size_t> pick(lo, hi - 1);
+    std::swap(index[lo], index[pick(gen)]);
+    const size_t vp = index[lo];
+    nodes[node].point = vp;
+    if (hi - lo == 1)
+      return node;
+
+    // median split of the others by distance to the vantage point
+    const size_t mid = (lo + 1 + hi)/2;
+    std::nth_element(index.begin() + lo + 1, index.begin() + mid,
+                     index.begin() + hi, [&](size_t a, size_t b) {
+                       return dist(vp, a) < dist(vp, b);
+                     });
+    nodes[node].threshold = dist(vp, index[mid]);
+    if (mid > lo + 1) {
+      const size_t in = build(lo + 1, mid, gen);
+      nodes[node].inside = in;
+    }
+    const size_t out = build(mid, hi, gen);
+    nodes[node].outside = out;
+    return node;
+  }
+
+  void search(const size_t node, const size_t target, const size_t k,
+              std::priority_queue<std::pair<double, size_t> > &heap,
+              double &tau) const {
+    const Node &n = nodes[node];
+    const double d = dist(n.point, target);
+    if (d < tau) {
+      heap.push(std::make_pair(d, n.point));
+      if (heap.size() > k)
+        heap.pop();
+      if (heap.size() == k)
+        tau = heap.top().first;
+    }
+
+    // the side of the target first, then the other one if it can still
+    // hold a point within tau
+    if (d < n.threshold) {
+      if (n.inside && d - tau <= n.threshold)
+        search(n.inside, target, k, heap, tau);
+      if (n.outside && d + tau >= n.threshold)
+        search(n.outside, target, k, heap, tau);
+    }
+    else {
+      if (n.outside && d + tau >= n.threshold)
+        search(n.outside, target, k, heap, tau);
+      if (n.inside && d - tau <= n.threshold)
+        search(n.inside, target, k, heap, tau);
+    }
+  }
+
+  const double *points;
+  size_t dim;
+  std::vector<size_t> index;
+  std::vector<Node> nodes;
+};
+
+#endif
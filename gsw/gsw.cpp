@@ -1,8 +1,20 @@
 #include <iostream>
-#include <fstream>
 #include <vector>
 #include <algorithm>
 #include <string>
+#include <sstream>
+#include <fstream>
+#include <cstdlib>
+#include <limits>
+#include <deque>
+#include <mutex>
+#include <unistd.h>
+#include <zlib.h>
+#include "../cpp/gsw/kseq.h"
+#include "../cpp/common/packed_sequences.hpp"
+#include "../cpp/common/thread_pool.hpp"
+KSEQ_INIT(gzFile, gzread)
+
 using std::string;
 using std::cin;
 using std::cout;
@@ -10,11 +22,9 @@ using std::cerr;
 using std::endl;
 using std::max;
 using std::vector;
-using std::istream;
-using std::ifstream;
 using std::ostream;
-using std::getline;
 using std::runtime_error;
+using std::ostringstream;
 
 struct Sequence {
   string name;
@@ -29,26 +39,60 @@ struct Sequence {
   }
 };
 
-istream & operator
->> (istream &lhs, Sequence &s) {
-  string line;
-  if (lhs.peek() != '>')
-    throw runtime_error("malformatted fasta file");
+// Buffered FASTA/FASTQ reader on top of kseq.h, reading plain or gzipped
+// files (or stdin for "-"). Records are read one at a time or in batches
+// of bounded size, so a query file never has to fit in memory.
+class SequenceReader {
+public:
+  explicit SequenceReader(const string &filename) {
+    fp = (filename == "-") ? gzdopen(fileno(stdin), "r")
+                           : gzopen(filename.c_str(), "r");
+    if (fp == 0)
+      throw runtime_error("could not open file: " + filename);
+    ks = kseq_init(fp);
+  }
 
-  while(getline(lhs, s.name) &&
-        s.name.size() > 0 &&
-        s.name[0] != '>');
+  ~SequenceReader() {
+    kseq_destroy(ks);
+    gzclose(fp);
+  }
 
-  // remove >
-  s.name.erase(s.name.begin());
+  // reads the next record into s, false at the end of the file
+  bool read(Sequence &s) {
+    const int r = kseq_read(ks);
+    if (r == -1)
+      return false;
+    if (r < 0)
+      throw runtime_error("malformatted fastq file: truncated quality "
+                          "string in " + string(ks->name.s));
+    s.name.assign(ks->name.s, ks->name.l);
+    if (ks->comment.l > 0)
+      s.name.append(" ").append(ks->comment.s, ks->comment.l);
+    s.seq.assign(ks->seq.s, ks->seq.l);
+    return true;
+  }
 
-  // read sequence
-  s.seq.clear();
-  while (lhs.peek() != '>' && getline(lhs, line))
-    s.seq.append(line);
+  // replaces the contents of v with up to max_records records, reusing the
+  // strings already in v. Returns the number of records read.
+  size_t read_batch(vector<Sequence> &v, const size_t max_records) {
+    size_t n = 0;
+    for (; n < max_records; ++n) {
+      if (n == v.size())
+        v.push_back(Sequence());
+      if (!read(v[n]))
+        break;
+    }
+    v.resize(n);
+    return n;
+  }
 
-  return lhs;
-}
+private:
+  gzFile fp;
+  kseq_t *ks;
+
+  SequenceReader(const SequenceReader &);
+  SequenceReader &operator=(const SequenceReader &);
+};
 
 namespace alignment {
   static const int sa = 1; //match
@@ -63,6 +107,49 @@ s(char a, char b) {
          (alignment::sb * (a != b));
 }
 
+// A target and its bases, packed into the store of all targets (see
+// ../cpp/common/packed_sequences.hpp)
+struct Target {
+  string name;
+  PackedSequence seq;
+
+  Target() {}
+  Target(const Sequence &s, PackedSequences &store) :
+    name(s.name), seq(store.add(s.seq)) {}
+};
+
+// Query encoded once into the scores of each nt4 letter of the target
+// against every query position, so each DP cell costs one table lookup.
+// Built once per query and reused for all targets, as ksw_align does with
+// its kswq_t profile.
+class QueryProfile {
+public:
+  QueryProfile() : len(0) {}
+
+  void init(const string &query) {
+    len = query.size();
+    codes.resize(len);
+    for (size_t j = 0; j < len; ++j)
+      codes[j] = nt4_table[(unsigned char)query[j]];
+    scores.resize(nt4_size * len);
+    for (size_t a = 0; a < nt4_size; ++a)
+      for (size_t j = 0; j < len; ++j)
+        scores[a * len + j] = s(a, codes[j]);
+  }
+
+  size_t size() const {return len;}
+  bool empty() const {return len == 0;}
+  unsigned char code(const size_t j) const {return codes[j];}
+
+  // scores of target letter a against query positions 0, ..., size() - 1
+  const int *row(const unsigned char a) const {return scores.data() + a * len;}
+
+private:
+  size_t len;
+  vector<unsigned char> codes;
+  vector<int> scores;
+};
+
 template <typename N>
 void
 get_alignment_positions(const N &H,
@@ -70,10 +157,11 @@ get_alignment_positions(const N &H,
                         size_t &target_end,
                         size_t &qs,
                         size_t &query_end,
-                        const string &target,
-                        const string &query,
+                        const PackedSequence &target,
+                        const QueryProfile &query,
                         int    &max_score) {
   max_score = 0;
+  target_end = query_end = 0;
   size_t i,j;
 
   // find largest score
@@ -88,7 +176,7 @@ get_alignment_positions(const N &H,
   ts = target_end;
   qs = query_end;
   while (H[ts][qs] != 0) {
-    if (H[ts][qs] == H[ts-1][qs-1] + s(target[ts-1], query[qs-1])) {
+    if (H[ts][qs] == H[ts-1][qs-1] + query.row(target.code(ts-1))[qs-1]) {
       ts--;
       qs--;
     } else if (H[ts][qs] == H[ts-1][qs] - alignment::sg) {
@@ -111,86 +199,739 @@ smith_waterman (const S &target,
   size_t i,j;
   // first row
   for (i = 1; i != target.size() + 1; ++i) {
+    const int *sc = query.row(target.code(i-1));
     for (j = 1; j != query.size() + 1; ++j) {
       H[i][j] = 0;
-      H[i][j] = max(H[i][j], H[i-1][j-1] + s(target[i-1], query[j-1]));
+      H[i][j] = max(H[i][j], H[i-1][j-1] + sc[j-1]);
       H[i][j] = max(H[i][j], H[i-1][j] - alignment::sg);
       H[i][j] = max(H[i][j], H[i][j-1] - alignment::sg);
     }
   }
 }
 
-void
-read_fasta(istream &is, vector<Sequence> &v) {
-  Sequence s;
-  while (is >> s)
-    v.push_back(s);
-  v.push_back(s);
+// Linear-memory version of smith_waterman followed by the max search in
+// get_alignment_positions. Only one row of H is kept (plus the diagonal
+// cell), so memory is O(|query|) regardless of the target size. The best
+// cell is the first maximum in row-major order, exactly as in the full
+// matrix scan
+template <typename S,
+          typename T> void
+smith_waterman_linear (const S &target,
+                       const T &query,
+                       vector<int> &row,
+                       size_t &target_end,
+                       size_t &query_end,
+                       int    &max_score) {
+  size_t i,j;
+  int diag, up, h;
+  max_score = 0;
+  target_end = query_end = 0;
+
+  // row holds H[i-1][.] on entry of each i and H[i][.] on exit
+  row.assign(query.size() + 1, 0);
+  for (i = 1; i != target.size() + 1; ++i) {
+    const int *sc = query.row(target.code(i-1));
+    diag = 0;
+    for (j = 1; j != query.size() + 1; ++j) {
+      up = row[j];
+      h = max(0, diag + sc[j-1]);
+      h = max(h, up - alignment::sg);
+      h = max(h, row[j-1] - alignment::sg);
+      diag = up;
+      row[j] = h;
+      if (h > max_score) {
+        max_score = h;
+        target_end = i;
+        query_end = j;
+      }
+    }
+  }
 }
 
-int
-main(int argc, char **argv) {
-  if (argc != 3) {
-    cerr << "run: gsw <target.fa> <query.fa>" << endl;
-    return EXIT_SUCCESS;
+// Diagonal band of the DP matrix: cell (i, j) of H is inside the band if
+// |i - j - center| <= width. The default band covers the whole matrix.
+struct Band {
+  long center;
+  long width;
+
+  Band() : center(0), width(std::numeric_limits<long>::max() / 4) {}
+  Band(const long c, const long w) : center(c), width(w) {}
+
+  // first and last query columns of row i inside the band, clipped to
+  // [1, qlen]; lo > hi if the row does not meet the band
+  void columns(const long i, const long qlen, long &lo, long &hi) const {
+    lo = max(1L, i - center - width);
+    hi = std::min(qlen, i - center + width);
   }
-  vector <Sequence> targets, queries;
-  ifstream target_file(argv[1]),
-           query_file(argv[2]);
-  read_fasta(target_file, targets);
-  target_file.close();
+};
+
+// Banded version of smith_waterman_linear with an optional Z-drop cutoff,
+// in the style of the w and zdrop parameters of ksw_extend2. Only cells
+// inside the band are computed (cells outside count as 0, which is where
+// a local alignment can start anyway), so the cost is O(|query| * width).
+// With zdrop > 0 the DP stops at the first row whose best cell falls more
+// than zdrop below the best score so far, after allowing for the gaps
+// needed to reach it from the best cell.
+template <typename S,
+          typename T> void
+smith_waterman_banded (const S &target,
+                       const T &query,
+                       const Band &band,
+                       const int zdrop,
+                       vector<int> &row,
+                       size_t &target_end,
+                       size_t &query_end,
+                       int    &max_score) {
+  const long tlen = target.size(), qlen = query.size();
+  long i, j, lo, hi, row_j;
+  int diag, up, left, h, row_max;
+  max_score = 0;
+  target_end = query_end = 0;
 
-  read_fasta(query_file, queries);
-  query_file.close();
+  // rows before first and after last do not meet the band
+  const long first = max(1L, band.center + 1 - band.width);
+  const long last = std::min(tlen, band.center + qlen + band.width);
+
+  // row holds H[i-1][.] on entry of each i and H[i][.] on exit. Columns to
+  // the right of the band have never been written and are still 0.
+  row.assign(qlen + 1, 0);
+  for (i = first; i <= last; ++i) {
+    band.columns(i, qlen, lo, hi);
+    const int *sc = query.row(target.code(i-1));
+    diag = row[lo-1];
+    left = 0;
+    row_max = 0;
+    row_j = lo;
+    for (j = lo; j <= hi; ++j) {
+      up = row[j];
+      h = max(0, diag + sc[j-1]);
+      h = max(h, up - alignment::sg);
+      h = max(h, left - alignment::sg);
+      diag = up;
+      row[j] = left = h;
+      if (h > row_max) {
+        row_max = h;
+        row_j = j;
+      }
+    }
+    if (row_max > max_score) {
+      max_score = row_max;
+      target_end = i;
+      query_end = row_j;
+    } else if (zdrop > 0 && max_score > 0) {
+      const long di = i - long(target_end), dj = row_j - long(query_end);
+      const long gaps = (di > dj) ? di - dj : dj - di;
+      if (max_score - row_max - gaps * alignment::sg > zdrop)
+        break;
+    }
+  }
+}
+
+// Recovers the start of the best alignment from its end cell without the
+// full matrix. The prefixes target[0, target_end) and query[0, query_end)
+// are aligned backwards, anchored at the end cell, and the first cell that
+// reaches max_score is the start. Every such cell has H == 0, so it is a
+// valid start for a traceback. The pass only visits the window of the
+// target that precedes target_end (and the band, if the forward pass was
+// banded) and stops as soon as the start is found.
+template <typename S,
+          typename T> void
+get_alignment_starts(const S &target,
+                     const T &query,
+                     const size_t target_end,
+                     const size_t query_end,
+                     const int    max_score,
+                     vector<int> &row,
+                     size_t &ts,
+                     size_t &qs,
+                     const Band &band = Band()) {
+  // cells with negative anchored score can never reach max_score, since
+  // the rest of the path would have to score above the global maximum
+  static const int dead = -1;
+  const long qe = query_end;
+  long a, b, lo, hi;
+  int diag, up, h;
+
+  ts = target_end;
+  qs = query_end;
+  if (max_score == 0)
+    return;
 
-  // alignment matrix and results
+  // row[b] is the anchored score of aligning the last a target letters
+  // with the last b query letters, both ending at the end cell. Columns
+  // to the right of the band have never been written and are still dead.
+  row.assign(query_end + 1, dead);
+  row[0] = 0;
+  for (a = 1; a <= long(target_end); ++a) {
+    // cells (target_end - a, query_end - b) inside the band
+    const long i = target_end - a;
+    lo = max(1L, qe - (i - band.center + band.width));
+    hi = std::min(qe, qe - (i - band.center - band.width));
+    if (lo > hi)
+      break;
+
+    const int *sc = query.row(target.code(target_end - a));
+    diag = row[lo-1];
+    row[lo-1] = dead;
+
+    for (b = lo; b <= hi; ++b) {
+      up = row[b];
+      h = dead;
+      if (diag != dead)
+        h = max(h, diag + sc[query_end - b]);
+      if (up != dead)
+        h = max(h, up - alignment::sg);
+      if (row[b-1] != dead)
+        h = max(h, row[b-1] - alignment::sg);
+      diag = up;
+      row[b] = (h < 0) ? dead : h;
+      if (row[b] == max_score) {
+        ts = target_end - a;
+        qs = query_end - b;
+        return;
+      }
+    }
+  }
+}
+
+#include "striped.hpp"
+#include "kmer_index.hpp"
+#ifdef GSW_WITH_KSW
+#include "../cpp/gsw/ksw.h"
+#endif
+
+// how each pair is aligned
+struct AlignmentOptions {
+  bool linear;
+  bool simd;
+  SimdIsa isa;
+  long band;  // band width, negative for no band
+  int zdrop;  // Z-drop cutoff, 0 for none
+  bool batch; // one query per SIMD lane with ksw_batch
+
+  AlignmentOptions() : linear(false), simd(false), isa(ISA_SCALAR),
+                       band(-1), zdrop(0), batch(false) {}
+
+  bool banded() const {return band >= 0 || zdrop > 0;}
+};
+
+// diagonals added on each side of the seed hits of a candidate pair when no
+// band width is given
+static const long default_seed_band = 16;
+static const size_t default_kmer_size = 15;
+
+// diagonals added on each side of the seed hits of a candidate pair, which
+// is also the largest gap between two seed diagonals of one candidate
+static long
+seed_band(const AlignmentOptions &opt) {
+  return (opt.band >= 0) ? opt.band : default_seed_band;
+}
+
+// Scratch space of one worker, reused across all the pairs it aligns. The
+// profiles of the last query seen are kept until the query changes.
+struct AlignmentWorkspace {
   vector<vector<int>> H;
-  size_t target_start, target_end, query_start, query_end;
+  vector<int> row;
+  QueryProfile qprofile;
+  StripedProfile profile;
+  const Sequence *profile_query;
+
+  AlignmentWorkspace() : profile_query(0) {}
+};
+
+// TSV line of one alignment
+static void
+append_alignment(const Target &target,
+                 const size_t target_start, const size_t target_end,
+                 const Sequence &query,
+                 const size_t query_start, const size_t query_end,
+                 const int max_score, string &out) {
+  ostringstream line;
+  line << target.name << "\t" <<
+          target_start << "\t" <<
+          target_end << "\t" <<
+          query.name << "\t" <<
+          query_start << "\t" <<
+          query_end << "\t" <<
+          max_score << "\n";
+  out += line.str();
+}
+
+// best alignment of a pair, as reported in its TSV line
+struct Alignment {
+  size_t target_start;
+  size_t target_end;
+  size_t query_start;
+  size_t query_end;
   int max_score;
 
-  for (size_t j = 0; j < queries.size(); ++j) {
+  // higher score, or the same score and an earlier end in row-major order,
+  // which is the cell the full matrix scan keeps
+  bool better_than(const Alignment &a) const {
+    if (max_score != a.max_score)
+      return max_score > a.max_score;
+    if (target_end != a.target_end)
+      return target_end < a.target_end;
+    return query_end < a.query_end;
+  }
+};
+
+// Aligns one pair. A candidate from the k-mer prefilter restricts the DP
+// to the band around its seed diagonals.
+static void
+align_region(const Target &target,
+             const Sequence &query,
+             const AlignmentOptions &opt,
+             AlignmentWorkspace &ws,
+             Alignment &aln,
+             const Candidate *cand = 0) {
+  size_t &target_start = aln.target_start, &target_end = aln.target_end;
+  size_t &query_start = aln.query_start, &query_end = aln.query_end;
+  int &max_score = aln.max_score;
+
+  const QueryProfile &qp = ws.qprofile;
+  if (ws.profile_query != &query) {
+    ws.qprofile.init(query.seq);
+    if (opt.simd && !opt.banded())
+      striped_init(ws.profile, qp, opt.isa);
+    ws.profile_query = &query;
+  }
+
+  if (opt.banded() || cand) {
+    Band b = (opt.band >= 0) ? Band(0, opt.band) : Band();
+    if (cand) {
+      const long pad = seed_band(opt);
+      b = Band((cand->diag_lo + cand->diag_hi) / 2,
+               (cand->diag_hi - cand->diag_lo + 1) / 2 + pad);
+    }
+    smith_waterman_banded(target.seq, qp, b, opt.zdrop, ws.row,
+                          target_end, query_end, max_score);
+    get_alignment_starts(target.seq, qp,
+                         target_end, query_end, max_score,
+                         ws.row, target_start, query_start, b);
+  } else if (opt.simd) {
+    striped_align(ws.profile, target.seq, qp, ws.row,
+                  target_end, query_end, max_score);
+    get_alignment_starts(target.seq, qp,
+                         target_end, query_end, max_score,
+                         ws.row, target_start, query_start);
+  } else if (opt.linear) {
+    smith_waterman_linear(target.seq, qp, ws.row,
+                          target_end, query_end, max_score);
+    get_alignment_starts(target.seq, qp,
+                         target_end, query_end, max_score,
+                         ws.row, target_start, query_start);
+  } else {
+    // alignment matrix, reusing the rows of the previous pair
+    vector<vector<int>> &H = ws.H;
+    H.resize(target.seq.size()+1);
+    for (size_t k = 0; k < H.size(); ++k)
+      H[k].assign(qp.size()+1, 0);
+
+    // run alignment
+    smith_waterman(target.seq, qp, H);
+
+    // get traceback
+    get_alignment_positions(H, target_start, target_end,
+                               query_start, query_end,
+                               target.seq, qp,
+                               max_score);
+  }
+}
+
+// Aligns one pair and appends its TSV line to out
+static void
+align_pair(const Target &target,
+           const Sequence &query,
+           const AlignmentOptions &opt,
+           AlignmentWorkspace &ws,
+           string &out) {
+  Alignment aln;
+  align_region(target, query, opt, ws, aln);
+  append_alignment(target, aln.target_start, aln.target_end,
+                   query, aln.query_start, aln.query_end, aln.max_score, out);
+}
+
+// Aligns the pair of the candidates [first, last), all of the same target,
+// in the band of each, and appends the TSV line of the best of them, so a
+// pair still has one line however many clusters its seeds form
+static void
+align_candidates(const Target &target,
+                 const Sequence &query,
+                 const AlignmentOptions &opt,
+                 AlignmentWorkspace &ws,
+                 const Candidate *first, const Candidate *last,
+                 string &out) {
+  Alignment best, aln;
+  align_region(target, query, opt, ws, best, first);
+  for (++first; first != last; ++first) {
+    align_region(target, query, opt, ws, aln, first);
+    if (aln.better_than(best))
+      best = aln;
+  }
+  append_alignment(target, best.target_start, best.target_end,
+                   query, best.query_start, best.query_end, best.max_score,
+                   out);
+}
+
+#ifdef GSW_WITH_KSW
+// Aligns queries [q_begin, q_end) against every target with ksw_batch, which
+// puts one query in each lane of a SIMD register, and appends their TSV
+// lines to out grouped by query. ksw finds the score and end positions and
+// the start positions come from the same reverse pass as the -l mode.
+static void
+align_batch(const vector<Target> &targets,
+            const vector<Sequence> &queries,
+            const size_t q_begin, const size_t q_end,
+            AlignmentWorkspace &ws,
+            string &out) {
+  // the scores of s(), in the layout of ksw
+  int8_t mat[nt4_size * nt4_size];
+  for (size_t a = 0; a < nt4_size; ++a)
+    for (size_t b = 0; b < nt4_size; ++b)
+      mat[a * nt4_size + b] = s(a, b);
+
+  const int n = q_end - q_begin;
+  vector<vector<uint8_t>> codes(n);
+  vector<uint8_t*> seqs(n);
+  vector<int> qlens(n);
+  for (int k = 0; k < n; ++k) {
+    const string &seq = queries[q_begin + k].seq;
+    codes[k].resize(seq.size() + 1);
+    for (size_t j = 0; j < seq.size(); ++j)
+      codes[k][j] = nt4_table[(unsigned char)seq[j]];
+    seqs[k] = codes[k].data();
+    qlens[k] = seq.size();
+  }
+
+  vector<kswr_t> r(targets.size() * n);
+  vector<uint8_t> t;
+  kswb_t *bq = 0;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    const PackedSequence &seq = targets[i].seq;
+    t.resize(seq.size() + 1);
+    for (size_t a = 0; a < seq.size(); ++a)
+      t[a] = seq.code(a);
+    ksw_batch(n, qlens.data(), seqs.data(), seq.size(), t.data(),
+              nt4_size, mat, 0, alignment::sg, 0, &bq, &r[i * n]);
+  }
+  free(bq);
+
+  for (int k = 0; k < n; ++k) {
+    const Sequence &query = queries[q_begin + k];
+    ws.qprofile.init(query.seq);
+    ws.profile_query = &query;
     for (size_t i = 0; i < targets.size(); ++i) {
-      // alignment matrix
-      H = vector<vector<int>>(
-          targets[i].seq.size()+1, vector<int>(
-          queries[j].seq.size()+1, 0)
-      );
-
-      // run alignment
-      smith_waterman(targets[i].seq,
-                     queries[j].seq,
-                     H);
-
-      // get traceback
-      get_alignment_positions(H, target_start, target_end,
-                                 query_start, query_end,
-                                 targets[i].seq,
-                                 queries[j].seq,
-                                 max_score);
-      cout << targets[i].name << "\t" <<
-              target_start << "\t" <<
-              target_end << "\t" <<
-              queries[j].name << "\t" <<
-              query_start << "\t" <<
-              query_end << "\t" <<
-              max_score << "\n";
-
-      /*
-      cout << targets[i].seq << "\n";
-      cout << queries[j].seq << "\n";
-
-      cout << " ";
-      for (size_t k = 0; k < H[0].size(); ++k)
-        cout << queries[j].seq[k] << " ";
-      cout << "\n";
-      for (size_t k = 0; k < H.size(); ++k) {
-        cout << targets[i].seq[k] << " ";
-        for (size_t l = 0; l < H[0].size(); ++l) {
-          cout << H[k][l] << " ";
+      const kswr_t &x = r[i * n + k];
+      size_t target_start, target_end, query_start, query_end;
+      int max_score = x.score;
+      if (max_score + alignment::sa >= INT16_MAX) {
+        // ksw saturates at 16 bits
+        smith_waterman_linear(targets[i].seq, ws.qprofile, ws.row,
+                              target_end, query_end, max_score);
+      } else {
+        target_end = (max_score > 0) ? x.te + 1 : 0;
+        query_end = (max_score > 0) ? x.qe + 1 : 0;
+      }
+      get_alignment_starts(targets[i].seq, ws.qprofile,
+                           target_end, query_end, max_score,
+                           ws.row, target_start, query_start);
+      append_alignment(targets[i], target_start, target_end,
+                       query, query_start, query_end, max_score, out);
+    }
+  }
+}
+#endif
+
+// Tile scheduler: the all-pairs work is split into tiles of one query
+// against a block of consecutive targets, numbered in the order of the
+// serial output. Each worker starts with every n-th tile in its own queue,
+// takes tiles from the front of it and, once it runs dry, steals from the
+// back of the other queues. Finished tiles go to a reorder buffer that
+// writes them out strictly in tile order.
+class TileScheduler {
+public:
+  TileScheduler(const size_t n_tiles, const size_t n_workers, ostream &os)
+    : queues(n_workers), results(n_tiles), done(n_tiles, false),
+      next_out(0), out(os) {
+    for (size_t t = 0; t < n_tiles; ++t)
+      queues[t % n_workers].tiles.push_back(t);
+  }
+
+  // next tile for worker w, false once all queues are empty
+  bool pop(const size_t w, size_t &tile) {
+    {
+      std::lock_guard<std::mutex> lock(queues[w].m);
+      if (!queues[w].tiles.empty()) {
+        tile = queues[w].tiles.front();
+        queues[w].tiles.pop_front();
+        return true;
+      }
+    }
+    for (size_t k = 1; k < queues.size(); ++k) {
+      Queue &victim = queues[(w + k) % queues.size()];
+      std::lock_guard<std::mutex> lock(victim.m);
+      if (!victim.tiles.empty()) {
+        tile = victim.tiles.back();
+        victim.tiles.pop_back();
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // stores the output of a tile and flushes every tile that is now ready
+  void finish(const size_t tile, string &text) {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    results[tile].swap(text);
+    done[tile] = true;
+    for (; next_out < done.size() && done[next_out]; ++next_out) {
+      out << results[next_out];
+      string().swap(results[next_out]);
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex m;
+    std::deque<size_t> tiles;
+  };
+  vector<Queue> queues;
+
+  // reorder buffer
+  std::mutex out_mutex;
+  vector<string> results;
+  vector<bool> done;
+  size_t next_out;
+  ostream &out;
+};
+
+// Splits the targets into blocks of roughly equal total length, enough of
+// them that every worker gets several tiles per query
+static void
+block_targets(const vector<Target> &targets, const size_t n_threads,
+              vector<size_t> &block_start) {
+  size_t total = 0;
+  for (size_t i = 0; i < targets.size(); ++i)
+    total += targets[i].seq.size() + 1;
+  const size_t block_size = max<size_t>(1, total / (4 * n_threads));
+
+  block_start.clear();
+  size_t cur = block_size;
+  for (size_t i = 0; i < targets.size(); ++i) {
+    if (cur >= block_size) {
+      block_start.push_back(i);
+      cur = 0;
+    }
+    cur += targets[i].seq.size() + 1;
+  }
+  block_start.push_back(targets.size());
+}
+
+// Aligns every query against every target on the threads of pool. The output
+// is identical to the serial double loop over queries and targets. With a
+// k-mer index each tile is one query, aligned only against the targets it
+// shares k-mers with, and its seed counts are stored in counts. In batch
+// mode each tile is one group of queries, aligned together against every
+// target.
+static void
+align_all(const vector<Target> &targets,
+          const vector<Sequence> &queries,
+          const AlignmentOptions &opt,
+          ThreadPool &pool,
+          const KmerIndex *index,
+          vector<SeedCounts> &counts,
+          ostream &out) {
+  vector<size_t> block_start;
+  if (index || opt.batch) {
+    block_start.push_back(0);
+    block_start.push_back(targets.size());
+  }
+  else block_targets(targets, pool.size(), block_start);
+  const size_t n_blocks = block_start.size() - 1;
+
+  // queries per tile
+  size_t group = 1;
+#ifdef GSW_WITH_KSW
+  if (opt.batch)
+    group = ksw_batch_width();
+#endif
+  const size_t n_groups = (queries.size() + group - 1) / group;
+  if (index)
+    counts.resize(queries.size());
+
+  TileScheduler sched(n_groups * n_blocks, pool.size(), out);
+  pool.run([&](const size_t w) {
+    AlignmentWorkspace ws;
+    vector<std::pair<uint32_t, long>> diags;
+    vector<Candidate> candidates;
+    string text;
+    size_t tile;
+    while (sched.pop(w, tile)) {
+      text.clear();
+#ifdef GSW_WITH_KSW
+      if (opt.batch) {
+        const size_t q_begin = tile * group;
+        align_batch(targets, queries, q_begin,
+                    std::min(queries.size(), q_begin + group), ws, text);
+        sched.finish(tile, text);
+        continue;
+      }
+#endif
+      const Sequence &query = queries[tile / n_blocks];
+      const size_t b = tile % n_blocks;
+      if (index) {
+        find_candidates(*index, query.seq, seed_band(opt), diags, candidates,
+                        counts[tile]);
+        size_t j;
+        for (size_t i = 0; i < candidates.size(); i = j) {
+          j = i + 1;
+          while (j < candidates.size() &&
+                 candidates[j].target == candidates[i].target)
+            ++j;
+          align_candidates(targets[candidates[i].target], query, opt, ws,
+                           &candidates[i], &candidates[0] + j, text);
         }
-        cout << "\n";
       }
-      */
+      else {
+        for (size_t i = block_start[b]; i < block_start[b + 1]; ++i)
+          align_pair(targets[i], query, opt, ws, text);
+      }
+      sched.finish(tile, text);
+    }
+  });
+}
+
+int
+main(int argc, char **argv) {
+  AlignmentOptions opt;
+  SimdIsa isa_cap = ISA_AVX512;
+  size_t n_threads = 1, batch_size = 100000, kmer_size = 0;
+  string index_file, counts_file;
+  int c;
+  while ((c = getopt(argc, argv, "lsi:t:b:w:z:k:x:c:q")) >= 0) {
+    switch (c) {
+      case 'l': opt.linear = true; break;
+      case 's': opt.simd = true; break;
+      case 'i':
+        opt.simd = true;
+        if (string(optarg) == "sse2") isa_cap = ISA_SSE2;
+        else if (string(optarg) == "avx2") isa_cap = ISA_AVX2;
+        else if (string(optarg) == "avx512") isa_cap = ISA_AVX512;
+        else if (string(optarg) == "scalar") isa_cap = ISA_SCALAR;
+        else {
+          cerr << "unknown instruction set: " << optarg << endl;
+          return EXIT_FAILURE;
+        }
+        break;
+      case 't': n_threads = max(1, atoi(optarg)); break;
+      case 'b': batch_size = max(1, atoi(optarg)); break;
+      case 'w': opt.band = max(0, atoi(optarg)); break;
+      case 'z': opt.zdrop = max(0, atoi(optarg)); break;
+      case 'k': kmer_size = max(1, atoi(optarg)); break;
+      case 'x': index_file = optarg; break;
+      case 'c': counts_file = optarg; break;
+      case 'q': opt.batch = true; break;
+      default: return EXIT_FAILURE;
+    }
+  }
+  if (optind + 2 != argc) {
+    cerr << "run: gsw [-l] [-s] [-i isa] [-w band] [-z zdrop] [-t threads] "
+         << "[-b batch] [-k kmer] [-x index] [-c counts] [-q] "
+         << "<target.fa> <query.fa>\n"
+         << "  inputs are FASTA or FASTQ, optionally gzipped\n"
+         << "  -l  linear memory: keep one row of the matrix and recover\n"
+         << "      the start positions with a reverse pass\n"
+         << "  -s  striped SIMD scoring (linear memory), using the widest\n"
+         << "      instruction set of the CPU\n"
+         << "  -i  widest instruction set for -s: sse2, avx2, avx512 or\n"
+         << "      scalar\n"
+         << "  -w  only compute cells within this many diagonals of the main\n"
+         << "      diagonal (linear memory, scalar)\n"
+         << "  -z  stop once the best score of a row drops this much below\n"
+         << "      the best score so far (linear memory, scalar)\n"
+         << "  -t  number of threads [1]\n"
+         << "  -b  number of queries held in memory at a time [100000]\n"
+         << "  -k  only align pairs that share a k-mer of this size, in a\n"
+         << "      band of -w diagonals [" << default_seed_band
+         << "] around the shared k-mers\n"
+         << "  -x  k-mer index file, mapped if it exists and otherwise built\n"
+         << "      with -k [" << default_kmer_size << "] and written\n"
+         << "  -c  write the seed counts of each query to this file\n"
+         << "  -q  align groups of queries together, one per SIMD lane\n"
+         << "      (ksw_batch; needs a build with GSW_WITH_KSW)"
+         << endl;
+    return EXIT_SUCCESS;
+  }
+  if (opt.simd)
+    opt.isa = detect_isa(isa_cap);
+#ifndef GSW_WITH_KSW
+  if (opt.batch) {
+    cerr << "-q needs gsw to be built with -DGSW_WITH_KSW and ksw.o" << endl;
+    return EXIT_FAILURE;
+  }
+#endif
+  if (opt.batch && (opt.banded() || kmer_size != 0 || !index_file.empty())) {
+    cerr << "-q cannot be combined with -w, -z, -k or -x" << endl;
+    return EXIT_FAILURE;
+  }
+
+  try {
+    // targets are aligned against every query, so they are all kept,
+    // packed at 2 bits per base
+    PackedSequences target_store;
+    vector<Target> targets;
+    vector<Sequence> queries;
+    SequenceReader target_file(argv[optind]);
+    Sequence t;
+    while (target_file.read(t))
+      targets.push_back(Target(t, target_store));
+
+    // optional k-mer prefilter, built once and reused through the index
+    // file if one is given
+    KmerIndex index_buf;
+    const KmerIndex *index = 0;
+    if (!index_file.empty() && access(index_file.c_str(), F_OK) == 0) {
+      index_buf.load(index_file);
+      index_buf.check(targets);
+      if (kmer_size != 0 && kmer_size != index_buf.k())
+        throw runtime_error("index " + index_file + " has k = " +
+                            std::to_string(index_buf.k()));
+      index = &index_buf;
     }
+    else if (kmer_size != 0 || !index_file.empty()) {
+      index_buf.build(targets, kmer_size ? kmer_size : default_kmer_size);
+      if (!index_file.empty())
+        index_buf.save(index_file);
+      index = &index_buf;
+    }
+
+    std::ofstream counts_out;
+    if (!counts_file.empty()) {
+      if (!index)
+        throw runtime_error("seed counts (-c) need a k-mer index (-k or -x)");
+      counts_out.open(counts_file.c_str());
+      if (!counts_out)
+        throw runtime_error("could not open file: " + counts_file);
+    }
+
+    // queries are streamed in batches of bounded size, all aligned by the
+    // same threads
+    SequenceReader query_file(argv[optind + 1]);
+    vector<SeedCounts> counts;
+    ThreadPool pool(n_threads);
+    while (query_file.read_batch(queries, batch_size) > 0) {
+      align_all(targets, queries, opt, pool, index, counts, cout);
+      if (counts_out.is_open())
+        for (size_t i = 0; i < queries.size(); ++i)
+          counts_out << queries[i].name << "\t" << counts[i].n_kmers << "\t"
+                     << counts[i].n_hits << "\t" << counts[i].n_candidates
+                     << "\n";
+    }
+  }
+  catch (std::exception &e) {
+    cerr << "ERROR:\t" << e.what() << endl;
+    return EXIT_FAILURE;
   }
+  return EXIT_SUCCESS;
 }
@@ -0,0 +1,298 @@
+// Seed-and-filter prefilter for gsw: an index of every k-mer of the targets,
+// sorted so that a query k-mer is found by binary search. Each query is
+// looked up once, and only targets that share at least one k-mer with it
+// are aligned, inside a band around the diagonals of the shared k-mers.
+//
+// The index can be written to a file and mapped back with mmap, so a large
+// target set is only indexed once. File layout (native byte order):
+//
+//   IndexHeader
+//   uint64_t keys[n_keys]         sorted distinct k-mers
+//   uint64_t offsets[n_keys + 1]  hits of keys[i] are offsets[i], ...
+//   KmerHit  hits[n_hits]         sorted by target, then position
+//
+// Expects the nt4 encoding, PackedSequence and Target to be declared before
+// inclusion.
+
+#ifndef GSW_KMER_INDEX_HPP
+#define GSW_KMER_INDEX_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const size_t max_kmer_size = 32;
+
+// k-mers with more hits than this are too repetitive to pick diagonals
+// from and are skipped, as minimap and BWA skip high-occurrence seeds
+static const uint64_t max_kmer_occurrence = 1000;
+
+struct KmerHit {
+  uint32_t target;
+  uint32_t pos;  // 0-based start of the k-mer in the target
+
+  bool operator<(const KmerHit &rhs) const {
+    return target < rhs.target || (target == rhs.target && pos < rhs.pos);
+  }
+};
+
+struct IndexHeader {
+  char magic[8];
+  uint64_t k;
+  uint64_t n_targets;
+  uint64_t n_residues;  // total target length, to catch a stale index
+  uint64_t n_keys;
+  uint64_t n_hits;
+};
+
+static const char index_magic[8] = {'G', 'S', 'W', 'K', 'I', 'D', 'X', '1'};
+
+class KmerIndex {
+public:
+  KmerIndex() : map(0), map_size(0), keys(0), offsets(0), hits(0) {
+    memset(&header, 0, sizeof(header));
+  }
+
+  ~KmerIndex() {
+    if (map)
+      munmap(map, map_size);
+  }
+
+  // builds the index of all k-mers without N in the targets
+  void build(const vector<Target> &targets, const size_t k) {
+    if (k == 0 || k > max_kmer_size)
+      throw runtime_error("k-mer size must be between 1 and " +
+                          std::to_string(max_kmer_size));
+
+    struct Entry {
+      uint64_t key;
+      KmerHit hit;
+      bool operator<(const Entry &rhs) const {
+        return key < rhs.key || (key == rhs.key && hit < rhs.hit);
+      }
+    };
+    vector<Entry> entries;
+    uint64_t n_residues = 0;
+    for (size_t t = 0; t < targets.size(); ++t) {
+      const PackedSequence &seq = targets[t].seq;
+      n_residues += seq.size();
+      uint64_t key = 0;
+      size_t run = 0;
+      for (size_t i = 0; i < seq.size(); ++i) {
+        const unsigned char c = seq.code(i);
+        if (c == nt4_n) {
+          run = 0;
+          continue;
+        }
+        key = ((key << 2) | c) & kmer_mask(k);
+        if (++run >= k) {
+          Entry e;
+          e.key = key;
+          e.hit.target = t;
+          e.hit.pos = i + 1 - k;
+          entries.push_back(e);
+        }
+      }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    own_keys.clear();
+    own_offsets.clear();
+    own_hits.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (i == 0 || entries[i].key != entries[i - 1].key) {
+        own_keys.push_back(entries[i].key);
+        own_offsets.push_back(i);
+      }
+      own_hits[i] = entries[i].hit;
+    }
+    own_offsets.push_back(entries.size());
+
+    memcpy(header.magic, index_magic, sizeof(index_magic));
+    header.k = k;
+    header.n_targets = targets.size();
+    header.n_residues = n_residues;
+    header.n_keys = own_keys.size();
+    header.n_hits = own_hits.size();
+    keys = own_keys.data();
+    offsets = own_offsets.data();
+    hits = own_hits.data();
+  }
+
+  void save(const string &filename) const {
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out)
+      throw runtime_error("could not open file: " + filename);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(keys),
+              header.n_keys * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(offsets),
+              (header.n_keys + 1) * sizeof(uint64_t));
+    out.write(reinterpret_cast<const char*>(hits),
+              header.n_hits * sizeof(KmerHit));
+    if (!out)
+      throw runtime_error("could not write index: " + filename);
+  }
+
+  // maps an index written by save; the arrays are used in place
+  void load(const string &filename) {
+    const int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+      throw runtime_error("could not open file: " + filename);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(IndexHeader)) {
+      close(fd);
+      throw runtime_error("malformatted index file: " + filename);
+    }
+    map_size = st.st_size;
+    map = mmap(0, map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      map = 0;
+      throw runtime_error("could not map index file: " + filename);
+    }
+
+    const char *p = static_cast<const char*>(map);
+    memcpy(&header, p, sizeof(header));
+    const size_t expected = sizeof(header) +
+      (2 * header.n_keys + 1) * sizeof(uint64_t) +
+      header.n_hits * sizeof(KmerHit);
+    if (memcmp(header.magic, index_magic, sizeof(index_magic)) != 0 ||
+        header.k == 0 || header.k > max_kmer_size || map_size != expected)
+      throw runtime_error("malformatted index file: " + filename);
+
+    p += sizeof(header);
+    keys = reinterpret_cast<const uint64_t*>(p);
+    p += header.n_keys * sizeof(uint64_t);
+    offsets = reinterpret_cast<const uint64_t*>(p);
+    p += (header.n_keys + 1) * sizeof(uint64_t);
+    hits = reinterpret_cast<const KmerHit*>(p);
+  }
+
+  // throws if the index was not built from these targets
+  void check(const vector<Target> &targets) const {
+    uint64_t n_residues = 0;
+    for (size_t t = 0; t < targets.size(); ++t)
+      n_residues += targets[t].seq.size();
+    if (header.n_targets != targets.size() || header.n_residues != n_residues)
+      throw runtime_error("index does not match the target file");
+  }
+
+  size_t k() const {return header.k;}
+
+  // hits of a k-mer, empty if it does not occur in the targets
+  void lookup(const uint64_t key,
+              const KmerHit *&first, const KmerHit *&last) const {
+    const uint64_t *it = std::lower_bound(keys, keys + header.n_keys, key);
+    first = last = hits;
+    if (it != keys + header.n_keys && *it == key) {
+      first = hits + offsets[it - keys];
+      last = hits + offsets[it - keys + 1];
+    }
+  }
+
+  static uint64_t kmer_mask(const size_t k) {
+    return (k == max_kmer_size) ? ~uint64_t(0) : (uint64_t(1) << (2 * k)) - 1;
+  }
+
+private:
+  IndexHeader header;
+
+  // storage of a built index, or the mapping of a loaded one
+  vector<uint64_t> own_keys;
+  vector<uint64_t> own_offsets;
+  vector<KmerHit> own_hits;
+  void *map;
+  size_t map_size;
+
+  const uint64_t *keys;
+  const uint64_t *offsets;
+  const KmerHit *hits;
+
+  KmerIndex(const KmerIndex &);
+  KmerIndex &operator=(const KmerIndex &);
+};
+
+// target that shares k-mers with a query, and the band of diagonals (in the
+// i - j convention of Band) that covers one cluster of them
+struct Candidate {
+  size_t target;
+  long diag_lo;
+  long diag_hi;
+  size_t n_hits;
+};
+
+// seed statistics of one query
+struct SeedCounts {
+  size_t n_kmers;  // k-mers of the query without N
+  size_t n_hits;   // hits of those k-mers in the targets
+  size_t n_candidates;  // targets aligned, whatever their clusters
+
+  SeedCounts() : n_kmers(0), n_hits(0), n_candidates(0) {}
+};
+
+// Looks up every k-mer of the query and collects the targets it hits, in
+// target order. The sorted diagonals of a target are split into clusters
+// wherever two of them are more than max_gap apart, and each cluster is a
+// candidate of its own, so a far seed does not widen the band of the
+// others. diags is scratch space reused across queries.
+static void
+find_candidates(const KmerIndex &index, const string &query,
+                const long max_gap,
+                vector<std::pair<uint32_t, long>> &diags,
+                vector<Candidate> &candidates, SeedCounts &counts) {
+  const size_t k = index.k();
+  const uint64_t mask = KmerIndex::kmer_mask(k);
+  diags.clear();
+  counts = SeedCounts();
+  uint64_t key = 0;
+  size_t run = 0;
+  for (size_t j = 0; j < query.size(); ++j) {
+    const unsigned char c = nt4_table[(unsigned char)query[j]];
+    if (c == nt4_n) {
+      run = 0;
+      continue;
+    }
+    key = ((key << 2) | c) & mask;
+    if (++run < k)
+      continue;
+
+    ++counts.n_kmers;
+    const KmerHit *first, *last;
+    index.lookup(key, first, last);
+    counts.n_hits += last - first;
+    if (uint64_t(last - first) > max_kmer_occurrence)
+      continue;
+    const long qpos = j + 1 - k;
+    for (; first != last; ++first)
+      diags.push_back(std::make_pair(first->target, long(first->pos) - qpos));
+  }
+
+  std::sort(diags.begin(), diags.end());
+  candidates.clear();
+  for (size_t i = 0; i < diags.size(); ++i) {
+    const bool new_target = (i == 0 || diags[i].first != diags[i - 1].first);
+    if (new_target)
+      ++counts.n_candidates;
+    if (new_target || diags[i].second - diags[i - 1].second > max_gap) {
+      Candidate c;
+      c.target = diags[i].first;
+      c.diag_lo = diags[i].second;
+      c.n_hits = 0;
+      candidates.push_back(c);
+    }
+    candidates.back().diag_hi = diags[i].second;
+    ++candidates.back().n_hits;
+  }
+}
+
+#endif
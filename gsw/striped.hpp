@@ -0,0 +1,299 @@
+// Vectorized engine for gsw: striped Smith-Waterman in the style of
+// ksw_u8/ksw_i16 (cpp/gsw/ksw.c), with SSE2, AVX2 and AVX-512BW widths
+// selected at runtime. Scores start in unsigned 8-bit lanes, fall back to
+// signed 16-bit lanes on overflow and to the scalar linear kernel if 16 bits
+// are not enough either. Results are the max_score, target_end and
+// query_end that smith_waterman_linear reports for the same pair.
+//
+// Expects alignment::sa/sb/sg, the nt4 encoding, PackedSequence,
+// QueryProfile and smith_waterman_linear to be declared before inclusion.
+
+#ifndef GSW_STRIPED_HPP
+#define GSW_STRIPED_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GSW_HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+enum SimdIsa {
+  ISA_SCALAR = 0,
+  ISA_SSE2,
+  ISA_AVX2,
+  ISA_AVX512
+};
+
+inline const char *
+isa_name(const SimdIsa isa) {
+  switch (isa) {
+    case ISA_SSE2: return "sse2";
+    case ISA_AVX2: return "avx2";
+    case ISA_AVX512: return "avx512";
+    default: return "scalar";
+  }
+}
+
+// Widest instruction set supported by both the CPU and the cap
+inline SimdIsa
+detect_isa(const SimdIsa cap = ISA_AVX512) {
+#ifdef GSW_HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (cap >= ISA_AVX512 && __builtin_cpu_supports("avx512bw"))
+    return ISA_AVX512;
+  if (cap >= ISA_AVX2 && __builtin_cpu_supports("avx2"))
+    return ISA_AVX2;
+  if (cap >= ISA_SSE2 && __builtin_cpu_supports("sse2"))
+    return ISA_SSE2;
+#endif
+  return ISA_SCALAR;
+}
+
+// Striped layout of a QueryProfile, one row per nt4 letter of the target,
+// built once per query and reused for every target
+struct StripedProfile {
+  // buffer of one lane width; the vectors start at an aligned offset so
+  // that copies of the profile stay valid
+  struct Layout {
+    std::vector<unsigned char> buf;
+    size_t offset, slen;
+    Layout() : offset(0), slen(0) {}
+    unsigned char *base() { return buf.empty() ? 0 : buf.data() + offset; }
+  };
+
+  const QueryProfile *query;
+  SimdIsa isa;
+  int shift; // bias that keeps 8-bit scores unsigned
+  Layout u8, i16;
+
+  StripedProfile() : query(0), isa(ISA_SCALAR), shift(alignment::sb) {}
+};
+
+#ifdef GSW_HAVE_X86_SIMD
+
+///////////////////////////////////////////////////////////
+// SSE2: 16 x u8 or 8 x i16
+///////////////////////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("sse2")
+namespace striped_sse2 {
+  typedef __m128i vec;
+  static const size_t vec_bytes = 16;
+
+  static inline vec v_zero() { return _mm_setzero_si128(); }
+  static inline vec v_set1_u8(int x) { return _mm_set1_epi8((char)x); }
+  static inline vec v_set1_i16(int x) { return _mm_set1_epi16((short)x); }
+  static inline vec v_load(const vec *p) { return _mm_load_si128(p); }
+  static inline void v_store(vec *p, vec a) { _mm_store_si128(p, a); }
+
+  static inline vec v_adds_u8(vec a, vec b) { return _mm_adds_epu8(a, b); }
+  static inline vec v_subs_u8(vec a, vec b) { return _mm_subs_epu8(a, b); }
+  static inline vec v_max_u8(vec a, vec b) { return _mm_max_epu8(a, b); }
+  static inline vec v_shl_u8(vec a) { return _mm_slli_si128(a, 1); }
+  static inline bool v_any_gt_u8(vec a, vec b) {
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_subs_epu8(a, b),
+                                            _mm_setzero_si128())) != 0xffff;
+  }
+  static inline int v_hmax_u8(vec a) {
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 8));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 4));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 2));
+    a = _mm_max_epu8(a, _mm_srli_si128(a, 1));
+    return _mm_extract_epi16(a, 0) & 0x00ff;
+  }
+
+  static inline vec v_adds_i16(vec a, vec b) { return _mm_adds_epi16(a, b); }
+  static inline vec v_subs_u16(vec a, vec b) { return _mm_subs_epu16(a, b); }
+  static inline vec v_max_i16(vec a, vec b) { return _mm_max_epi16(a, b); }
+  static inline vec v_shl_i16(vec a) { return _mm_slli_si128(a, 2); }
+  static inline bool v_any_gt_i16(vec a, vec b) {
+    return _mm_movemask_epi8(_mm_cmpgt_epi16(a, b)) != 0;
+  }
+  static inline int v_hmax_i16(vec a) {
+    a = _mm_max_epi16(a, _mm_srli_si128(a, 8));
+    a = _mm_max_epi16(a, _mm_srli_si128(a, 4));
+    a = _mm_max_epi16(a, _mm_srli_si128(a, 2));
+    return (int16_t)_mm_extract_epi16(a, 0);
+  }
+
+#include "striped_kernel.hpp"
+}
+#pragma GCC pop_options
+
+///////////////////////////////////////////////////////////
+// AVX2: 32 x u8 or 16 x i16
+///////////////////////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("avx2")
+namespace striped_avx2 {
+  typedef __m256i vec;
+  static const size_t vec_bytes = 32;
+
+  static inline vec v_zero() { return _mm256_setzero_si256(); }
+  static inline vec v_set1_u8(int x) { return _mm256_set1_epi8((char)x); }
+  static inline vec v_set1_i16(int x) { return _mm256_set1_epi16((short)x); }
+  static inline vec v_load(const vec *p) { return _mm256_load_si256(p); }
+  static inline void v_store(vec *p, vec a) { _mm256_store_si256(p, a); }
+
+  // shift up by n bytes across the two 128-bit lanes
+  template <int n> static inline vec v_shl(vec a) {
+    return _mm256_alignr_epi8(a, _mm256_permute2x128_si256(a, a, 0x08),
+                              16 - n);
+  }
+  static inline int v_hmax(vec a, const bool bytes) {
+    alignas(32) int16_t t16[16];
+    _mm256_store_si256(reinterpret_cast<vec*>(t16), a);
+    const unsigned char *t8 = reinterpret_cast<const unsigned char*>(t16);
+    int m = 0;
+    for (size_t i = 0; i < (bytes ? 32u : 16u); ++i)
+      m = std::max(m, bytes ? (int)t8[i] : (int)t16[i]);
+    return m;
+  }
+
+  static inline vec v_adds_u8(vec a, vec b) { return _mm256_adds_epu8(a, b); }
+  static inline vec v_subs_u8(vec a, vec b) { return _mm256_subs_epu8(a, b); }
+  static inline vec v_max_u8(vec a, vec b) { return _mm256_max_epu8(a, b); }
+  static inline vec v_shl_u8(vec a) { return v_shl<1>(a); }
+  static inline bool v_any_gt_u8(vec a, vec b) {
+    return _mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_subs_epu8(a, b),
+                                                  _mm256_setzero_si256())) != -1;
+  }
+  static inline int v_hmax_u8(vec a) { return v_hmax(a, true); }
+
+  static inline vec v_adds_i16(vec a, vec b) { return _mm256_adds_epi16(a, b); }
+  static inline vec v_subs_u16(vec a, vec b) { return _mm256_subs_epu16(a, b); }
+  static inline vec v_max_i16(vec a, vec b) { return _mm256_max_epi16(a, b); }
+  static inline vec v_shl_i16(vec a) { return v_shl<2>(a); }
+  static inline bool v_any_gt_i16(vec a, vec b) {
+    return _mm256_movemask_epi8(_mm256_cmpgt_epi16(a, b)) != 0;
+  }
+  static inline int v_hmax_i16(vec a) { return v_hmax(a, false); }
+
+#include "striped_kernel.hpp"
+}
+#pragma GCC pop_options
+
+///////////////////////////////////////////////////////////
+// AVX-512BW: 64 x u8 or 32 x i16
+///////////////////////////////////////////////////////////
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+namespace striped_avx512 {
+  typedef __m512i vec;
+  static const size_t vec_bytes = 64;
+
+  static inline vec v_zero() { return _mm512_setzero_si512(); }
+  static inline vec v_set1_u8(int x) { return _mm512_set1_epi8((char)x); }
+  static inline vec v_set1_i16(int x) { return _mm512_set1_epi16((short)x); }
+  static inline vec v_load(const vec *p) { return _mm512_load_si512(p); }
+  static inline void v_store(vec *p, vec a) { _mm512_store_si512(p, a); }
+
+  // shift up by n bytes across the four 128-bit lanes
+  template <int n> static inline vec v_shl(vec a) {
+    const vec t = _mm512_maskz_alignr_epi64(0xff, a, _mm512_setzero_si512(), 6);
+    return _mm512_alignr_epi8(a, t, 16 - n);
+  }
+  static inline int v_hmax(vec a, const bool bytes) {
+    alignas(64) int16_t t16[32];
+    _mm512_store_si512(reinterpret_cast<vec*>(t16), a);
+    const unsigned char *t8 = reinterpret_cast<const unsigned char*>(t16);
+    int m = 0;
+    for (size_t i = 0; i < (bytes ? 64u : 32u); ++i)
+      m = std::max(m, bytes ? (int)t8[i] : (int)t16[i]);
+    return m;
+  }
+
+  static inline vec v_adds_u8(vec a, vec b) { return _mm512_adds_epu8(a, b); }
+  static inline vec v_subs_u8(vec a, vec b) { return _mm512_subs_epu8(a, b); }
+  static inline vec v_max_u8(vec a, vec b) { return _mm512_max_epu8(a, b); }
+  static inline vec v_shl_u8(vec a) { return v_shl<1>(a); }
+  static inline bool v_any_gt_u8(vec a, vec b) {
+    return _mm512_cmpgt_epu8_mask(a, b) != 0;
+  }
+  static inline int v_hmax_u8(vec a) { return v_hmax(a, true); }
+
+  static inline vec v_adds_i16(vec a, vec b) { return _mm512_adds_epi16(a, b); }
+  static inline vec v_subs_u16(vec a, vec b) { return _mm512_subs_epu16(a, b); }
+  static inline vec v_max_i16(vec a, vec b) { return _mm512_max_epi16(a, b); }
+  static inline vec v_shl_i16(vec a) { return v_shl<2>(a); }
+  static inline bool v_any_gt_i16(vec a, vec b) {
+    return _mm512_cmpgt_epi16_mask(a, b) != 0;
+  }
+  static inline int v_hmax_i16(vec a) { return v_hmax(a, false); }
+
+#include "striped_kernel.hpp"
+}
+#pragma GCC pop_options
+
+#endif // GSW_HAVE_X86_SIMD
+
+// Builds the 8-bit profile of a query for the given instruction set. The
+// 16-bit profile is only built the first time a target overflows 8 bits.
+inline void
+striped_init(StripedProfile &p, const QueryProfile &query, const SimdIsa isa) {
+  p.query = &query;
+  p.isa = isa;
+  p.shift = alignment::sb;
+  p.u8 = p.i16 = StripedProfile::Layout();
+
+#ifdef GSW_HAVE_X86_SIMD
+  switch (isa) {
+    case ISA_SSE2: striped_sse2::build_profile(p, 1); break;
+    case ISA_AVX2: striped_avx2::build_profile(p, 1); break;
+    case ISA_AVX512: striped_avx512::build_profile(p, 1); break;
+    default: break;
+  }
+#endif
+}
+
+// Aligns a target against the query of the profile. Tries 8-bit lanes,
+// then 16-bit lanes, then the scalar kernel, stopping at the first width
+// that does not saturate.
+inline void
+striped_align(StripedProfile &p, const PackedSequence &target,
+              const QueryProfile &query, std::vector<int> &row,
+              size_t &target_end, size_t &query_end, int &max_score) {
+  if (query.empty() || target.empty()) {
+    target_end = query_end = 0;
+    max_score = 0;
+    return;
+  }
+#ifdef GSW_HAVE_X86_SIMD
+  typedef bool (*kernel)(StripedProfile&, const PackedSequence&,
+                         size_t&, size_t&, int&);
+  kernel u8 = 0, i16 = 0;
+  void (*build)(StripedProfile&, const size_t) = 0;
+  switch (p.isa) {
+    case ISA_SSE2:
+      u8 = striped_sse2::align_u8; i16 = striped_sse2::align_i16;
+      build = striped_sse2::build_profile;
+      break;
+    case ISA_AVX2:
+      u8 = striped_avx2::align_u8; i16 = striped_avx2::align_i16;
+      build = striped_avx2::build_profile;
+      break;
+    case ISA_AVX512:
+      u8 = striped_avx512::align_u8; i16 = striped_avx512::align_i16;
+      build = striped_avx512::build_profile;
+      break;
+    default: break;
+  }
+  if (u8) {
+    if (u8(p, target, target_end, query_end, max_score))
+      return;
+    if (p.i16.base() == 0)
+      build(p, 2);
+    if (i16(p, target, target_end, query_end, max_score))
+      return;
+  }
+#endif
+  smith_waterman_linear(target, query, row,
+                        target_end, query_end, max_score);
+}
+
+#endif
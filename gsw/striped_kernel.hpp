@@ -0,0 +1,202 @@
+// Striped (Farrar) Smith-Waterman kernel, written once against a small set
+// of vector primitives. This file is included by striped.hpp inside one
+// namespace per instruction set, after the primitives for that instruction
+// set have been defined:
+//
+//   vec                       register type, vec_bytes bytes wide
+//   v_zero, v_set1_u8, v_set1_i16, v_load, v_store
+//   v_adds_u8, v_subs_u8, v_max_u8, v_any_gt_u8, v_shl_u8, v_hmax_u8
+//   v_adds_i16, v_subs_u16, v_max_i16, v_any_gt_i16, v_shl_i16, v_hmax_i16
+//
+// Cells are computed as in ksw_u8/ksw_i16 in cpp/gsw/ksw.c:
+//   H(i,j)   = max{H(i-1,j-1)+S(i,j), E(i,j), F(i,j), 0}
+//   E(i+1,j) = max{H(i,j), E(i,j)} - sg
+//   F(i,j+1) = max{H(i,j), F(i,j)} - sg
+
+static const size_t lanes_u8 = vec_bytes;
+static const size_t lanes_i16 = vec_bytes / 2;
+
+// Fills p with the striped profile of the query for elements of elem_size
+// bytes. Row a of the profile holds the scores of nt4 letter a of the
+// target against every query position, in striped order.
+static void
+build_profile(StripedProfile &p, const size_t elem_size) {
+  const size_t lanes = vec_bytes / elem_size;
+  const size_t qlen = p.query->size();
+  const size_t slen = (qlen + lanes - 1) / lanes;
+  const size_t n_rows = nt4_size;
+
+  StripedProfile::Layout &l = (elem_size == 1) ? p.u8 : p.i16;
+  l.slen = slen;
+  // profile rows plus H0, H1, E and Hmax, and room to align the start
+  l.buf.assign(vec_bytes * slen * (n_rows + 4) + vec_bytes, 0);
+  const size_t off = reinterpret_cast<size_t>(l.buf.data()) % vec_bytes;
+  l.offset = off ? vec_bytes - off : 0;
+
+  for (size_t a = 0; a < n_rows; ++a) {
+    const int *sc = p.query->row(a);
+    unsigned char *t8 = l.base() + a * slen * vec_bytes;
+    int16_t *t16 = reinterpret_cast<int16_t*>(t8);
+    for (size_t j = 0; j < slen; ++j) {
+      for (size_t k = j; k < slen * lanes; k += slen) {
+        // padding past the end of the query scores as a mismatch
+        const int x = (k < qlen) ? sc[k] : -alignment::sb;
+        if (elem_size == 1) *t8++ = static_cast<unsigned char>(x + p.shift);
+        else *t16++ = static_cast<int16_t>(x);
+      }
+    }
+  }
+}
+
+// 16 lanes per 128 bits, saturates at 255 - shift
+static bool
+align_u8(StripedProfile &p, const PackedSequence &target,
+         size_t &target_end, size_t &query_end, int &max_score) {
+  StripedProfile::Layout &l = p.u8;
+  const size_t slen = l.slen;
+  vec *qp = reinterpret_cast<vec*>(l.base());
+  vec *H0 = qp + slen * nt4_size, *H1 = H0 + slen,
+      *E = H1 + slen, *Hmax = E + slen, *tmp;
+  const vec zero = v_zero(), gap = v_set1_u8(alignment::sg),
+            shift = v_set1_u8(p.shift);
+  int gmax = 0, imax;
+  size_t te = 0, i, j, k;
+
+  for (j = 0; j < slen; ++j) {
+    v_store(E + j, zero);
+    v_store(H0 + j, zero);
+    v_store(Hmax + j, zero);
+  }
+  for (i = 0; i < target.size(); ++i) {
+    const vec *S = qp + target.code(i) * slen;
+    vec e, h, t, f = zero, mx = zero;
+    h = v_shl_u8(v_load(H0 + slen - 1)); // H(i-1,-1)
+    for (j = 0; j < slen; ++j) {
+      h = v_subs_u8(v_adds_u8(h, v_load(S + j)), shift);
+      e = v_load(E + j);
+      h = v_max_u8(h, e);
+      h = v_max_u8(h, f);
+      mx = v_max_u8(mx, h);
+      v_store(H1 + j, h);
+      t = v_subs_u8(h, gap);
+      e = v_max_u8(v_subs_u8(e, gap), t);
+      v_store(E + j, e);
+      f = v_max_u8(v_subs_u8(f, gap), t);
+      h = v_load(H0 + j);
+    }
+    // lazy-F: propagate F across segment boundaries until it can no longer
+    // raise any H
+    bool done = false;
+    for (k = 0; !done && k < lanes_u8; ++k) {
+      f = v_shl_u8(f);
+      for (j = 0; j < slen; ++j) {
+        h = v_max_u8(v_load(H1 + j), f);
+        v_store(H1 + j, h);
+        h = v_subs_u8(h, gap);
+        f = v_subs_u8(f, gap);
+        if (!v_any_gt_u8(f, h)) {
+          done = true;
+          break;
+        }
+      }
+    }
+    imax = v_hmax_u8(mx);
+    if (imax > gmax) {
+      gmax = imax;
+      te = i;
+      for (j = 0; j < slen; ++j)
+        v_store(Hmax + j, v_load(H1 + j));
+      if (gmax + p.shift >= 255)
+        return false;
+    }
+    tmp = H1; H1 = H0; H0 = tmp;
+  }
+
+  max_score = gmax;
+  target_end = query_end = 0;
+  if (gmax > 0) {
+    const unsigned char *t = reinterpret_cast<const unsigned char*>(Hmax);
+    size_t pos, best = slen * lanes_u8;
+    for (k = 0; k < slen * lanes_u8; ++k)
+      if (t[k] == gmax && (pos = k / lanes_u8 + (k % lanes_u8) * slen) < best)
+        best = pos;
+    target_end = te + 1;
+    query_end = best + 1;
+  }
+  return true;
+}
+
+// vec_bytes/2 lanes of signed 16 bit scores, saturates at INT16_MAX
+static bool
+align_i16(StripedProfile &p, const PackedSequence &target,
+          size_t &target_end, size_t &query_end, int &max_score) {
+  StripedProfile::Layout &l = p.i16;
+  const size_t slen = l.slen;
+  vec *qp = reinterpret_cast<vec*>(l.base());
+  vec *H0 = qp + slen * nt4_size, *H1 = H0 + slen,
+      *E = H1 + slen, *Hmax = E + slen, *tmp;
+  const vec zero = v_zero(), gap = v_set1_i16(alignment::sg);
+  int gmax = 0, imax;
+  size_t te = 0, i, j, k;
+
+  for (j = 0; j < slen; ++j) {
+    v_store(E + j, zero);
+    v_store(H0 + j, zero);
+    v_store(Hmax + j, zero);
+  }
+  for (i = 0; i < target.size(); ++i) {
+    const vec *S = qp + target.code(i) * slen;
+    vec e, h, t, f = zero, mx = zero;
+    h = v_shl_i16(v_load(H0 + slen - 1));
+    for (j = 0; j < slen; ++j) {
+      h = v_adds_i16(h, v_load(S + j));
+      e = v_load(E + j);
+      h = v_max_i16(h, e);
+      h = v_max_i16(h, f);
+      mx = v_max_i16(mx, h);
+      v_store(H1 + j, h);
+      t = v_subs_u16(h, gap);
+      e = v_max_i16(v_subs_u16(e, gap), t);
+      v_store(E + j, e);
+      f = v_max_i16(v_subs_u16(f, gap), t);
+      h = v_load(H0 + j);
+    }
+    bool done = false;
+    for (k = 0; !done && k < lanes_i16; ++k) {
+      f = v_shl_i16(f);
+      for (j = 0; j < slen; ++j) {
+        h = v_max_i16(v_load(H1 + j), f);
+        v_store(H1 + j, h);
+        h = v_subs_u16(h, gap);
+        f = v_subs_u16(f, gap);
+        if (!v_any_gt_i16(f, h)) {
+          done = true;
+          break;
+        }
+      }
+    }
+    imax = v_hmax_i16(mx);
+    if (imax > gmax) {
+      gmax = imax;
+      te = i;
+      for (j = 0; j < slen; ++j)
+        v_store(Hmax + j, v_load(H1 + j));
+      if (gmax + alignment::sa >= INT16_MAX)
+        return false;
+    }
+    tmp = H1; H1 = H0; H0 = tmp;
+  }
+
+  max_score = gmax;
+  target_end = query_end = 0;
+  if (gmax > 0) {
+    const int16_t *t = reinterpret_cast<const int16_t*>(Hmax);
+    size_t pos, best = slen * lanes_i16;
+    for (k = 0; k < slen * lanes_i16; ++k)
+      if (t[k] == gmax && (pos = k / lanes_i16 + (k % lanes_i16) * slen) < best)
+        best = pos;
+    target_end = te + 1;
+    query_end = best + 1;
+  }
+  return true;
+}